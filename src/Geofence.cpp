@@ -15,11 +15,865 @@
  */
 
 #include "Geofence.h"
+#include <algorithm>
 #include <math.h>
+#include <string.h>
 
 
 constexpr double EARTH_RADIUS = 6371.0; /*!< Earth radius in units of kilometers */
 
+#if GEOFENCE_USE_FIXED_POINT
+constexpr double E7 = 1e7;
+constexpr int64_t E7_360 = 3600000000LL;
+constexpr float RAD_PER_E7 = (float)(0.01745329251994 / E7);
+constexpr float METERS_PER_E7 = (float)(0.01745329251994 / E7 * EARTH_RADIUS * 1000.0);
+#endif
+
+constexpr double BOX_MARGIN = 1e-4;    /*!< Degrees, covers the float rounding of box and point */
+constexpr double CIRCLE_BOX_MAX_RADIUS = 100000.0; /*!< Meters, larger circles have no bounding box */
+constexpr int CORRIDOR_LEAF_SEGMENTS = GEOFENCE_CORRIDOR_LEAF_SEGMENTS;
+constexpr double CONVEX_EPSILON = 1e-12;    /*!< Degrees, convex polygon decisions closer than this are ray cast */
+constexpr double CONVEX_MAX_EXTENT = 90.0;  /*!< Degrees, keeps the fixed-point convex test within 64 bits */
+constexpr int SIMPLIFY_ATTEMPTS = 4;    /*!< Halvings of the tolerance to keep a simplified polygon simple */
+constexpr int CORE_GRID = 6;            /*!< Polygon cores are grown from a grid of this many points per axis */
+constexpr int CORE_SEARCH_STEPS = 12;   /*!< Binary search steps for each side of a polygon core */
+constexpr int POINT_READ_ATTEMPTS = 4;  /*!< Copies of the latest point tried while it is being written */
+#if GEOFENCE_USE_FIXED_POINT
+constexpr double CORE_MARGIN = 2.0;     /*!< E7 units a polygon core keeps from the edges */
+#else
+constexpr double CORE_MARGIN = 1e-9;    /*!< Degrees a polygon core keeps from the edges */
+#endif
+constexpr float EMPTY_BOX = 1e9f;    /*!< Box that contains no point: min EMPTY_BOX, max -EMPTY_BOX */
+constexpr int ZONE_INDEX_LEAF_SIZE = 4;
+constexpr float METERS_PER_DEGREE = (float)(0.01745329251994 * EARTH_RADIUS * 1000.0);
+
+// GeofenceZoneHot event flags of the event types in GEOFENCE_ENABLED_EVENTS
+constexpr uint8_t ENABLED_EVENT_FLAGS =
+    (GeofenceEventEnabled(GeofenceEventType::INSIDE) ? GeofenceZoneHot::INSIDE_EVENT : 0) |
+    (GeofenceEventEnabled(GeofenceEventType::OUTSIDE) ? GeofenceZoneHot::OUTSIDE_EVENT : 0) |
+    (GeofenceEventEnabled(GeofenceEventType::ENTER) ? GeofenceZoneHot::ENTER_EVENT : 0) |
+    (GeofenceEventEnabled(GeofenceEventType::EXIT) ? GeofenceZoneHot::EXIT_EVENT : 0);
+
+constexpr uint16_t SNAPSHOT_MAGIC = 0x5A47;    /*!< "GZ" */
+constexpr uint8_t SNAPSHOT_FORMAT = 2;
+constexpr size_t SNAPSHOT_HEADER_SIZE = 16;
+constexpr size_t SNAPSHOT_RECORD_SIZE = 10;
+constexpr uint32_t SNAPSHOT_ELAPSED_MAX = 0xFFFFFF;    /*!< 24 bits of 100 ms */
+
+namespace {
+
+uint32_t VerificationMs(const GeofenceZoneHot& hot) {
+#if GEOFENCE_ENABLE_VERIFICATION
+    return hot.verification_ms;
+#else
+    (void)hot;
+    return 0;
+#endif
+}
+
+// Nibble table CRC-32 (IEEE 802.3), small enough for flash constrained targets
+uint32_t Crc32(const void* data, size_t size, uint32_t crc = 0) {
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+        0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+        0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+    };
+    auto p = (const uint8_t*)data;
+    crc = ~crc;
+    while(size--) {
+        crc = table[(crc ^ *p) & 0x0F] ^ (crc >> 4);
+        crc = table[(crc ^ (*p >> 4)) & 0x0F] ^ (crc >> 4);
+        p++;
+    }
+    return ~crc;
+}
+
+void PutLe(uint8_t* p, uint32_t value, int bytes) {
+    for(int i = 0; i < bytes; i++) {
+        p[i] = (uint8_t)(value >> (i * 8));
+    }
+}
+
+uint32_t GetLe(const uint8_t* p, int bytes) {
+    uint32_t value = 0;
+    for(int i = 0; i < bytes; i++) {
+        value |= (uint32_t)p[i] << (i * 8);
+    }
+    return value;
+}
+
+// Number of zone records of a valid snapshot, or SYSTEM_ERROR_BAD_DATA
+int CheckSnapshot(const uint8_t* buffer, size_t size) {
+    if(size < SNAPSHOT_HEADER_SIZE ||
+            GetLe(buffer, 2) != SNAPSHOT_MAGIC ||
+                buffer[2] != SNAPSHOT_FORMAT) {
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+    int count = (int)GetLe(buffer + 8, 2);
+    size_t snapshot_size = SNAPSHOT_HEADER_SIZE + count * SNAPSHOT_RECORD_SIZE;
+    if(size < snapshot_size) {
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+    uint32_t crc = Crc32(buffer, 12);
+    crc = Crc32(buffer + SNAPSHOT_HEADER_SIZE,
+        snapshot_size - SNAPSHOT_HEADER_SIZE, crc);
+    if(crc != GetLe(buffer + 12, 4)) {
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+    return count;
+}
+
+// Squared distance from the origin to the segment a-b
+template<typename T>
+T SegmentDistanceSq(T ax, T ay, T bx, T by) {
+    T dx = bx - ax;
+    T dy = by - ay;
+    T length_sq = dx * dx + dy * dy;
+    T t = (length_sq > T(0)) ? -(ax * dx + ay * dy) / length_sq : T(0);
+    t = std::max(T(0), std::min(T(1), t));
+    T x = ax + t * dx;
+    T y = ay + t * dy;
+    return x * x + y * y;
+}
+
+// Fractions t in [0, 1] where the segment a + t (b - a) crosses the circle
+// of radius r around the origin
+template<typename T>
+int SegmentCircleCrossings(T ax, T ay, T bx, T by, T r, float& first, float& last) {
+    T dx = bx - ax;
+    T dy = by - ay;
+    T qa = dx * dx + dy * dy;
+    T qb = T(2) * (ax * dx + ay * dy);
+    T qc = ax * ax + ay * ay - r * r;
+    T discriminant = qb * qb - T(4) * qa * qc;
+    if(qa <= T(0) || discriminant <= T(0)) {
+        return 0;
+    }
+    T root = sqrt(discriminant);
+    T t1 = (-qb - root) / (T(2) * qa);
+    T t2 = (-qb + root) / (T(2) * qa);
+    int count = 0;
+    for(T t : {t1, t2}) {
+        if(t >= T(0) && t <= T(1)) {
+            last = (float)t;
+            if(!count++) {
+                first = last;
+            }
+        }
+    }
+    return count;
+}
+
+// Crossing of the segment from the origin to d with the edge from c to c + e
+template<typename T>
+void AddEdgeCrossing(T dx, T dy, T cx, T cy, T ex, T ey,
+                int& count, float& first, float& last) {
+    T denominator = dx * ey - dy * ex;
+    if(denominator == T(0)) {
+        return;
+    }
+    T t = (cx * ey - cy * ex) / denominator;
+    T u = (cx * dy - cy * dx) / denominator;
+    // Half open edges so a crossing through a vertex is counted once
+    if(t < T(0) || t > T(1) || u < T(0) || u >= T(1)) {
+        return;
+    }
+    if(!count++) {
+        first = last = (float)t;
+    }
+    else {
+        first = std::min(first, (float)t);
+        last = std::max(last, (float)t);
+    }
+}
+
+// Crossings of the segment from a to b with the edges of the rectangle of
+// half width w around x = 0 from y = min_y to max_y
+template<typename T>
+int SegmentRectangleCrossings(T ax, T ay, T bx, T by, T w, T min_y, T max_y,
+                float& first, float& last) {
+    const T x[4] = {-w, w, w, -w};
+    const T y[4] = {min_y, min_y, max_y, max_y};
+    int count = 0;
+    for(int i = 0, j = 3; i < 4; j = i++) {
+        AddEdgeCrossing<T>(bx - ax, by - ay, x[j] - ax, y[j] - ay,
+            x[i] - x[j], y[i] - y[j], count, first, last);
+    }
+    return count;
+}
+
+// Lower bound of the distance in meters from a point to a box, negative
+// infinity if the point is inside
+template<typename Box>
+float BoxDistanceBound(const Box& box, float lat, float lon) {
+    float dlat = std::max(std::max(box.min_lat - lat, lat - box.max_lat), 0.0f);
+    float dlon = 360.0f;
+    for(float wrapped : {lon, lon + 360.0f, lon - 360.0f}) {
+        dlon = std::min(dlon, std::max(std::max(box.min_lon - wrapped,
+            wrapped - box.max_lon), 0.0f));
+    }
+    if(dlat == 0.0f && dlon == 0.0f) {
+        return -HUGE_VALF;
+    }
+    // Degrees of longitude are shortest at the most polar latitude
+    float polar = std::min(std::max(std::max(fabsf(box.min_lat), fabsf(box.max_lat)),
+        fabsf(lat)), 90.0f);
+    dlon *= cosf(polar * (float)(0.01745329251994));
+    return 0.99f * METERS_PER_DEGREE * sqrtf(dlat * dlat + dlon * dlon);
+}
+
+#if GEOFENCE_ENABLE_POLYGON
+// Side of the point from the line a-b with longitude as x: 1 left, -1 right
+// and 0 within epsilon degrees (scaled by the edge length), where rounding
+// could decide it. Exact for E7 vertices with epsilon 0.
+template<typename T, typename Vertex>
+int PointSide(const Vertex& a, const Vertex& b, T lat, T lon, T epsilon) {
+    T dlat = (T)b.lat - a.lat;
+    T dlon = (T)b.lon - a.lon;
+    T side = dlon * (lat - a.lat) - dlat * (lon - a.lon);
+    T tolerance = epsilon * ((dlat < T(0) ? -dlat : dlat) + (dlon < T(0) ? -dlon : dlon));
+    return (side > tolerance) ? 1 : (side < -tolerance) ? -1 : 0;
+}
+
+// 1 or -1 for a strictly convex polygon wound counterclockwise or clockwise,
+// 0 otherwise. Turns within epsilon of straight are not convex, and only
+// polygons whose edge directions change sign twice in each axis turn around
+// once, which rules out self intersecting stars.
+template<typename T, typename Vertex>
+int8_t ConvexOrientation(const Vertex* points, int count, T epsilon) {
+    if(count < 3) {
+        return 0;
+    }
+    int orientation = 0, lat_changes = 0, lon_changes = 0;
+    T last_dlat = T(0), last_dlon = T(0);
+    for(int i = 0; i < count * 2; i++) {
+        const Vertex& a = points[i % count];
+        const Vertex& b = points[(i + 1) % count];
+        if(i < count) {
+            const Vertex& c = points[(i + 2) % count];
+            int turn = PointSide(a, b, (T)c.lat, (T)c.lon, epsilon);
+            if(!turn || (orientation && turn != orientation)) {
+                return 0;
+            }
+            orientation = turn;
+        }
+        // First lap finds the direction of the last edge
+        T dlat = (T)b.lat - a.lat;
+        T dlon = (T)b.lon - a.lon;
+        if(dlat != T(0)) {
+            lat_changes += (i >= count && last_dlat != T(0) && (dlat < T(0)) != (last_dlat < T(0)));
+            last_dlat = dlat;
+        }
+        if(dlon != T(0)) {
+            lon_changes += (i >= count && last_dlon != T(0) && (dlon < T(0)) != (last_dlon < T(0)));
+            last_dlon = dlon;
+        }
+    }
+    return (lat_changes <= 2 && lon_changes <= 2) ? orientation : 0;
+}
+
+// Containment in a convex polygon in O(log n): a binary search finds the
+// triangle of the fan around the first vertex the point is in, then only the
+// polygon edge of that triangle is tested. 1 inside, 0 outside, -1 if one
+// of the sides is within epsilon and ray casting has to decide.
+template<typename T, typename Vertex>
+int PointInConvexPolygon(const Vertex* points, int count, int orientation,
+                T lat, T lon, T epsilon) {
+    auto side = [&](int a, int b) {
+        return orientation * PointSide(points[a], points[b], lat, lon, epsilon);
+    };
+    int first = side(0, 1);
+    int last = side(0, count - 1);
+    if(first < 0 || last > 0) {
+        return 0;
+    }
+    if(!first || !last) {
+        return -1;
+    }
+    int low = 1, high = count - 1;
+    while(high - low > 1) {
+        int mid = (low + high) / 2;
+        int diagonal = side(0, mid);
+        if(!diagonal) {
+            return -1;
+        }
+        (diagonal > 0 ? low : high) = mid;
+    }
+    int edge = side(low, high);
+    return edge ? (edge > 0) : -1;
+}
+
+// Douglas-Peucker on a ring: marks the vertices to keep, starting from the
+// first vertex and the one furthest from it, and returns their number.
+// Refines all spans between kept vertices in each round instead of
+// recursing, so it needs no memory of its own.
+int SimplifyRing(const Vector<GeofenceVertex>& points, double tolerance,
+                Vector<uint8_t>& keep) {
+    int count = points.size();
+    int far = 0;
+    double far_sq = 0.0;
+    for(int i = 0; i < count; i++) {
+        keep[i] = 0;
+        double dlat = points[i].lat - points[0].lat;
+        double dlon = points[i].lon - points[0].lon;
+        if(dlat * dlat + dlon * dlon > far_sq) {
+            far_sq = dlat * dlat + dlon * dlon;
+            far = i;
+        }
+    }
+    keep[0] = 1;
+    keep[far] = 1;
+    int kept = (far > 0) ? 2 : 1;
+    double tolerance_sq = tolerance * tolerance;
+    for(bool split = true; split;) {
+        split = false;
+        for(int start = 0; start < count;) {
+            int end = start + 1;
+            while(!keep[end % count]) {
+                end++;
+            }
+            auto& a = points[start];
+            auto& b = points[end % count];
+            int worst = -1;
+            double worst_sq = tolerance_sq;
+            for(int i = start + 1; i < end; i++) {
+                double distance_sq = SegmentDistanceSq(a.lat - points[i].lat,
+                    a.lon - points[i].lon, b.lat - points[i].lat, b.lon - points[i].lon);
+                if(distance_sq > worst_sq) {
+                    worst_sq = distance_sq;
+                    worst = i;
+                }
+            }
+            if(worst >= 0) {
+                keep[worst] = 1;
+                kept++;
+                split = true;
+            }
+            start = end;
+        }
+    }
+    return kept;
+}
+
+// Whether two segments intersect or touch
+bool SegmentsTouch(const GeofenceVertex& a, const GeofenceVertex& b,
+                const GeofenceVertex& c, const GeofenceVertex& d) {
+    if(std::max(a.lat, b.lat) < std::min(c.lat, d.lat) ||
+            std::max(c.lat, d.lat) < std::min(a.lat, b.lat) ||
+            std::max(a.lon, b.lon) < std::min(c.lon, d.lon) ||
+            std::max(c.lon, d.lon) < std::min(a.lon, b.lon)) {
+        return false;
+    }
+    auto orientation = [](const GeofenceVertex& p, const GeofenceVertex& q,
+                    const GeofenceVertex& r) {
+        double side = (q.lon - p.lon) * (r.lat - p.lat) - (q.lat - p.lat) * (r.lon - p.lon);
+        return (side > 0.0) - (side < 0.0);
+    };
+    return orientation(a, b, c) * orientation(a, b, d) <= 0 &&
+        orientation(c, d, a) * orientation(c, d, b) <= 0;
+}
+
+// Whether no two edges of the ring touch other than neighbors at their
+// shared vertex, O(n^2)
+bool IsSimpleRing(const Vector<GeofenceVertex>& ring) {
+    int count = ring.size();
+    for(int i = 0; i < count; i++) {
+        for(int j = i + 2; j < count; j++) {
+            if((j + 1) % count == i) {
+                continue;
+            }
+            if(SegmentsTouch(ring[i], ring[(i + 1) % count],
+                    ring[j], ring[(j + 1) % count])) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Whether the point is within the tolerance of an edge of the polygon, with
+// longitude differences multiplied by scale
+template<typename Real, typename T, typename Vertex>
+bool NearPolygonEdge(const Vertex* points, int count, T lat, T lon,
+                Real scale, Real tolerance) {
+    Real tolerance_sq = tolerance * tolerance;
+    for(int i = 0, j = count - 1; i < count; j = i++) {
+        Real distance_sq = SegmentDistanceSq(
+            (Real)((T)points[j].lat - lat), (Real)((T)points[j].lon - lon) * scale,
+            (Real)((T)points[i].lat - lat), (Real)((T)points[i].lon - lon) * scale);
+        if(distance_sq <= tolerance_sq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#if GEOFENCE_POLYGON_CORES
+struct CoreBox {
+    double min_lat;
+    double max_lat;
+    double min_lon;
+    double max_lon;
+};
+
+// Whether any point of the segment a-b is in the closed box, Liang-Barsky
+bool SegmentTouchesBox(const GeofenceVertex& a, const GeofenceVertex& b,
+                const CoreBox& box) {
+    double t0 = 0.0, t1 = 1.0;
+    const double start[2] = {a.lat, a.lon};
+    const double delta[2] = {b.lat - a.lat, b.lon - a.lon};
+    const double low[2] = {box.min_lat, box.min_lon};
+    const double high[2] = {box.max_lat, box.max_lon};
+    for(int axis = 0; axis < 2; axis++) {
+        if(delta[axis] == 0.0) {
+            if(start[axis] < low[axis] || start[axis] > high[axis]) {
+                return false;
+            }
+            continue;
+        }
+        double ta = (low[axis] - start[axis]) / delta[axis];
+        double tb = (high[axis] - start[axis]) / delta[axis];
+        t0 = std::max(t0, std::min(ta, tb));
+        t1 = std::min(t1, std::max(ta, tb));
+        if(t0 > t1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A box with its center inside the polygon and clear of every edge is
+// entirely inside
+bool BoxClearOfEdges(const Vector<GeofenceVertex>& points, const CoreBox& box) {
+    for(int i = 0, j = points.size() - 1; i < points.size(); j = i++) {
+        if(SegmentTouchesBox(points[j], points[i], box)) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif // GEOFENCE_POLYGON_CORES
+#endif // GEOFENCE_ENABLE_POLYGON
+
+#if GEOFENCE_USE_FIXED_POINT
+/*
+* Haversine term a = sin(df / 2)^2 + cos(las) * cos(lae) * sin(dfi / 2)^2 of
+* E7 offsets from a fixed-point circle center
+*
+* Within the circle limits df and dfi are small enough for sin(x) = x - x^3/6
+* and cos(lae) = cos(las) * (1 - df^2/2) - sin(las) * df
+*/
+float HaversineTermFixed(const GeofenceZoneGeometry& geometry,
+                int32_t dlat, int32_t dlon) {
+    float df = (float)dlat * RAD_PER_E7;
+    float half_df = df * 0.5f;
+    float half_dfi = (float)dlon * RAD_PER_E7 * 0.5f;
+    float sin_df = half_df - half_df * half_df * half_df * (1.0f / 6.0f);
+    float sin_dfi = half_dfi - half_dfi * half_dfi * half_dfi * (1.0f / 6.0f);
+    float cos_lae = geometry.cos_lat * (1.0f - df * df * 0.5f) -
+        geometry.sin_lat * df;
+    return sin_df * sin_df +
+        geometry.cos_lat * cos_lae * sin_dfi * sin_dfi;
+}
+
+int32_t ToE7(double degrees) {
+    return (int32_t)lround(degrees * E7);
+}
+
+// Longitude difference wrapped to +/-180 degrees
+int32_t WrapLonE7(int64_t lon) {
+    if(lon > E7_360 / 2) {
+        lon -= E7_360;
+    }
+    else if(lon < -E7_360 / 2) {
+        lon += E7_360;
+    }
+    return (int32_t)lon;
+}
+#endif
+
+} // namespace
+
+#if GEOFENCE_ENABLE_VERIFICATION
+constexpr uint16_t GeofenceTimerWheel::NONE;
+
+GeofenceTimerWheel::GeofenceTimerWheel(int count) : _time(0) {
+    std::fill(std::begin(_heads), std::end(_heads), NONE);
+    std::fill(std::begin(_occupied), std::end(_occupied), 0);
+    Resize(count);
+}
+
+bool GeofenceTimerWheel::Resize(int count) {
+    int size = _timers.size();
+    if(count <= size) {
+        return true;
+    }
+    if(!_timers.resize(count)) {
+        return false;
+    }
+    for(int i = size; i < count; i++) {
+        _timers.at(i) = {0, NONE, NONE, NONE};
+    }
+    return true;
+}
+
+bool GeofenceTimerWheel::Schedule(int id, uint64_t deadline) {
+    Cancel(id);
+    if(deadline <= _time) {
+        return false;
+    }
+    _timers.at(id).deadline = deadline;
+    Link(id, Bucket(deadline));
+    return true;
+}
+
+void GeofenceTimerWheel::Cancel(int id) {
+    if(IsScheduled(id)) {
+        Unlink(id);
+    }
+}
+
+int GeofenceTimerWheel::Advance(uint64_t now, Vector<uint16_t>* expired_ids) {
+    int expired = 0;
+    while(_time < now) {
+        // Jump to the start of the next slot holding timers, timers in lower
+        // levels are always due before those in higher levels
+        uint64_t next = now;
+        for(int level = 0; level < LEVELS; level++) {
+            uint64_t start;
+            if(NextBucket(level, start) >= 0) {
+                next = std::min(next, start);
+                break;
+            }
+        }
+        _time = next;
+
+        // Move the timers of slots starting now down, then expire the first
+        // level slot
+        for(int level = LEVELS - 1; level > 0; level--) {
+            int shift = SLOT_BITS * level;
+            if(_time & ((1ULL << shift) - 1)) {
+                continue;
+            }
+            uint16_t id = Detach(level * SLOTS + (int)((_time >> shift) & (SLOTS - 1)));
+            while(id != NONE) {
+                uint16_t next_id = _timers.at(id).next;
+                Link(id, Bucket(_timers.at(id).deadline));
+                id = next_id;
+            }
+        }
+        uint16_t id = Detach((int)(_time & (SLOTS - 1)));
+        while(id != NONE) {
+            _timers.at(id).bucket = NONE;
+            if(expired_ids) {
+                expired_ids->append(id);
+            }
+            id = _timers.at(id).next;
+            expired++;
+        }
+    }
+    return expired;
+}
+
+bool GeofenceTimerWheel::NextDeadline(uint64_t& deadline) const {
+    for(int level = 0; level < LEVELS; level++) {
+        uint64_t start;
+        int bucket = NextBucket(level, start);
+        if(bucket < 0) {
+            continue;
+        }
+        deadline = UINT64_MAX;
+        for(uint16_t id = _heads[bucket]; id != NONE; id = _timers.at(id).next) {
+            deadline = std::min(deadline, _timers.at(id).deadline);
+        }
+        return true;
+    }
+    return false;
+}
+
+int GeofenceTimerWheel::Bucket(uint64_t deadline) const {
+    // The lowest level above which the deadline and the current time agree
+    uint64_t diff = deadline ^ _time;
+    int level = 0;
+    while(level < LEVELS - 1 && (diff >> (SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+    return level * SLOTS + (int)((deadline >> (SLOT_BITS * level)) & (SLOTS - 1));
+}
+
+int GeofenceTimerWheel::NextBucket(int level, uint64_t& start) const {
+    if(!_occupied[level]) {
+        return -1;
+    }
+    int shift = SLOT_BITS * level;
+    int index = (int)((_time >> shift) & (SLOTS - 1));
+    uint64_t later = (index < SLOTS - 1) ?
+        _occupied[level] & (~0ULL << (index + 1)) : 0;
+    uint64_t base = (_time >> (shift + SLOT_BITS)) << (shift + SLOT_BITS);
+    if(!later) {
+        if(level < LEVELS - 1) {
+            return -1;
+        }
+        // Only the top level wraps around
+        later = _occupied[level];
+        base += 1ULL << (shift + SLOT_BITS);
+    }
+    int slot = __builtin_ctzll(later);
+    start = base | ((uint64_t)slot << shift);
+    return level * SLOTS + slot;
+}
+
+void GeofenceTimerWheel::Link(int id, int bucket) {
+    auto& timer = _timers.at(id);
+    timer.bucket = (uint16_t)bucket;
+    timer.prev = NONE;
+    timer.next = _heads[bucket];
+    if(timer.next != NONE) {
+        _timers.at(timer.next).prev = (uint16_t)id;
+    }
+    _heads[bucket] = (uint16_t)id;
+    _occupied[bucket / SLOTS] |= 1ULL << (bucket % SLOTS);
+}
+
+void GeofenceTimerWheel::Unlink(int id) {
+    auto& timer = _timers.at(id);
+    if(timer.prev != NONE) {
+        _timers.at(timer.prev).next = timer.next;
+    }
+    else {
+        _heads[timer.bucket] = timer.next;
+        if(timer.next == NONE) {
+            _occupied[timer.bucket / SLOTS] &= ~(1ULL << (timer.bucket % SLOTS));
+        }
+    }
+    if(timer.next != NONE) {
+        _timers.at(timer.next).prev = timer.prev;
+    }
+    timer.bucket = NONE;
+}
+
+uint16_t GeofenceTimerWheel::Detach(int bucket) {
+    uint16_t head = _heads[bucket];
+    _heads[bucket] = NONE;
+    _occupied[bucket / SLOTS] &= ~(1ULL << (bucket % SLOTS));
+    return head;
+}
+#endif // GEOFENCE_ENABLE_VERIFICATION
+
+constexpr int GeofencePointSeqlock::WORDS;
+
+GeofencePointSeqlock::GeofencePointSeqlock() : _sequence(0) {
+    for(auto& word : _words) {
+        word.store(0, std::memory_order_relaxed);
+    }
+}
+
+void GeofencePointSeqlock::Publish(const PointData& point, uint32_t arrival_us) {
+    Payload payload;
+    payload.point = point;
+    payload.arrival_us = arrival_us;
+    uint32_t words[WORDS] = {};
+    memcpy(words, &payload, sizeof(payload));
+
+    uint32_t sequence = _sequence.load(std::memory_order_relaxed);
+    _sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for(int i = 0; i < WORDS; i++) {
+        _words[i].store(words[i], std::memory_order_relaxed);
+    }
+    _sequence.store(sequence + 2, std::memory_order_release);
+}
+
+bool GeofencePointSeqlock::Read(PointData& point, uint32_t& arrival_us,
+                uint32_t& sequence, int attempts) const {
+    for(int attempt = 0; attempt < attempts; attempt++) {
+        uint32_t before = _sequence.load(std::memory_order_acquire);
+        if(before & 1) {
+            continue;
+        }
+        uint32_t words[WORDS];
+        for(int i = 0; i < WORDS; i++) {
+            words[i] = _words[i].load(std::memory_order_relaxed);
+        }
+        // A write that overlapped the copy has changed the sequence
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(_sequence.load(std::memory_order_relaxed) != before) {
+            continue;
+        }
+        Payload payload;
+        memcpy(&payload, words, sizeof(payload));
+        point = payload.point;
+        arrival_us = payload.arrival_us;
+        sequence = before;
+        return true;
+    }
+    return false;
+}
+
+constexpr int GeofenceLatencyHistogram::SUB_BUCKETS;
+constexpr int GeofenceLatencyHistogram::BUCKETS;
+
+int GeofenceLatencyHistogram::BucketOf(uint32_t us) {
+    if(us < SUB_BUCKETS) {
+        return us;
+    }
+    int shift = 31 - __builtin_clz(us) - GEOFENCE_LATENCY_SUB_BUCKET_BITS;
+    return shift * SUB_BUCKETS + (us >> shift);
+}
+
+uint32_t GeofenceLatencyHistogram::BucketUpperBound(int bucket) {
+    if(bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / SUB_BUCKETS - 1;
+    uint64_t mantissa = bucket % SUB_BUCKETS + SUB_BUCKETS;
+    return (uint32_t)(((mantissa + 1) << shift) - 1);
+}
+
+void GeofenceLatencyHistogram::Record(uint32_t us) {
+    _counts[BucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+    uint32_t max = _max.load(std::memory_order_relaxed);
+    while(us > max && !_max.compare_exchange_weak(max, us,
+            std::memory_order_relaxed)) {
+    }
+}
+
+void GeofenceLatencyHistogram::Reset() {
+    for(auto& count : _counts) {
+        count.store(0, std::memory_order_relaxed);
+    }
+    _max.store(0, std::memory_order_relaxed);
+}
+
+uint32_t GeofenceLatencyHistogram::GetTotalCount() const {
+    uint32_t total = 0;
+    for(auto& count : _counts) {
+        total += count.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+uint32_t GeofenceLatencyHistogram::GetPercentile(double percentile) const {
+    uint32_t total = GetTotalCount();
+    if(!total) {
+        return 0;
+    }
+    // Rank of the percentile among the recorded latencies, at least the first
+    double rank = std::max(1.0, ceil(std::min(percentile, 100.0) / 100.0 * total));
+    uint32_t seen = 0;
+    for(int bucket = 0; bucket < BUCKETS; bucket++) {
+        seen += GetCount(bucket);
+        if(seen >= rank) {
+            return std::min(BucketUpperBound(bucket), GetMax());
+        }
+    }
+    return GetMax();
+}
+
+#if GEOFENCE_ENABLE_ASYNC
+GeofenceEventQueue::GeofenceEventQueue(GeofenceEventQueue&& other) :
+    _entries(std::move(other._entries)), _mask(other._mask),
+    _head(other._head.load()), _tail(other._tail.load()),
+    _dropped(other._dropped.load()), _max_pending(other._max_pending.load()) {
+}
+
+bool GeofenceEventQueue::Resize(int capacity) {
+    int size = 1;
+    while(size < capacity) {
+        size <<= 1;
+    }
+    _entries.clear();
+    if(!_entries.resize(size)) {
+        return false;
+    }
+    _mask = size - 1;
+    _head = 0;
+    _tail = 0;
+    _dropped = 0;
+    _max_pending = 0;
+    return true;
+}
+
+bool GeofenceEventQueue::Push(const CallbackContext& context,
+                const GeofenceEventCallback& callback,
+                bool measure, uint32_t due_us) {
+    uint32_t head = _head.load(std::memory_order_relaxed);
+    uint32_t pending = head - _tail.load(std::memory_order_acquire);
+    if(pending > _mask) {
+        _dropped.store(_dropped.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+        return false;
+    }
+    // The consumer is done with this entry once it has moved the tail past it
+    auto& entry = _entries.at(head & _mask);
+    entry.context = context;
+    entry.callback = callback;
+    entry.due_us = due_us;
+    entry.measure = measure;
+    _head.store(head + 1, std::memory_order_release);
+    if(pending + 1 > _max_pending.load(std::memory_order_relaxed)) {
+        _max_pending.store(pending + 1, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+int GeofenceEventQueue::Deliver(int max_events,
+                GeofenceLatencyHistogram* latency) {
+    uint32_t tail = _tail.load(std::memory_order_relaxed);
+    uint32_t head = _head.load(std::memory_order_acquire);
+    int delivered = 0;
+    while(tail != head && (!max_events || delivered < max_events)) {
+        auto& entry = _entries.at(tail & _mask);
+        if(latency && entry.measure) {
+            latency->Record(micros() - entry.due_us);
+        }
+        entry.callback(entry.context);
+        _tail.store(++tail, std::memory_order_release);
+        delivered++;
+    }
+    return delivered;
+}
+
+void GeofenceEventQueue::AddStats(GeofenceAsyncStats& stats) const {
+    uint32_t tail = _tail.load(std::memory_order_acquire);
+    stats.queued += _head.load(std::memory_order_acquire);
+    stats.delivered += tail;
+    stats.dropped += _dropped.load(std::memory_order_relaxed);
+    stats.max_pending = std::max(stats.max_pending,
+        _max_pending.load(std::memory_order_relaxed));
+}
+#endif // GEOFENCE_ENABLE_ASYNC
+
+Geofence::Geofence(int num_of_zones) : GeofenceZones(num_of_zones),
+    ZoneHot(num_of_zones), GeofenceZoneStates(num_of_zones), ZoneGeometry(num_of_zones),
+    ZoneSlotIndex(num_of_zones),
+#if GEOFENCE_ENABLE_VERTICES
+    _released_vertices(0),
+#endif
+    _index_dirty(true), _zones_dirty(true),
+    _slots(num_of_zones),
+    _free_slot(-1),
+    _subscribers_dirty(true), _dispatching(false), _batch_pending(false),
+    _last_subscription_id(0), _point_sequence(0), _geofence_point(),
+    _have_previous_point(false), _crossing_detection(false),
+    _slice_next(0), _slice_max_zones(0), _slice_max_us(0),
+#if GEOFENCE_ENABLE_STATS
+    _pass_slices(0),
+    _pass_point_us(0), _pass_measured(false),
+    _dispatch_due_us(0), _dispatch_measured(false),
+#endif
+#if GEOFENCE_ENABLE_VERIFICATION
+    _verification_timers(num_of_zones),
+#endif
+    _event_driven(false), _evaluate_pending(true),
+    _maximumDop(GEOFENCE_MAXIMUM_DOP) {
+    for(int i = 0; i < num_of_zones; i++) {
+        _slots.at(i) = {i, -1, 1};
+        ZoneSlotIndex.at(i) = i;
+    }
+}
+
 void Geofence::init() {
     //clear out the previous geofence zone boundary states
     for(auto&& iter : GeofenceZoneStates) {
@@ -28,99 +882,1054 @@ void Geofence::init() {
 }
 
 void Geofence::loop() {
-    auto zone_index = 0;
-    for(auto zone : GeofenceZones) {
-        if(zone.enable) {
-            // If the current geocoordinate doesn't meet the DOP requirement then there
-            // is nothing to do
-            if (_geofence_point.hdop > _maximumDop) {
-                CallbackContext context;
-                context.event_type = GeofenceEventType::POOR_LOCATION;
-                context.index = zone_index;
-                for(auto callback : EventCallback) {
-                    callback(context);
+    uint32_t start = micros();
+    if(_event_driven) {
+        bool evaluate = _evaluate_pending || _zones_dirty || _slice_next ||
+            (_latest_point.GetSequence() != _point_sequence);
+#if GEOFENCE_ENABLE_VERIFICATION
+        // Zones the current pass has yet to reach are confirmed by it
+        ConfirmExpiredZones(evaluate ? _slice_next : ZoneHot.size());
+#endif
+        if(!evaluate) {
+            DeliverBatches();
+            return;
+        }
+    }
+#if GEOFENCE_ENABLE_VERIFICATION
+    else {
+        _verification_timers.Advance(System.millis());
+    }
+#endif
+
+    CompileDirtyZones();
+    if(!_slice_next) {
+        BeginPass();
+    }
+    if(_subscribers_dirty) {
+        BuildSubscriberLists();
+    }
+
+    // If the current geocoordinate doesn't meet the DOP requirement then there
+    // is nothing to do
+    bool poor_location = (_geofence_point.hdop > _maximumDop);
+    bool segment = _crossing_detection && _have_previous_point && !poor_location;
+#if GEOFENCE_ENABLE_STATS
+    // Events found by the first pass over a fix are due since it arrived
+    _dispatch_due_us = _pass_point_us;
+    _dispatch_measured = _pass_measured;
+#endif
+
+    int dense = _slice_next;
+    int evaluated = 0;
+    for(; dense < ZoneHot.size(); dense++) {
+        if(!(ZoneHot.at(dense).flags & GeofenceZoneHot::ENABLE)) {
+            continue;
+        }
+        if(evaluated && ((_slice_max_zones && evaluated >= _slice_max_zones) ||
+                (_slice_max_us && micros() - start >= _slice_max_us))) {
+            break;
+        }
+        EvaluateZone(dense, poor_location, segment);
+        evaluated++;
+    }
+
+#if GEOFENCE_ENABLE_STATS
+    _pass_slices++;
+#endif
+    _slice_next = (dense < ZoneHot.size()) ? dense : 0;
+    if(!_slice_next) {
+        EndPass();
+    }
+    DeliverBatches();
+#if GEOFENCE_ENABLE_STATS
+    _stats.slices++;
+    _stats.last_slice_us = micros() - start;
+    _stats.max_slice_us = std::max(_stats.max_slice_us, _stats.last_slice_us);
+#endif
+}
+
+void Geofence::BeginPass() {
+    _evaluate_pending = false;
+    // Snapshot the latest point once for the whole pass. If the writer keeps
+    // interfering, the previous point is evaluated again and the new one by
+    // the next pass.
+    PointData point;
+    uint32_t arrival_us, sequence;
+    bool new_point = _latest_point.Read(point, arrival_us, sequence,
+        POINT_READ_ATTEMPTS) && (sequence != _point_sequence);
+    if(new_point) {
+        _geofence_point = point;
+        _point_sequence = sequence;
+    }
+    _point_lat_f = (float)_geofence_point.lat;
+    _point_lon_f = (float)_geofence_point.lon;
+#if GEOFENCE_USE_FIXED_POINT
+    _point_lat_e7 = ToE7(_geofence_point.lat);
+    _point_lon_e7 = ToE7(_geofence_point.lon);
+#endif
+#if GEOFENCE_ENABLE_STATS
+    _pass_slices = 0;
+    if(new_point) {
+        _pass_point_us = arrival_us;
+    }
+    _pass_measured = new_point;
+#endif
+}
+
+void Geofence::EndPass() {
+    if(_geofence_point.hdop <= _maximumDop) {
+        _previous_point = _geofence_point;
+        _previous_lat_f = _point_lat_f;
+        _previous_lon_f = _point_lon_f;
+#if GEOFENCE_USE_FIXED_POINT
+        _previous_lat_e7 = _point_lat_e7;
+        _previous_lon_e7 = _point_lon_e7;
+#endif
+        _have_previous_point = true;
+    }
+#if GEOFENCE_ENABLE_STATS
+    _stats.passes++;
+    _stats.last_pass_slices = _pass_slices;
+    _stats.max_pass_slices = std::max(_stats.max_pass_slices, _pass_slices);
+#endif
+}
+
+void Geofence::InitContext(int dense, CallbackContext& context) const {
+    int zone_index = ZoneSlotIndex.at(dense);
+    context.index = zone_index;
+    context.handle = {(uint16_t)zone_index, _slots.at(zone_index).generation};
+    context.time = _geofence_point.gps_time;
+    context.distance = NAN;
+}
+
+void Geofence::EvaluateZone(int dense, bool poor_location, bool segment) {
+    auto& hot = ZoneHot.at(dense);
+    CallbackContext context;
+    InitContext(dense, context);
+
+    if (poor_location) {
+        if(GeofenceEventEnabled(GeofenceEventType::POOR_LOCATION)) {
+            context.event_type = GeofenceEventType::POOR_LOCATION;
+            DispatchEvent(dense, context);
+        }
+        return;
+    }
+
+    // Keep the circle distance if a subscriber wants it, other distances
+    // are computed when an event is dispatched
+    bool want_distance = ZoneEventMask.at(dense) & GEOFENCE_EVENT_DISTANCE;
+    bool in_box = IsInBoundingBox(hot);
+#if GEOFENCE_ENABLE_STATS
+    if(hot.shape == (uint8_t)GeofenceShapeType::POLYGONAL) {
+        _stats.polygon_tests++;
+        _stats.fast_rejects += !in_box;
+    }
+#endif
+    bool outside_geofence = !in_box ||
+        IsZoneOutside(hot, ZoneGeometry.at(dense),
+            want_distance ? &context.distance : nullptr);
+    auto prev_event = GeofenceZoneStates.at(dense).prev_event;
+
+    // Boundary crossings between the previous fix and this one, only
+    // needed for the ENTER and EXIT events they can change
+    float first = 0.0f, last = 0.0f;
+    int crossings = 0;
+    if(segment && !VerificationMs(hot) &&
+            (hot.flags & (GeofenceZoneHot::ENTER_EVENT | GeofenceZoneHot::EXIT_EVENT)) &&
+                (prev_event == GeofenceEventType::INSIDE ||
+                    prev_event == GeofenceEventType::OUTSIDE) &&
+                        IsSegmentInBoundingBox(hot)) {
+        crossings = FindSegmentCrossings(hot, ZoneGeometry.at(dense), first, last);
+    }
+    DispatchZoneEvents(dense, outside_geofence, context, crossings, first, last);
+}
+
+#if GEOFENCE_ENABLE_VERIFICATION
+void Geofence::ConfirmExpiredZones(int evaluated) {
+    _expired_timers.clear();
+    if(!_verification_timers.Advance(System.millis(), &_expired_timers)) {
+        return;
+    }
+    CompileDirtyZones();
+    if(_subscribers_dirty) {
+        BuildSubscriberLists();
+    }
+    for(auto slot : _expired_timers) {
+        int dense = _slots.at(slot).dense;
+        if(dense >= 0 && dense < evaluated) {
+            ConfirmZone(dense);
+        }
+    }
+}
+
+void Geofence::ConfirmZone(int dense) {
+    // Only the verification timer ran out, the zone is still where the last
+    // evaluated point put it
+    auto& hot = ZoneHot.at(dense);
+    if(!(hot.flags & GeofenceZoneHot::ENABLE) ||
+            _geofence_point.hdop > _maximumDop) {
+        return;
+    }
+    CallbackContext context;
+    InitContext(dense, context);
+    bool outside_geofence = GeofenceZoneStates.at(dense).pending_event ==
+        GeofenceEventType::OUTSIDE;
+#if GEOFENCE_ENABLE_STATS
+    // Due at the verification deadline rather than when the fix arrived
+    _dispatch_due_us = VerificationDeadlineUs(dense);
+    _dispatch_measured = true;
+#endif
+    DispatchZoneEvents(dense, outside_geofence, context, 0, 0.0f, 0.0f);
+}
+#endif // GEOFENCE_ENABLE_VERIFICATION
+
+void Geofence::DispatchZoneEvents(int dense, bool outside_geofence,
+                        CallbackContext& context, int crossings,
+                        float first, float last) {
+    auto& hot = ZoneHot.at(dense);
+    auto prev_event = GeofenceZoneStates.at(dense).prev_event;
+    // Constant mask, the code of disabled event types is left out
+    uint8_t flags = hot.flags & ENABLED_EVENT_FLAGS;
+    if(IsEventTriggered(outside_geofence, hot, dense)) {
+        //distance is outside geofence
+        if(outside_geofence) {
+            // Passed through the zone between the fixes
+            if(prev_event == GeofenceEventType::OUTSIDE && crossings >= 2) {
+                if(flags & GeofenceZoneHot::ENTER_EVENT) {
+                    context.event_type = GeofenceEventType::ENTER;
+                    context.time = CrossingTime(first);
+                    DispatchEvent(dense, context);
                 }
-                continue; // Go to next zone
-            }
-
-            bool outside_geofence =
-                (zone.shape_type == GeofenceShapeType::CIRCULAR) ?
-                    IsCircularGeofenceOutside(zone) :
-                        IsPolygonalGeofenceOutside(zone);
-            auto zone_state = GeofenceZoneStates.at(zone_index);
-            CallbackContext context;
-            if(IsEventTriggered(outside_geofence, zone, zone_index)) {
-                //distance is outside geofence
-                if(outside_geofence) {
-                    if(zone.outside_event) {
-                        context.event_type = GeofenceEventType::OUTSIDE;
-                        context.index = zone_index;
-                        for(auto callback : EventCallback) {
-                            callback(context);
-                        }
-                    }
-                    if(zone.exit_event) {
-                        if(zone_state.prev_event == GeofenceEventType::INSIDE) {
-                            context.event_type = GeofenceEventType::EXIT;
-                            context.index = zone_index;
-                            for(auto callback : EventCallback) {
-                                callback(context);
-                            }
-                        }
+                if(flags & GeofenceZoneHot::EXIT_EVENT) {
+                    context.event_type = GeofenceEventType::EXIT;
+                    context.time = CrossingTime(last);
+                    DispatchEvent(dense, context);
+                }
+                context.time = _geofence_point.gps_time;
+            }
+            if(flags & GeofenceZoneHot::OUTSIDE_EVENT) {
+                context.event_type = GeofenceEventType::OUTSIDE;
+                DispatchEvent(dense, context);
+            }
+            if(flags & GeofenceZoneHot::EXIT_EVENT) {
+                if(prev_event == GeofenceEventType::INSIDE) {
+                    context.event_type = GeofenceEventType::EXIT;
+                    context.time = (crossings) ? CrossingTime(first) :
+                        _geofence_point.gps_time;
+                    DispatchEvent(dense, context);
+                }
+            }
+            //Store the most recent event type for that zone
+            GeofenceZoneStates.at(dense).prev_event =
+                                        GeofenceEventType::OUTSIDE;
+        }
+        //distance is inside geofence
+        else {
+            // Left the zone and came back between the fixes
+            if(prev_event == GeofenceEventType::INSIDE && crossings >= 2) {
+                if(flags & GeofenceZoneHot::EXIT_EVENT) {
+                    context.event_type = GeofenceEventType::EXIT;
+                    context.time = CrossingTime(first);
+                    DispatchEvent(dense, context);
+                }
+                if(flags & GeofenceZoneHot::ENTER_EVENT) {
+                    context.event_type = GeofenceEventType::ENTER;
+                    context.time = CrossingTime(last);
+                    DispatchEvent(dense, context);
+                }
+                context.time = _geofence_point.gps_time;
+            }
+            if(flags & GeofenceZoneHot::INSIDE_EVENT) {
+                context.event_type = GeofenceEventType::INSIDE;
+                DispatchEvent(dense, context);
+            }
+            if(flags & GeofenceZoneHot::ENTER_EVENT) {
+                if(prev_event == GeofenceEventType::OUTSIDE) {
+                    context.event_type = GeofenceEventType::ENTER;
+                    context.time = (crossings) ? CrossingTime(last) :
+                        _geofence_point.gps_time;
+                    DispatchEvent(dense, context);
+                }
+            }
+            //Store the most recent event type for that zone
+            GeofenceZoneStates.at(dense).prev_event =
+                                        GeofenceEventType::INSIDE;
+        }
+    }
+}
+
+bool Geofence::AnyGeofenceEnabled() {
+    for(auto& iter : GeofenceZones) {
+        if(iter.enable) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int Geofence::SetZoneInfo(GeofenceZoneHandle handle,
+                        const ZoneInfo& zone_config) {
+    // The per zone subscriber lists are in use while a callback runs
+    if(_dispatching) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+    if(!IsValidZone(handle)) {
+        return SYSTEM_ERROR_NOT_FOUND;
+    }
+    if(!GeofenceShapeEnabled(zone_config.shape_type)) {
+        return SYSTEM_ERROR_NOT_SUPPORTED;
+    }
+    int dense = _slots.at(handle.slot).dense;
+    auto& zone = GeofenceZones.at(dense);
+    if(ZoneConfigHash(zone) != ZoneConfigHash(zone_config)) {
+        GeofenceZoneStates.at(dense) = GeofenceZoneState();
+#if GEOFENCE_ENABLE_VERIFICATION
+        _verification_timers.Cancel(handle.slot);
+#endif
+    }
+    zone = zone_config;
+    CompileZone(dense);
+    return SYSTEM_ERROR_NONE;
+}
+
+ZoneInfo& Geofence::GetZoneInfo(int index) {
+    int dense = _slots.at(index).dense;
+    ZoneHot.at(dense).flags |= GeofenceZoneHot::DIRTY;
+    _zones_dirty = true;
+    return GeofenceZones.at(dense);
+}
+
+const ZoneInfo& Geofence::GetZoneInfo(int index) const {
+    static const ZoneInfo none;
+    if(!IsValidZone(GetZoneHandle(index))) {
+        return none;
+    }
+    return GeofenceZones.at(_slots.at(index).dense);
+}
+
+ZoneInfo* Geofence::GetZoneInfo(GeofenceZoneHandle handle) {
+    if(!IsValidZone(handle)) {
+        return nullptr;
+    }
+    return &GetZoneInfo(handle.slot);
+}
+
+const ZoneInfo* Geofence::GetZoneInfo(GeofenceZoneHandle handle) const {
+    if(!IsValidZone(handle)) {
+        return nullptr;
+    }
+    return &GeofenceZones.at(_slots.at(handle.slot).dense);
+}
+
+GeofenceZoneHandle Geofence::GetZoneHandle(int index) const {
+    GeofenceZoneHandle handle;
+    if(index >= 0 && index < _slots.size() && _slots.at(index).dense >= 0) {
+        handle.slot = (uint16_t)index;
+        handle.generation = _slots.at(index).generation;
+    }
+    return handle;
+}
+
+GeofenceZoneHandle Geofence::AddZone(const ZoneInfo& zone_config) {
+    GeofenceZoneHandle handle;
+    if(_dispatching || !GeofenceShapeEnabled(zone_config.shape_type)) {
+        return handle;
+    }
+    int slot = _free_slot;
+    if(slot < 0) {
+        if(_slots.size() >= 0xFFFF ||
+#if GEOFENCE_ENABLE_VERIFICATION
+                !_verification_timers.Resize(_slots.size() + 1) ||
+#endif
+                    !_slots.append({-1, -1, 1})) {
+            return handle;
+        }
+        slot = _slots.size() - 1;
+        // Free until the zone is stored, so a failure below doesn't lose it
+        _slots.at(slot).next_free = _free_slot;
+        _free_slot = slot;
+    }
+    if(!GeofenceZones.append(zone_config)) {
+        return handle;
+    }
+    if(!ZoneHot.append(GeofenceZoneHot()) ||
+            !GeofenceZoneStates.append(GeofenceZoneState()) ||
+            !ZoneGeometry.append(GeofenceZoneGeometry()) ||
+                !ZoneSlotIndex.append(slot)) {
+        // Keep the dense arrays the same length
+        GeofenceZones.takeLast();
+        ZoneHot.resize(GeofenceZones.size());
+        GeofenceZoneStates.resize(GeofenceZones.size());
+        ZoneGeometry.resize(GeofenceZones.size());
+        ZoneSlotIndex.resize(GeofenceZones.size());
+        return handle;
+    }
+
+    auto& entry = _slots.at(slot);
+    _free_slot = entry.next_free;
+    entry.dense = GeofenceZones.size() - 1;
+    entry.next_free = -1;
+    CompileZone(entry.dense);
+    _subscribers_dirty = true;
+
+    handle.slot = (uint16_t)slot;
+    handle.generation = entry.generation;
+    return handle;
+}
+
+int Geofence::RemoveZone(GeofenceZoneHandle handle) {
+    if(_dispatching) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+    if(!IsValidZone(handle)) {
+        return SYSTEM_ERROR_NOT_FOUND;
+    }
+    auto& entry = _slots.at(handle.slot);
+    int dense = entry.dense;
+    int last = GeofenceZones.size() - 1;
+
+#if GEOFENCE_ENABLE_VERTICES
+    AllocateVertices(ZoneHot.at(dense), 0);
+#endif
+#if GEOFENCE_ENABLE_VERIFICATION
+    _verification_timers.Cancel(handle.slot);
+#endif
+
+    // Move the last zone into the hole to keep the zones dense
+    if(dense != last) {
+        std::swap(GeofenceZones.at(dense), GeofenceZones.at(last));
+        std::swap(ZoneHot.at(dense), ZoneHot.at(last));
+        std::swap(GeofenceZoneStates.at(dense), GeofenceZoneStates.at(last));
+        std::swap(ZoneGeometry.at(dense), ZoneGeometry.at(last));
+        std::swap(ZoneSlotIndex.at(dense), ZoneSlotIndex.at(last));
+        _slots.at(ZoneSlotIndex.at(dense)).dense = dense;
+    }
+    GeofenceZones.removeAt(last);
+    ZoneHot.removeAt(last);
+    GeofenceZoneStates.removeAt(last);
+    ZoneGeometry.removeAt(last);
+    ZoneSlotIndex.removeAt(last);
+
+    entry.dense = -1;
+    entry.next_free = _free_slot;
+    if(!++entry.generation) {
+        entry.generation = 1;
+    }
+    _free_slot = handle.slot;
+    _subscribers_dirty = true;
+    _index_dirty = true;
+    return SYSTEM_ERROR_NONE;
+}
+
+void Geofence::CompileDirtyZones() {
+    if(!_zones_dirty) {
+        return;
+    }
+    for(int dense = 0; dense < ZoneHot.size(); dense++) {
+        if(ZoneHot.at(dense).flags & GeofenceZoneHot::DIRTY) {
+            CompileZone(dense);
+        }
+    }
+    _zones_dirty = false;
+}
+
+void Geofence::CompileZone(int dense) {
+    auto& zone = GeofenceZones.at(dense);
+    auto& hot = ZoneHot.at(dense);
+    auto& geometry = ZoneGeometry.at(dense);
+
+    _index_dirty = true;
+    _evaluate_pending = true;
+    if(geometry.groups != zone.groups) {
+        _subscribers_dirty = true;
+    }
+    geometry = GeofenceZoneGeometry();
+    geometry.groups = zone.groups;
+#if GEOFENCE_ENABLE_VERTICES
+    uint32_t vertex_offset = hot.vertex_offset;
+    uint16_t num_points = hot.num_points;
+#endif
+#if GEOFENCE_ENABLE_VERIFICATION
+    uint32_t verification_ms = hot.verification_ms;
+#endif
+    hot = GeofenceZoneHot();
+#if GEOFENCE_ENABLE_VERTICES
+    hot.vertex_offset = vertex_offset;
+    hot.num_points = num_points;
+#endif
+    hot.shape = (uint8_t)zone.shape_type;
+#if GEOFENCE_ENABLE_VERIFICATION
+    hot.verification_ms = zone.verification_time_sec * 1000;
+    // Move the deadline of a pending transition to the new verification time
+    int slot = ZoneSlotIndex.at(dense);
+    if(hot.verification_ms != verification_ms &&
+            _verification_timers.IsScheduled(slot)) {
+        uint64_t now = System.millis();
+        uint32_t elapsed = (uint32_t)now - GeofenceZoneStates.at(dense).pending_time_ms;
+        if(hot.verification_ms > elapsed) {
+            _verification_timers.Schedule(slot, now + (hot.verification_ms - elapsed));
+        }
+        else {
+            _verification_timers.Cancel(slot);
+        }
+    }
+#endif
+    hot.flags = (zone.enable ? GeofenceZoneHot::ENABLE : 0) |
+        (((zone.inside_event ? GeofenceZoneHot::INSIDE_EVENT : 0) |
+        (zone.outside_event ? GeofenceZoneHot::OUTSIDE_EVENT : 0) |
+        (zone.enter_event ? GeofenceZoneHot::ENTER_EVENT : 0) |
+        (zone.exit_event ? GeofenceZoneHot::EXIT_EVENT : 0)) & ENABLED_EVENT_FLAGS);
+
+    double min_lat = -90.0, max_lat = 90.0, min_lon = -180.0, max_lon = 180.0;
+    if(zone.shape_type == GeofenceShapeType::CIRCULAR) {
+#if GEOFENCE_ENABLE_VERTICES
+        AllocateVertices(hot, 0);
+#endif
+        geometry.center_lat = zone.center_lat;
+        geometry.center_lon = zone.center_lon;
+        geometry.radius = zone.radius;
+#if GEOFENCE_USE_FIXED_POINT
+        CompileCircleFixed(zone, geometry);
+#endif
+        // Spherical extent, widened for the ellipsoidal and approximate
+        // distance models
+        if(zone.radius <= CIRCLE_BOX_MAX_RADIUS) {
+            double delta = (zone.radius * 1.05 + 10.0) / (EARTH_RADIUS * 1000.0);
+            double extent = delta / D2R(1.0);
+            if(fabs(zone.center_lat) + extent < 90.0) {
+                min_lat = zone.center_lat - extent;
+                max_lat = zone.center_lat + extent;
+                extent = asin(sin(delta) / cos(D2R(zone.center_lat))) / D2R(1.0);
+                if(fabs(zone.center_lon) + extent < 180.0) {
+                    min_lon = zone.center_lon - extent;
+                    max_lon = zone.center_lon + extent;
+                }
+            }
+        }
+    }
+#if GEOFENCE_ENABLE_RECTANGLE
+    else if(zone.shape_type == GeofenceShapeType::RECTANGLE) {
+#if GEOFENCE_ENABLE_VERTICES
+        AllocateVertices(hot, 0);
+#endif
+        if(!(zone.min_lat <= zone.max_lat) || zone.min_lat < -90.0 || zone.max_lat > 90.0 ||
+                !(fabs(zone.min_lon) <= 180.0) || !(fabs(zone.max_lon) <= 180.0)) {
+            // Empty box, never inside
+            hot.min_lat = 1.0f;
+            hot.max_lat = -1.0f;
+            return;
+        }
+        double width = zone.max_lon - zone.min_lon;
+        width += (width < 0.0) ? 360.0 : 0.0;
+        auto& rectangle = geometry.rectangle;
+#if GEOFENCE_USE_FIXED_POINT
+        rectangle = {ToE7(zone.min_lat), ToE7(zone.max_lat), ToE7(zone.min_lon),
+            (int64_t)llround(width * E7)};
+#else
+        rectangle = {zone.min_lat, zone.max_lat, zone.min_lon, width};
+#endif
+        min_lat = zone.min_lat;
+        max_lat = zone.max_lat;
+        if(zone.min_lon <= zone.max_lon) {
+            min_lon = zone.min_lon;
+            max_lon = zone.max_lon;
+        }
+        else if(zone.min_lon >= 0.0) {
+            // Across the date line, negative longitudes shifted by 360
+            hot.flags |= GeofenceZoneHot::DATELINE;
+            min_lon = zone.min_lon;
+            max_lon = zone.max_lon + 360.0;
+        }
+    }
+#endif
+#if GEOFENCE_ENABLE_VERTICES
+    else if(GeofenceShapeEnabled(zone.shape_type)) {
+        int count = zone.polygon_points.isEmpty() ? 0 :
+            HowManyPolygonPointsEnabled(zone.polygon_points);
+        if(count > 0xFFFF || !AllocateVertices(hot, count)) {
+            AllocateVertices(hot, 0);
+            count = 0;
+        }
+        if(!count) {
+            // Empty box, never inside
+            hot.min_lat = 1.0f;
+            hot.max_lat = -1.0f;
+            return;
+        }
+
+        double offset = CalculateLonDatelineOffset(zone.polygon_points);
+        if(offset != 0.0) {
+            hot.flags |= GeofenceZoneHot::DATELINE;
+        }
+        GeofenceCompiledVertex* vertices = ZoneVertices.data() + hot.vertex_offset;
+        int i = 0;
+        for(auto& point : zone.polygon_points) {
+            if(!point.enable) {
+                continue;
+            }
+            double lon = (point.lon < 0.0) ? point.lon + offset : point.lon;
+            if(!i || point.lat < min_lat) {min_lat = point.lat;}
+            if(!i || point.lat > max_lat) {max_lat = point.lat;}
+            if(!i || lon < min_lon) {min_lon = lon;}
+            if(!i || lon > max_lon) {max_lon = lon;}
+#if GEOFENCE_USE_FIXED_POINT
+            int32_t lon_e7 = ToE7(point.lon);
+            if(!i) {
+                geometry.ref_lon = lon_e7;
+            }
+            vertices[i++] = {ToE7(point.lat),
+                WrapLonE7((int64_t)lon_e7 - geometry.ref_lon)};
+#else
+            vertices[i++] = {point.lat, lon};
+#endif
+        }
+#if GEOFENCE_ENABLE_POLYGON
+        if(zone.shape_type == GeofenceShapeType::POLYGONAL &&
+                max_lat - min_lat < CONVEX_MAX_EXTENT &&
+                max_lon - min_lon < CONVEX_MAX_EXTENT) {
+#if GEOFENCE_USE_FIXED_POINT
+            geometry.convex = ConvexOrientation<int64_t>(vertices, count, 0);
+#else
+            geometry.convex = ConvexOrientation(vertices, count, CONVEX_EPSILON);
+#endif
+        }
+#if GEOFENCE_POLYGON_CORES
+        if(zone.shape_type == GeofenceShapeType::POLYGONAL) {
+            CompilePolygonCores(hot, geometry);
+        }
+#endif
+        if(zone.shape_type == GeofenceShapeType::POLYGONAL &&
+                !geometry.convex && zone.simplify_tolerance > 0.0) {
+            SimplifyPolygon(zone, hot, geometry);
+        }
+#endif
+#if GEOFENCE_ENABLE_CORRIDOR
+        if(zone.shape_type == GeofenceShapeType::CORRIDOR) {
+            geometry.radius = zone.radius;
+            if(!CompileCorridor(zone, hot, geometry, offset)) {
+                AllocateVertices(hot, 0);
+                hot.min_lat = 1.0f;
+                hot.max_lat = -1.0f;
+            }
+            return;
+        }
+#endif
+    }
+#endif
+    else {
+        // Shape left out at compile time, never inside
+#if GEOFENCE_ENABLE_VERTICES
+        AllocateVertices(hot, 0);
+#endif
+        hot.min_lat = 1.0f;
+        hot.max_lat = -1.0f;
+        return;
+    }
+    hot.min_lat = (float)(min_lat - BOX_MARGIN);
+    hot.max_lat = (float)(max_lat + BOX_MARGIN);
+    hot.min_lon = (float)(min_lon - BOX_MARGIN);
+    hot.max_lon = (float)(max_lon + BOX_MARGIN);
+}
+
+#if GEOFENCE_ENABLE_CORRIDOR
+bool Geofence::CompileCorridor(const ZoneInfo& zone,
+                        GeofenceZoneHot& hot,
+                        GeofenceZoneGeometry& geometry,
+                        double offset) {
+    Vector<GeofenceVertex> points;
+    if(!points.reserve(hot.num_points)) {
+        return false;
+    }
+    for(auto& point : zone.polygon_points) {
+        if(point.enable) {
+            points.append({point.lat, (point.lon < 0.0) ? point.lon + offset : point.lon});
+        }
+    }
+
+    // A single point is a segment of zero length
+    int last = points.size() - 1;
+    int segments = std::max(last, 1);
+    int leaves = 1;
+    while(leaves * CORRIDOR_LEAF_SEGMENTS < segments) {
+        leaves *= 2;
+    }
+    if(!geometry.segment_boxes.resize(leaves * 2)) {
+        return false;
+    }
+    geometry.segment_leaves = leaves;
+
+    // Widened for the local projection used to measure the distance
+    double width = (zone.radius * 1.01 + 1.0) / (EARTH_RADIUS * 1000.0) / D2R(1.0);
+    for(int leaf = 0; leaf < leaves; leaf++) {
+        auto& box = geometry.segment_boxes.at(leaves + leaf);
+        int first = leaf * CORRIDOR_LEAF_SEGMENTS;
+        if(first >= segments) {
+            box = {EMPTY_BOX, -EMPTY_BOX, EMPTY_BOX, -EMPTY_BOX};
+            continue;
+        }
+        int end = std::min(first + CORRIDOR_LEAF_SEGMENTS, segments);
+        double min_lat = points.at(first).lat, max_lat = min_lat;
+        double min_lon = points.at(first).lon, max_lon = min_lon;
+        for(int i = first + 1; i <= std::min(end, last); i++) {
+            min_lat = std::min(min_lat, points.at(i).lat);
+            max_lat = std::max(max_lat, points.at(i).lat);
+            min_lon = std::min(min_lon, points.at(i).lon);
+            max_lon = std::max(max_lon, points.at(i).lon);
+        }
+        double polar = std::min(89.0, std::max(fabs(min_lat), fabs(max_lat)) + width);
+        double lon_width = width / cos(D2R(polar));
+        box.min_lat = (float)(min_lat - width - BOX_MARGIN);
+        box.max_lat = (float)(max_lat + width + BOX_MARGIN);
+        box.min_lon = (float)(min_lon - lon_width - BOX_MARGIN);
+        box.max_lon = (float)(max_lon + lon_width + BOX_MARGIN);
+    }
+    for(int node = leaves - 1; node >= 1; node--) {
+        auto& left = geometry.segment_boxes.at(node * 2);
+        auto& right = geometry.segment_boxes.at(node * 2 + 1);
+        geometry.segment_boxes.at(node) = {std::min(left.min_lat, right.min_lat),
+            std::max(left.max_lat, right.max_lat),
+            std::min(left.min_lon, right.min_lon),
+            std::max(left.max_lon, right.max_lon)};
+    }
+
+    // With a single leaf the root is the leaf
+    auto& root = geometry.segment_boxes.at(1);
+    hot.min_lat = root.min_lat;
+    hot.max_lat = root.max_lat;
+    hot.min_lon = root.min_lon;
+    hot.max_lon = root.max_lon;
+    return true;
+}
+#endif // GEOFENCE_ENABLE_CORRIDOR
+
+#if GEOFENCE_ENABLE_VERTICES
+bool Geofence::AllocateVertices(GeofenceZoneHot& hot, int count) {
+    if(count == hot.num_points) {
+        return true;
+    }
+    _released_vertices += hot.num_points;
+    hot.vertex_offset = 0;
+    hot.num_points = 0;
+    if(!count) {
+        return true;
+    }
+
+    if(_released_vertices > ZoneVertices.size() / 2) {
+        CompactVertices();
+    }
+    int size = ZoneVertices.size() + count;
+    if(size > ZoneVertices.capacity() &&
+            !ZoneVertices.reserve(std::max(size, ZoneVertices.capacity() * 3 / 2))) {
+        // Retry without the headroom
+        if(!ZoneVertices.reserve(size)) {
+            return false;
+        }
+    }
+    hot.vertex_offset = ZoneVertices.size();
+    hot.num_points = (uint16_t)count;
+    return ZoneVertices.resize(size);
+}
+
+void Geofence::CompactVertices() {
+    Vector<int> order;
+    if(!order.reserve(ZoneHot.size())) {
+        return;
+    }
+    for(int dense = 0; dense < ZoneHot.size(); dense++) {
+        if(ZoneHot.at(dense).num_points) {
+            order.append(dense);
+        }
+    }
+    std::sort(order.begin(), order.end(), [this](int a, int b) {
+        return ZoneHot.at(a).vertex_offset < ZoneHot.at(b).vertex_offset;
+    });
+
+    // Ranges only move down, so moving them in offset order never
+    // overwrites a range that is yet to be moved
+    uint32_t next = 0;
+    for(int dense : order) {
+        auto& hot = ZoneHot.at(dense);
+        if(hot.vertex_offset != next) {
+            memmove(ZoneVertices.data() + next,
+                ZoneVertices.data() + hot.vertex_offset,
+                hot.num_points * sizeof(GeofenceCompiledVertex));
+            hot.vertex_offset = next;
+        }
+        next += hot.num_points;
+    }
+    ZoneVertices.resize(next);
+    _released_vertices = 0;
+}
+#endif // GEOFENCE_ENABLE_VERTICES
+
+void Geofence::DispatchEvent(int dense, CallbackContext& context) {
+    GeofenceEventMask bit = GeofenceEventBit(context.event_type);
+    if(!(ZoneEventMask.at(dense) & bit)) {
+        return;
+    }
+#if GEOFENCE_ENABLE_STATS
+    uint32_t due_us;
+    bool measured = GetEventDue(dense, context.event_type, due_us);
+#endif
+    for(int i = ZoneSubscriberStart.at(dense);
+            i < ZoneSubscriberStart.at(dense + 1); i++) {
+        int index = ZoneSubscribers.at(i);
+        auto& subscription = EventSubscriptions.at(index);
+        if((subscription.event_mask & bit) && subscription.id) {
+            if((subscription.event_mask & GEOFENCE_EVENT_DISTANCE) &&
+                    isnan(context.distance) &&
+                        context.event_type != GeofenceEventType::POOR_LOCATION) {
+                context.distance = ZoneSignedDistance(dense,
+                    _geofence_point.lat, _geofence_point.lon);
+            }
+            if(subscription.batch_callback) {
+                // Delivered at the end of loop(), or now if the batch is full
+                if(!subscription.batch.append(context)) {
+                    DeliverBatch(index);
+                    if(!subscription.batch.append(context)) {
+#if GEOFENCE_ENABLE_STATS
+                        RecordLatency(measured, due_us);
+#endif
+                        _dispatching = true;
+                        subscription.batch_callback(&context, 1);
+                        _dispatching = false;
+                        continue;
                     }
-                    //Store the most recent event type for that zone
-                    GeofenceZoneStates.at(zone_index).prev_event =
-                                                GeofenceEventType::OUTSIDE;
                 }
-                //distance is inside geofence
-                else {
-                    if(zone.inside_event) {
-                        context.event_type = GeofenceEventType::INSIDE;
-                        context.index = zone_index;
-                        for(auto callback : EventCallback) {
-                            callback(context);
-                        }
-                    }
-                    if(zone.enter_event) {
-                        if(zone_state.prev_event ==
-                            GeofenceEventType::OUTSIDE) {
-                            context.index = zone_index;
-                            context.event_type = GeofenceEventType::ENTER;
-                            for(auto callback : EventCallback) {
-                                callback(context);
-                            }
-                        }
-                    }
-                    //Store the most recent event type for that zone
-                    GeofenceZoneStates.at(zone_index).prev_event =
-                                                GeofenceEventType::INSIDE;
+#if GEOFENCE_ENABLE_STATS
+                if(measured) {
+                    subscription.batch_due_us.append(due_us);
                 }
+#endif
+                _batch_pending = true;
+                continue;
             }
+#if GEOFENCE_ENABLE_ASYNC
+            if(!_async_queues.isEmpty()) {
+                // Zones stay on one queue, so their events stay in order
+                auto& queue = _async_queues.at(context.index % _async_queues.size());
+#if GEOFENCE_ENABLE_STATS
+                queue.Push(context, subscription.callback, measured, due_us);
+#else
+                queue.Push(context, subscription.callback);
+#endif
+                continue;
+            }
+#endif
+#if GEOFENCE_ENABLE_STATS
+            RecordLatency(measured, due_us);
+#endif
+            _dispatching = true;
+            subscription.callback(context);
+            _dispatching = false;
         }
-        zone_index++;
     }
 }
 
-bool Geofence::AnyGeofenceEnabled() {
-    for(auto iter : GeofenceZones) {
-        if(iter.enable) {
-            return true;
+#if GEOFENCE_ENABLE_STATS
+bool Geofence::GetEventDue(int dense, GeofenceEventType type,
+                        uint32_t& due_us) const {
+    due_us = _dispatch_due_us;
+    if(type != GeofenceEventType::ENTER && type != GeofenceEventType::EXIT) {
+        return _dispatch_measured;
+    }
+    // Transitions are reported once, on whichever pass confirms them, and
+    // are due when the fix showing them arrived or once verified
+#if GEOFENCE_ENABLE_VERIFICATION
+    if(ZoneHot.at(dense).verification_ms) {
+        uint32_t deadline_us = VerificationDeadlineUs(dense);
+        if((int32_t)(deadline_us - due_us) > 0) {
+            due_us = deadline_us;
         }
     }
-    return false;
+#endif
+    return true;
 }
 
-int Geofence::RegisterGeofenceCallback(GeofenceEventCallback callback) {
-    EventCallback.append(callback);
+#if GEOFENCE_ENABLE_VERIFICATION
+uint32_t Geofence::VerificationDeadlineUs(int dense) const {
+    uint64_t now_ms = System.millis();
+    uint64_t deadline_ms = std::min(now_ms,
+        _verification_timers.GetDeadline(ZoneSlotIndex.at(dense)));
+    return micros() - (uint32_t)((now_ms - deadline_ms) * 1000);
+}
+#endif
+#endif // GEOFENCE_ENABLE_STATS
+
+void Geofence::DeliverBatch(int index) {
+    auto& subscription = EventSubscriptions.at(index);
+    if(subscription.batch.isEmpty()) {
+        return;
+    }
+    // Batches of subscriptions removed since the events were collected are
+    // dropped
+    if(subscription.id) {
+#if GEOFENCE_ENABLE_STATS
+        uint32_t now = micros();
+        for(auto due_us : subscription.batch_due_us) {
+            _latency.Record(now - due_us);
+        }
+#endif
+        _dispatching = true;
+        subscription.batch_callback(subscription.batch.data(),
+            subscription.batch.size());
+        _dispatching = false;
+    }
+    subscription.batch.clear();
+#if GEOFENCE_ENABLE_STATS
+    subscription.batch_due_us.clear();
+#endif
+}
+
+void Geofence::DeliverBatches() {
+    if(!_batch_pending) {
+        return;
+    }
+    _batch_pending = false;
+    for(int i = 0; i < EventSubscriptions.size(); i++) {
+        DeliverBatch(i);
+    }
+}
+
+int Geofence::AddSubscription(GeofenceEventCallback callback,
+                GeofenceEventMask event_mask,
+                GeofenceZoneHandle handle,
+                uint32_t groups,
+                GeofenceBatchCallback batch_callback) {
+    // The subscriptions can't grow while one of them is being called
+    if(_dispatching) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+    Subscription subscription{};
+    subscription.callback = callback;
+    subscription.event_mask = event_mask;
+    subscription.handle = handle;
+    subscription.groups = groups;
+    subscription.id = _last_subscription_id + 1;
+    subscription.batch_callback = batch_callback;
+    if(EventSubscriptions.size() >= 0xFFFF ||
+            !EventSubscriptions.append(std::move(subscription))) {
+        return SYSTEM_ERROR_NO_MEMORY;
+    }
+    _subscribers_dirty = true;
+    return ++_last_subscription_id;
+}
+
+int Geofence::Unsubscribe(int id) {
+    for(auto& subscription : EventSubscriptions) {
+        if(id > 0 && subscription.id == id) {
+            // Removed on the next rebuild, a callback may be running right now
+            subscription.id = 0;
+            _subscribers_dirty = true;
+            return SYSTEM_ERROR_NONE;
+        }
+    }
+    return SYSTEM_ERROR_NOT_FOUND;
+}
+
+void Geofence::BuildSubscriberLists() {
+    for(int i = 0; i < EventSubscriptions.size(); ) {
+        if(!EventSubscriptions.at(i).id) {
+            EventSubscriptions.removeAt(i);
+        }
+        else {
+            i++;
+        }
+    }
+
+    ZoneSubscribers.clear();
+    ZoneSubscriberStart.resize(GeofenceZones.size() + 1);
+    ZoneEventMask.resize(GeofenceZones.size());
+    for(int dense = 0; dense < GeofenceZones.size(); dense++) {
+        GeofenceZoneHandle zone_handle = GetZoneHandle(ZoneSlotIndex.at(dense));
+        uint32_t zone_groups = GeofenceZones.at(dense).groups;
+        GeofenceEventMask mask = 0;
+
+        ZoneSubscriberStart.at(dense) = ZoneSubscribers.size();
+        for(int i = 0; i < EventSubscriptions.size(); i++) {
+            auto& subscription = EventSubscriptions.at(i);
+            bool match = (subscription.handle.generation) ?
+                (subscription.handle == zone_handle) :
+                    ((subscription.groups == GEOFENCE_GROUP_ALL) ||
+                        (subscription.groups & zone_groups));
+            if(match) {
+                ZoneSubscribers.append((uint16_t)i);
+                mask |= subscription.event_mask;
+            }
+        }
+        ZoneEventMask.at(dense) = mask;
+    }
+    ZoneSubscriberStart.at(GeofenceZones.size()) = ZoneSubscribers.size();
+    _subscribers_dirty = false;
+}
+
+#if GEOFENCE_ENABLE_ASYNC
+int Geofence::SetAsyncDelivery(int capacity, GeofenceEventOrder order,
+                int workers) {
+    if(capacity < 0 || workers < 1 || workers > 0xFFFF ||
+            (order == GeofenceEventOrder::GLOBAL && workers != 1)) {
+        return SYSTEM_ERROR_INVALID_ARGUMENT;
+    }
+    if(_dispatching) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+    _async_queues.clear();
+    if(!capacity) {
+        return SYSTEM_ERROR_NONE;
+    }
+    if(!_async_queues.resize(workers)) {
+        _async_queues.clear();
+        return SYSTEM_ERROR_NO_MEMORY;
+    }
+    for(auto& queue : _async_queues) {
+        if(!queue.Resize(capacity)) {
+            _async_queues.clear();
+            return SYSTEM_ERROR_NO_MEMORY;
+        }
+    }
     return SYSTEM_ERROR_NONE;
 }
 
-bool Geofence::IsCircularGeofenceOutside(ZoneInfo& zone) {
+int Geofence::ProcessAsyncEvents(int worker, int max_events) {
+    if(worker < 0 || worker >= _async_queues.size()) {
+        return SYSTEM_ERROR_INVALID_ARGUMENT;
+    }
+#if GEOFENCE_ENABLE_STATS
+    return _async_queues.at(worker).Deliver(max_events, &_latency);
+#else
+    return _async_queues.at(worker).Deliver(max_events);
+#endif
+}
+
+GeofenceAsyncStats Geofence::GetAsyncStats() const {
+    GeofenceAsyncStats stats;
+    for(auto& queue : _async_queues) {
+        queue.AddStats(stats);
+    }
+    return stats;
+}
+#endif // GEOFENCE_ENABLE_ASYNC
+
+int Geofence::RegisterGeofenceCallback(GeofenceEventCallback callback) {
+    int ret = Subscribe(callback);
+    return (ret < 0) ? ret : SYSTEM_ERROR_NONE;
+}
+
+bool Geofence::IsCircularGeofenceOutside(const GeofenceZoneGeometry& geometry,
+                        double* signed_distance) {
+#if GEOFENCE_USE_FIXED_POINT
+    if(geometry.fixed_circle) {
+        return IsCircularGeofenceOutsideFixed(geometry);
+    }
+#endif
     double distance;
-    GpsDistance(zone.center_lat, zone.center_lon, _geofence_point.lat,
+    GpsDistance(geometry.center_lat, geometry.center_lon, _geofence_point.lat,
                 _geofence_point.lon, distance);
+    if(signed_distance) {
+        *signed_distance = distance - geometry.radius;
+    }
     //outside geofence
-    if(distance > zone.radius) {
+    if(distance > geometry.radius) {
         return true;
     }
     else {
@@ -128,37 +1937,544 @@ bool Geofence::IsCircularGeofenceOutside(ZoneInfo& zone) {
     }
 }
 
-bool Geofence::IsPolygonalGeofenceOutside(ZoneInfo& zone) {
-    if(IsPointInPolygon(zone.polygon_points,
-                    _geofence_point.lat,
-                    _geofence_point.lon)) {
-        return false;
+#if GEOFENCE_ENABLE_POLYGON
+bool Geofence::IsPolygonalGeofenceOutside(const GeofenceZoneHot& hot,
+                        const GeofenceZoneGeometry& geometry) {
+    const GeofenceCompiledVertex* points = ZoneVertices.data() + hot.vertex_offset;
+#if GEOFENCE_USE_FIXED_POINT
+    int32_t point_lat = _point_lat_e7;
+    int32_t point_lon = WrapLonE7((int64_t)_point_lon_e7 - geometry.ref_lon);
+#else
+    double point_lat = _geofence_point.lat;
+    double point_lon = _geofence_point.lon;
+    if((hot.flags & GeofenceZoneHot::DATELINE) && point_lon < 0.0) {
+        point_lon += 360.0;
     }
-    else {
-        return true;
+#endif
+#if GEOFENCE_POLYGON_CORES
+    for(int i = 0; i < geometry.num_cores; i++) {
+        auto& core = geometry.cores[i];
+        if(point_lat >= core.min.lat && point_lat <= core.max.lat &&
+                point_lon >= core.min.lon && point_lon <= core.max.lon) {
+#if GEOFENCE_ENABLE_STATS
+            _stats.fast_accepts++;
+#endif
+            return false;
+        }
+    }
+#endif
+    if(!geometry.simplified.isEmpty()) {
+        const GeofenceCompiledVertex* simplified = geometry.simplified.data();
+        int count = geometry.simplified.size();
+#if GEOFENCE_USE_FIXED_POINT
+        if(!NearPolygonEdge<float, int64_t>(simplified, count, point_lat, point_lon,
+                geometry.simplify_scale, geometry.simplify_tolerance)) {
+            return !IsPointInPolygonFixed(geometry, simplified, count);
+        }
+#else
+        if(!NearPolygonEdge<double, double>(simplified, count, point_lat, point_lon,
+                geometry.simplify_scale, geometry.simplify_tolerance)) {
+            return !IsPointInPolygon(simplified, count, point_lat, point_lon);
+        }
+#endif
+    }
+#if GEOFENCE_USE_FIXED_POINT
+    if(geometry.convex) {
+        int inside = PointInConvexPolygon<int64_t>(points, hot.num_points,
+            geometry.convex, point_lat, point_lon, 0);
+        if(inside >= 0) {
+            return !inside;
+        }
+    }
+    return !IsPointInPolygonFixed(geometry, points, hot.num_points);
+#else
+    if(geometry.convex) {
+        int inside = PointInConvexPolygon(points, hot.num_points,
+            geometry.convex, point_lat, point_lon, CONVEX_EPSILON);
+        if(inside >= 0) {
+            return !inside;
+        }
+    }
+    return !IsPointInPolygon(points, hot.num_points, point_lat, point_lon);
+#endif
+}
+
+void Geofence::SimplifyPolygon(const ZoneInfo& zone,
+                        const GeofenceZoneHot& hot,
+                        GeofenceZoneGeometry& geometry) {
+    const GeofenceCompiledVertex* compiled = ZoneVertices.data() + hot.vertex_offset;
+    int count = hot.num_points;
+    Vector<GeofenceVertex> points;
+    Vector<uint8_t> keep;
+    if(count < 4 || !points.reserve(count) || !keep.resize(count)) {
+        return;
+    }
+#if GEOFENCE_USE_FIXED_POINT
+    const double unit = E7;
+#else
+    const double unit = 1.0;
+#endif
+    double min_lat = compiled[0].lat, max_lat = compiled[0].lat;
+    double min_lon = compiled[0].lon, max_lon = compiled[0].lon;
+    for(int i = 0; i < count; i++) {
+        min_lat = std::min(min_lat, (double)compiled[i].lat);
+        max_lat = std::max(max_lat, (double)compiled[i].lat);
+        min_lon = std::min(min_lon, (double)compiled[i].lon);
+        max_lon = std::max(max_lon, (double)compiled[i].lon);
+    }
+    double scale = cos(D2R((min_lat + max_lat) * 0.5 / unit));
+    for(int i = 0; i < count; i++) {
+        points.append({(double)compiled[i].lat, compiled[i].lon * scale});
+    }
+    // Tolerances too small to drop vertices would be lost in the rounding
+    // of the edge distances
+    double extent = std::max(max_lat - min_lat, (max_lon - min_lon) * scale);
+    double tolerance = zone.simplify_tolerance * unit /
+        (D2R(1.0) * EARTH_RADIUS * 1000.0);
+
+    Vector<GeofenceVertex> ring;
+    for(int attempt = 0; attempt < SIMPLIFY_ATTEMPTS && tolerance > extent * 1e-5;
+            attempt++, tolerance *= 0.5) {
+        int kept = SimplifyRing(points, tolerance, keep);
+        if(kept > count * 3 / 4) {
+            return;
+        }
+        if(kept < 3) {
+            continue;
+        }
+        ring.clear();
+        if(!ring.reserve(kept)) {
+            return;
+        }
+        for(int i = 0; i < count; i++) {
+            if(keep[i]) {
+                ring.append(points[i]);
+            }
+        }
+        if(!IsSimpleRing(ring)) {
+            continue;
+        }
+        if(!geometry.simplified.reserve(kept)) {
+            return;
+        }
+        for(int i = 0; i < count; i++) {
+            if(keep[i]) {
+                geometry.simplified.append(compiled[i]);
+            }
+        }
+        geometry.simplify_scale = (float)scale;
+        // Widened by more than the float rounding of the edge distances
+        geometry.simplify_tolerance = (float)(tolerance + extent * 1e-6);
+        return;
+    }
+}
+
+#if GEOFENCE_POLYGON_CORES
+void Geofence::CompilePolygonCores(const GeofenceZoneHot& hot,
+                        GeofenceZoneGeometry& geometry) {
+    const GeofenceCompiledVertex* compiled = ZoneVertices.data() + hot.vertex_offset;
+    int count = hot.num_points;
+    Vector<GeofenceVertex> points;
+    if(count < 3 || !points.reserve(count)) {
+        return;
+    }
+    CoreBox bounds = {(double)compiled[0].lat, (double)compiled[0].lat,
+        (double)compiled[0].lon, (double)compiled[0].lon};
+    for(int i = 0; i < count; i++) {
+        GeofenceVertex point = {(double)compiled[i].lat, (double)compiled[i].lon};
+        bounds.min_lat = std::min(bounds.min_lat, point.lat);
+        bounds.max_lat = std::max(bounds.max_lat, point.lat);
+        bounds.min_lon = std::min(bounds.min_lon, point.lon);
+        bounds.max_lon = std::max(bounds.max_lon, point.lon);
+        points.append(point);
+    }
+    double height = bounds.max_lat - bounds.min_lat;
+    double width = bounds.max_lon - bounds.min_lon;
+
+    // Grow a box with the aspect of the bounds around each grid point inside
+    Vector<CoreBox> boxes;
+    for(int i = 0; i < CORE_GRID * CORE_GRID; i++) {
+        double lat = bounds.min_lat + (i / CORE_GRID + 0.5) * height / CORE_GRID;
+        double lon = bounds.min_lon + (i % CORE_GRID + 0.5) * width / CORE_GRID;
+        if(!IsPointInPolygon(points.data(), count, lat, lon)) {
+            continue;
+        }
+        double low = 0.0, high = 1.0;
+        for(int step = 0; step < CORE_SEARCH_STEPS; step++) {
+            double mid = (low + high) * 0.5;
+            CoreBox box = {lat - mid * height, lat + mid * height,
+                lon - mid * width, lon + mid * width};
+            (BoxClearOfEdges(points, box) ? low : high) = mid;
+        }
+        if(low > 0.0 && !boxes.append({lat - low * height, lat + low * height,
+                lon - low * width, lon + low * width})) {
+            return;
+        }
+    }
+
+    double CoreBox::* const sides[4] = {&CoreBox::min_lat, &CoreBox::max_lat,
+        &CoreBox::min_lon, &CoreBox::max_lon};
+    const double limits[4] = {bounds.min_lat, bounds.max_lat,
+        bounds.min_lon, bounds.max_lon};
+    CoreBox cores[GEOFENCE_POLYGON_CORES];
+    int found = 0;
+    while(found < GEOFENCE_POLYGON_CORES) {
+        // Largest box whose center is not covered yet
+        int best = -1;
+        double best_area = 0.0;
+        for(int i = 0; i < boxes.size(); i++) {
+            auto& box = boxes[i];
+            double lat = (box.min_lat + box.max_lat) * 0.5;
+            double lon = (box.min_lon + box.max_lon) * 0.5;
+            bool covered = false;
+            for(int k = 0; k < found; k++) {
+                covered |= lat >= cores[k].min_lat && lat <= cores[k].max_lat &&
+                    lon >= cores[k].min_lon && lon <= cores[k].max_lon;
+            }
+            double area = (box.max_lat - box.min_lat) * (box.max_lon - box.min_lon);
+            if(!covered && area > best_area) {
+                best = i;
+                best_area = area;
+            }
+        }
+        if(best < 0) {
+            break;
+        }
+
+        // Stretch it one side at a time
+        CoreBox core = boxes[best];
+        for(int side = 0; side < 4; side++) {
+            double inner = core.*sides[side];
+            double outer = limits[side];
+            for(int step = 0; step < CORE_SEARCH_STEPS; step++) {
+                double mid = (inner + outer) * 0.5;
+                CoreBox box = core;
+                box.*sides[side] = mid;
+                (BoxClearOfEdges(points, box) ? inner : outer) = mid;
+            }
+            core.*sides[side] = inner;
+        }
+        cores[found++] = core;
+
+        // Round inwards, away from the edges
+        auto& compiled_core = geometry.cores[geometry.num_cores];
+#if GEOFENCE_USE_FIXED_POINT
+        compiled_core.min = {(int32_t)ceil(core.min_lat + CORE_MARGIN),
+            (int32_t)ceil(core.min_lon + CORE_MARGIN)};
+        compiled_core.max = {(int32_t)floor(core.max_lat - CORE_MARGIN),
+            (int32_t)floor(core.max_lon - CORE_MARGIN)};
+#else
+        compiled_core.min = {core.min_lat + CORE_MARGIN, core.min_lon + CORE_MARGIN};
+        compiled_core.max = {core.max_lat - CORE_MARGIN, core.max_lon - CORE_MARGIN};
+#endif
+        if(compiled_core.min.lat <= compiled_core.max.lat &&
+                compiled_core.min.lon <= compiled_core.max.lon) {
+            geometry.num_cores++;
+        }
+    }
+}
+#endif // GEOFENCE_POLYGON_CORES
+
+#endif // GEOFENCE_ENABLE_POLYGON
+
+#if GEOFENCE_ENABLE_RECTANGLE
+bool Geofence::IsRectangularGeofenceOutside(const GeofenceZoneGeometry& geometry) {
+    auto& rectangle = geometry.rectangle;
+#if GEOFENCE_USE_FIXED_POINT
+    int32_t lat = _point_lat_e7;
+    int64_t east = (int64_t)_point_lon_e7 - rectangle.west;
+    east += (east < 0) ? E7_360 : 0;
+#else
+    double lat = _geofence_point.lat;
+    double east = _geofence_point.lon - rectangle.west;
+    east += (east < 0.0) ? 360.0 : 0.0;
+#endif
+    return lat < rectangle.min_lat || lat > rectangle.max_lat || east > rectangle.width;
+}
+#endif // GEOFENCE_ENABLE_RECTANGLE
+
+#if GEOFENCE_ENABLE_CORRIDOR
+bool Geofence::IsCorridorGeofenceOutside(const GeofenceZoneHot& hot,
+                        GeofenceZoneGeometry& geometry) {
+    const GeofenceCompiledVertex* points = ZoneVertices.data() + hot.vertex_offset;
+    int last = hot.num_points - 1;
+    int segments = std::max(last, 1);
+#if GEOFENCE_USE_FIXED_POINT
+    int32_t point_lat = _point_lat_e7;
+    int32_t point_lon = WrapLonE7((int64_t)_point_lon_e7 - geometry.ref_lon);
+    float scale_x = METERS_PER_E7 * cosf(_point_lat_f * (float)D2R(1.0));
+    float width_sq = (float)(geometry.radius * geometry.radius);
+    auto is_near = [&](int segment) {
+        auto& a = points[segment];
+        auto& b = points[std::min(segment + 1, last)];
+        return SegmentDistanceSq<float>(
+            WrapLonE7((int64_t)a.lon - point_lon) * scale_x,
+            (float)(a.lat - point_lat) * METERS_PER_E7,
+            WrapLonE7((int64_t)b.lon - point_lon) * scale_x,
+            (float)(b.lat - point_lat) * METERS_PER_E7) <= width_sq;
+    };
+#else
+    double point_lat = _geofence_point.lat;
+    double point_lon = _geofence_point.lon;
+    if((hot.flags & GeofenceZoneHot::DATELINE) && point_lon < 0.0) {
+        point_lon += 360.0;
+    }
+    double scale_y = D2R(1.0) * EARTH_RADIUS * 1000.0;
+    double scale_x = scale_y * cos(D2R(point_lat));
+    double width_sq = geometry.radius * geometry.radius;
+    auto is_near = [&](int segment) {
+        auto& a = points[segment];
+        auto& b = points[std::min(segment + 1, last)];
+        return SegmentDistanceSq<double>((a.lon - point_lon) * scale_x,
+            (a.lat - point_lat) * scale_y, (b.lon - point_lon) * scale_x,
+            (b.lat - point_lat) * scale_y) <= width_sq;
+    };
+#endif
+
+    // Progress along the route, try the segment matched last and its
+    // neighbours first
+    int hint = geometry.corridor_segment;
+    for(int i = std::max(hint - 1, 0); i <= std::min(hint + 2, segments - 1); i++) {
+        if(is_near(i)) {
+            geometry.corridor_segment = i;
+            return false;
+        }
+    }
+
+    // Depth first through the boxes containing the point, the depth is at
+    // most log2(65535 / CORRIDOR_LEAF_SEGMENTS) + 1
+    float box_lon = _point_lon_f;
+    if((hot.flags & GeofenceZoneHot::DATELINE) && box_lon < 0.0f) {
+        box_lon += 360.0f;
+    }
+    const GeofenceSegmentBox* boxes = geometry.segment_boxes.data();
+    int leaves = geometry.segment_leaves;
+    int stack[40];
+    int top = 0;
+    stack[top++] = 1;
+    while(top) {
+        int node = stack[--top];
+        auto& box = boxes[node];
+        if(_point_lat_f < box.min_lat || _point_lat_f > box.max_lat ||
+                box_lon < box.min_lon || box_lon > box.max_lon) {
+            continue;
+        }
+        if(node < leaves) {
+            // Earlier segments first
+            stack[top++] = node * 2 + 1;
+            stack[top++] = node * 2;
+            continue;
+        }
+        int first = (node - leaves) * CORRIDOR_LEAF_SEGMENTS;
+        int end = std::min(first + CORRIDOR_LEAF_SEGMENTS, segments);
+        for(int i = first; i < end; i++) {
+            if(is_near(i)) {
+                geometry.corridor_segment = i;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+#endif // GEOFENCE_ENABLE_CORRIDOR
+
+bool Geofence::IsZoneOutside(const GeofenceZoneHot& hot,
+                        GeofenceZoneGeometry& geometry,
+                        double* distance) {
+    switch((GeofenceShapeType)hot.shape) {
+#if GEOFENCE_ENABLE_CORRIDOR
+        case GeofenceShapeType::CORRIDOR:
+            return IsCorridorGeofenceOutside(hot, geometry);
+#endif
+#if GEOFENCE_ENABLE_POLYGON
+        case GeofenceShapeType::POLYGONAL:
+            return IsPolygonalGeofenceOutside(hot, geometry);
+#endif
+#if GEOFENCE_ENABLE_RECTANGLE
+        case GeofenceShapeType::RECTANGLE:
+            return IsRectangularGeofenceOutside(geometry);
+#endif
+        default:
+            return IsCircularGeofenceOutside(geometry, distance);
+    }
+}
+
+bool Geofence::IsInBoundingBox(const GeofenceZoneHot& hot) const {
+    float point_lon = _point_lon_f;
+    if((hot.flags & GeofenceZoneHot::DATELINE) && point_lon < 0.0f) {
+        point_lon += 360.0f;
+    }
+    return (_point_lat_f >= hot.min_lat) && (_point_lat_f <= hot.max_lat) &&
+        (point_lon >= hot.min_lon) && (point_lon <= hot.max_lon);
+}
+
+bool Geofence::IsSegmentInBoundingBox(const GeofenceZoneHot& hot) const {
+    float a_lon = _previous_lon_f;
+    float b_lon = _point_lon_f;
+    if(hot.flags & GeofenceZoneHot::DATELINE) {
+        a_lon += (a_lon < 0.0f) ? 360.0f : 0.0f;
+        b_lon += (b_lon < 0.0f) ? 360.0f : 0.0f;
+    }
+    return (std::max(_previous_lat_f, _point_lat_f) >= hot.min_lat) &&
+        (std::min(_previous_lat_f, _point_lat_f) <= hot.max_lat) &&
+            (std::max(a_lon, b_lon) >= hot.min_lon) &&
+                (std::min(a_lon, b_lon) <= hot.max_lon);
+}
+
+int Geofence::FindSegmentCrossings(const GeofenceZoneHot& hot,
+                        const GeofenceZoneGeometry& geometry,
+                        float& first,
+                        float& last) {
+    const PointData& a = _previous_point;
+    const PointData& b = _geofence_point;
+
+    if(hot.shape == (uint8_t)GeofenceShapeType::CIRCULAR) {
+#if GEOFENCE_USE_FIXED_POINT
+        if(geometry.fixed_circle) {
+            float scale_x = METERS_PER_E7 * geometry.cos_lat;
+            return SegmentCircleCrossings<float>(
+                WrapLonE7((int64_t)_previous_lon_e7 - geometry.center_lon_e7) * scale_x,
+                (float)(_previous_lat_e7 - geometry.center_lat_e7) * METERS_PER_E7,
+                WrapLonE7((int64_t)_point_lon_e7 - geometry.center_lon_e7) * scale_x,
+                (float)(_point_lat_e7 - geometry.center_lat_e7) * METERS_PER_E7,
+                (float)geometry.radius, first, last);
+        }
+#endif
+        double scale_y = D2R(1.0) * EARTH_RADIUS * 1000.0;
+        double scale_x = scale_y * cos(D2R(geometry.center_lat));
+        auto x = [&](double lon) {
+            double delta = lon - geometry.center_lon;
+            delta += (delta > 180.0) ? -360.0 : (delta < -180.0) ? 360.0 : 0.0;
+            return delta * scale_x;
+        };
+        return SegmentCircleCrossings<double>(x(a.lon),
+            (a.lat - geometry.center_lat) * scale_y, x(b.lon),
+            (b.lat - geometry.center_lat) * scale_y, geometry.radius, first, last);
+    }
+#if GEOFENCE_ENABLE_RECTANGLE
+    if(hot.shape == (uint8_t)GeofenceShapeType::RECTANGLE) {
+        // Longitudes relative to the middle of the rectangle
+        auto& rectangle = geometry.rectangle;
+#if GEOFENCE_USE_FIXED_POINT
+        int64_t middle = rectangle.west + rectangle.width / 2;
+        int32_t middle_lat = rectangle.min_lat / 2 + rectangle.max_lat / 2;
+        return SegmentRectangleCrossings<float>(
+            WrapLonE7((int64_t)_previous_lon_e7 - middle),
+            (float)(_previous_lat_e7 - middle_lat),
+            WrapLonE7((int64_t)_point_lon_e7 - middle),
+            (float)(_point_lat_e7 - middle_lat), rectangle.width * 0.5f,
+            (float)(rectangle.min_lat - middle_lat), (float)(rectangle.max_lat - middle_lat),
+            first, last);
+#else
+        double middle = rectangle.west + rectangle.width * 0.5;
+        auto x = [middle](double lon) {
+            double delta = lon - middle;
+            return delta + ((delta > 180.0) ? -360.0 : (delta < -180.0) ? 360.0 : 0.0);
+        };
+        return SegmentRectangleCrossings<double>(x(a.lon), a.lat, x(b.lon), b.lat,
+            rectangle.width * 0.5, rectangle.min_lat, rectangle.max_lat, first, last);
+#endif
+    }
+#endif
+#if GEOFENCE_ENABLE_POLYGON
+    if(hot.shape != (uint8_t)GeofenceShapeType::POLYGONAL) {
+        return 0;
+    }
+
+    // Edges relative to the previous fix
+    const GeofenceCompiledVertex* points = ZoneVertices.data() + hot.vertex_offset;
+    int count = 0;
+#if GEOFENCE_USE_FIXED_POINT
+    int32_t a_lat = _previous_lat_e7;
+    int32_t a_lon = WrapLonE7((int64_t)_previous_lon_e7 - geometry.ref_lon);
+    float dx = WrapLonE7((int64_t)WrapLonE7((int64_t)_point_lon_e7 - geometry.ref_lon) - a_lon);
+    float dy = (float)(_point_lat_e7 - a_lat);
+    for(int i = 0, j = hot.num_points - 1; i < hot.num_points; j = i++) {
+        AddEdgeCrossing<float>(dx, dy,
+            WrapLonE7((int64_t)points[j].lon - a_lon),
+            (float)(points[j].lat - a_lat),
+            WrapLonE7((int64_t)points[i].lon - points[j].lon),
+            (float)(points[i].lat - points[j].lat), count, first, last);
+    }
+#else
+    double a_lon = a.lon;
+    double b_lon = b.lon;
+    if(hot.flags & GeofenceZoneHot::DATELINE) {
+        a_lon += (a_lon < 0.0) ? 360.0 : 0.0;
+        b_lon += (b_lon < 0.0) ? 360.0 : 0.0;
+    }
+    // Shortest way around, also for zones away from the date line
+    auto wrap = [](double delta) {
+        return delta + ((delta > 180.0) ? -360.0 : (delta < -180.0) ? 360.0 : 0.0);
+    };
+    double dx = wrap(b_lon - a_lon);
+    for(int i = 0, j = hot.num_points - 1; i < hot.num_points; j = i++) {
+        AddEdgeCrossing<double>(dx, b.lat - a.lat,
+            wrap(points[j].lon - a_lon), points[j].lat - a.lat,
+            points[i].lon - points[j].lon, points[i].lat - points[j].lat,
+            count, first, last);
     }
+#endif
+    return count;
+#else
+    return 0;
+#endif
+}
+
+time_t Geofence::CrossingTime(float fraction) const {
+    return _previous_point.gps_time + (time_t)lround(fraction *
+        (double)(_geofence_point.gps_time - _previous_point.gps_time));
 }
 
 bool Geofence::IsEventTriggered(bool outside_geofence,
-                        ZoneInfo& zone,
+                        const GeofenceZoneHot& hot,
                         int zone_index) {
-    bool returnval = false;
+#if GEOFENCE_ENABLE_VERIFICATION
+    auto& state = GeofenceZoneStates.at(zone_index);
+    int slot = ZoneSlotIndex.at(zone_index);
     bool stable =
-        ((outside_geofence && GeofenceZoneStates.at(zone_index).pending_event == GeofenceEventType::OUTSIDE) ||
-            (!outside_geofence && GeofenceZoneStates.at(zone_index).pending_event == GeofenceEventType::INSIDE)) ||
-                (!zone.verification_time_sec);
-    if(!GeofenceZoneStates.at(zone_index).pending_time_ms || !stable) {
-        GeofenceZoneStates.at(zone_index).pending_event = (outside_geofence)?
+        ((outside_geofence && state.pending_event == GeofenceEventType::OUTSIDE) ||
+            (!outside_geofence && state.pending_event == GeofenceEventType::INSIDE)) ||
+                (!hot.verification_ms);
+    if(!state.pending_time_ms || !stable) {
+        uint64_t now = System.millis();
+        state.pending_event = (outside_geofence)?
                     GeofenceEventType::OUTSIDE : GeofenceEventType::INSIDE;
-        GeofenceZoneStates.at(zone_index).pending_time_ms = System.millis();
+        state.pending_time_ms = (uint32_t)now;
+        if(hot.verification_ms) {
+            _verification_timers.Schedule(slot, now + hot.verification_ms);
+        }
     }
-    if(System.millis() - GeofenceZoneStates.at(zone_index).pending_time_ms >=
-            zone.verification_time_sec*1000 && stable) {
-        returnval = true;
+    if(!stable) {
+        return false;
+    }
+    // A pending transition is confirmed once its timer has expired, the
+    // wheel only advances at the start of loop() so check the deadline too
+    if(_verification_timers.IsScheduled(slot)) {
+        if(_verification_timers.GetDeadline(slot) > System.millis()) {
+            return false;
+        }
+        _verification_timers.Cancel(slot);
     }
-    return returnval;
+#else
+    (void)outside_geofence;
+    (void)hot;
+    (void)zone_index;
+#endif
+    return true;
+}
+
+bool Geofence::GetNextDeadline(uint64_t& deadline_ms) const {
+#if GEOFENCE_ENABLE_VERIFICATION
+    return _verification_timers.NextDeadline(deadline_ms);
+#else
+    (void)deadline_ms;
+    return false;
+#endif
 }
 
+#if GEOFENCE_ENABLE_VERTICES
 int Geofence::HowManyPolygonPointsEnabled(Vector<PolygonPoint>& poly_points) {
     int count = 0;
 
@@ -188,82 +2504,512 @@ double Geofence::CalculateLonDatelineOffset(Vector<PolygonPoint>& poly_points) {
 
     return offset;
 }
+#endif // GEOFENCE_ENABLE_VERTICES
 
 void Geofence::GpsDistance(double las,
                             double los,
                             double lae,
                             double loe,
                             double& d) {
-    double df, dfi, a;
-
-    /* Convert degrees to radians */
-    df = D2R(lae - las);
-    dfi = D2R(loe - los);
-    las = D2R(las);
-    los = D2R(los);
-    lae = D2R(lae);
-    loe = D2R(loe);
-
-    /*
-    * Calculate distance
-    *
-    * Calculated distance is absolute value in meters between 2 points on earth.
-    *
-    *
-    * a = sin(df / 2)^2 + cos(las) * cos(lae) * sin(dfi / 2)^2
-    * d = RADIUS * 2 * atan(a / (1 - a)) * 1000 (for meters)
-    */
-    a = (double)(sin(df * 0.5) * sin(df * 0.5) + sin(dfi * 0.5) * sin(dfi * 0.5) * cos(las) * cos(lae));
-    d = (double)(EARTH_RADIUS * 2.0 * atan2(sqrt(a), sqrt(1.0 - a)) * 1000.0);
+    d = GeofenceDistanceModel::Distance(las, los, lae, loe);
 }
 
-bool Geofence::IsPointInPolygon(Vector<PolygonPoint>& poly_points,
+#if GEOFENCE_ENABLE_POLYGON
+bool Geofence::IsPointInPolygon(const GeofenceVertex* points,
+                    int count,
                     double point_lat,
                     double point_lon) {
-    double offset;
-    int num_points_enabled = HowManyPolygonPointsEnabled(poly_points);
-    int i, j= num_points_enabled-1;
     bool  odd_nodes = false;
 
-    offset = CalculateLonDatelineOffset(poly_points);
-    if(point_lon < 0.0) {point_lon += offset;}
-
-    if(num_points_enabled) {
-        //vector of only enabled polygon points
-        Vector<PolygonPoint> enabled_poly_points;
-        for(auto iter : poly_points) {
-            if(iter.enable) {enabled_poly_points.append(iter);}
-        }
-
-        for(i=0; i < num_points_enabled; i++) {
-            double point_i_lon = enabled_poly_points.at(i).lon;
-            double point_j_lon = enabled_poly_points.at(j).lon;
-
-            if(point_i_lon < 0.0) {point_i_lon += offset;}
-            if(point_j_lon < 0.0) {point_j_lon += offset;}
-
-            //is point latitude between polygon line segment
-            if((enabled_poly_points.at(i).lat < point_lat &&
-                enabled_poly_points.at(j).lat >= point_lat) ||
-                    (enabled_poly_points.at(j).lat < point_lat &&
-                        enabled_poly_points.at(i).lat >= point_lat)) {
-                //is point to the right of polygon line segment
-                //lonp > (lon1-lon2)*(latp-lat2)/(lat1-lat2)+lon2
-                if(point_lon > (point_j_lon+(point_i_lon-point_j_lon)*
-                        (point_lat-enabled_poly_points.at(j).lat)/
-                            (enabled_poly_points.at(i).lat-enabled_poly_points.at(j).lat))) {
-                    odd_nodes=!odd_nodes;
-                }
+    for(int i = 0, j = count - 1; i < count; j = i++) {
+        //is point latitude between polygon line segment
+        if((points[i].lat < point_lat && points[j].lat >= point_lat) ||
+                (points[j].lat < point_lat && points[i].lat >= point_lat)) {
+            //is point to the right of polygon line segment
+            //lonp > (lon1-lon2)*(latp-lat2)/(lat1-lat2)+lon2
+            if(point_lon > (points[j].lon+(points[i].lon-points[j].lon)*
+                    (point_lat-points[j].lat)/
+                        (points[i].lat-points[j].lat))) {
+                odd_nodes=!odd_nodes;
+            }
+        }
+    }
+
+    return odd_nodes;
+}
+#endif // GEOFENCE_ENABLE_POLYGON
+
+#if GEOFENCE_USE_FIXED_POINT
+void Geofence::CompileCircleFixed(const ZoneInfo& zone,
+                        GeofenceZoneGeometry& geometry) {
+    geometry.fixed_circle = (zone.radius <= GEOFENCE_FIXED_MAX_RADIUS) &&
+        (fabs(zone.center_lat) <= GEOFENCE_FIXED_MAX_LAT);
+    if(!geometry.fixed_circle) {
+        return;
+    }
+    double lat = D2R(zone.center_lat);
+    double delta = zone.radius / (EARTH_RADIUS * 1000.0);
+    geometry.center_lat_e7 = ToE7(zone.center_lat);
+    geometry.center_lon_e7 = ToE7(zone.center_lon);
+    // Latitude and longitude extent of the circle, plus rounding margin
+    geometry.lat_limit = ToE7(delta / D2R(1.0)) + 2;
+    geometry.lon_limit = ToE7(asin(sin(delta) / cos(lat)) / D2R(1.0)) + 2;
+    geometry.cos_lat = (float)cos(lat);
+    geometry.sin_lat = (float)sin(lat);
+    geometry.threshold = (float)(sin(delta * 0.5) * sin(delta * 0.5));
+}
+
+bool Geofence::IsCircularGeofenceOutsideFixed(
+                        const GeofenceZoneGeometry& geometry) {
+    int32_t dlat = _point_lat_e7 - geometry.center_lat_e7;
+    int32_t dlon = WrapLonE7((int64_t)_point_lon_e7 - geometry.center_lon_e7);
+    if(abs(dlat) > geometry.lat_limit || abs(dlon) > geometry.lon_limit) {
+        return true;
+    }
+    return HaversineTermFixed(geometry, dlat, dlon) > geometry.threshold;
+}
+
+#if GEOFENCE_ENABLE_POLYGON
+bool Geofence::IsPointInPolygonFixed(const GeofenceZoneGeometry& geometry,
+                        const GeofenceFixedVertex* points,
+                        int count) {
+    int32_t point_lat = _point_lat_e7;
+    int32_t point_lon = WrapLonE7((int64_t)_point_lon_e7 - geometry.ref_lon);
+    bool odd_nodes = false;
+
+    for(int i = 0, j = count - 1; i < count; j = i++) {
+        //is point latitude between polygon line segment
+        if((points[i].lat < point_lat && points[j].lat >= point_lat) ||
+                (points[j].lat < point_lat && points[i].lat >= point_lat)) {
+            //lonp > (lon1-lon2)*(latp-lat2)/(lat1-lat2)+lon2, multiplied out
+            //by (lat1-lat2) so the comparison flips when it is negative
+            int64_t lhs = ((int64_t)point_lon - points[j].lon) *
+                (points[i].lat - points[j].lat);
+            int64_t rhs = ((int64_t)points[i].lon - points[j].lon) *
+                ((int64_t)point_lat - points[j].lat);
+            if((points[i].lat > points[j].lat) ? (lhs > rhs) : (lhs < rhs)) {
+                odd_nodes = !odd_nodes;
             }
-            j=i;
         }
     }
 
     return odd_nodes;
 }
+#endif // GEOFENCE_ENABLE_POLYGON
+#endif
+
+double Geofence::ZoneSignedDistance(int dense, double lat, double lon) {
+    auto& hot = ZoneHot.at(dense);
+    auto& geometry = ZoneGeometry.at(dense);
+
+    if(hot.shape == (uint8_t)GeofenceShapeType::CIRCULAR) {
+#if GEOFENCE_USE_FIXED_POINT
+        int32_t dlat = ToE7(lat) - geometry.center_lat_e7;
+        int32_t dlon = WrapLonE7((int64_t)ToE7(lon) - geometry.center_lon_e7);
+        if(geometry.fixed_circle && abs(dlat) <= geometry.lat_limit &&
+                abs(dlon) <= geometry.lon_limit) {
+            float a = HaversineTermFixed(geometry, dlat, dlon);
+            return 2.0f * (float)(EARTH_RADIUS * 1000.0) * asinf(sqrtf(a)) -
+                (float)geometry.radius;
+        }
+#endif
+        double distance;
+        GpsDistance(geometry.center_lat, geometry.center_lon, lat, lon, distance);
+        return distance - geometry.radius;
+    }
+
+#if GEOFENCE_ENABLE_RECTANGLE
+    if(hot.shape == (uint8_t)GeofenceShapeType::RECTANGLE) {
+        // Offsets from the middle in meters, in a local projection at the point
+        auto& rectangle = geometry.rectangle;
+#if GEOFENCE_USE_FIXED_POINT
+        const double unit = E7;
+#else
+        const double unit = 1.0;
+#endif
+        double scale_y = D2R(1.0) * EARTH_RADIUS * 1000.0;
+        double scale_x = scale_y * cos(D2R(lat));
+        double half_width = rectangle.width / unit * 0.5;
+        double half_height = (rectangle.max_lat - rectangle.min_lat) / unit * 0.5;
+        double dlon = lon - (rectangle.west / unit + half_width);
+        dlon += (dlon > 180.0) ? -360.0 : (dlon < -180.0) ? 360.0 : 0.0;
+        double dlat = lat - (rectangle.min_lat + rectangle.max_lat) / unit * 0.5;
+        double x = (fabs(dlon) - half_width) * scale_x;
+        double y = (fabs(dlat) - half_height) * scale_y;
+        if(x <= 0.0 && y <= 0.0) {
+            return std::max(x, y);
+        }
+        return sqrt(std::max(x, 0.0) * std::max(x, 0.0) + std::max(y, 0.0) * std::max(y, 0.0));
+    }
+#endif
+
+#if GEOFENCE_ENABLE_VERTICES
+    const GeofenceCompiledVertex* points = ZoneVertices.data() + hot.vertex_offset;
+    int count = hot.num_points;
+    if(!count) {
+        return HUGE_VAL;
+    }
+    // Vertices in meters in a local projection at the point
+#if GEOFENCE_USE_FIXED_POINT
+    using Real = float;
+    int32_t point_lat = ToE7(lat);
+    int32_t point_lon = WrapLonE7((int64_t)ToE7(lon) - geometry.ref_lon);
+    float scale_x = METERS_PER_E7 * cosf((float)D2R(lat));
+    auto x = [&](int i) {
+        return WrapLonE7((int64_t)points[i].lon - point_lon) * scale_x;
+    };
+    auto y = [&](int i) {
+        return (float)(points[i].lat - point_lat) * METERS_PER_E7;
+    };
+#else
+    using Real = double;
+    double scale_y = D2R(1.0) * EARTH_RADIUS * 1000.0;
+    double scale_x = scale_y * cos(D2R(lat));
+    auto x = [&](int i) {
+        // Also removes the date line offset
+        double delta = points[i].lon - lon;
+        delta += (delta > 180.0) ? -360.0 : (delta < -180.0) ? 360.0 : 0.0;
+        return delta * scale_x;
+    };
+    auto y = [&](int i) {
+        return (points[i].lat - lat) * scale_y;
+    };
+#endif
+
+#if GEOFENCE_ENABLE_CORRIDOR
+    if(hot.shape == (uint8_t)GeofenceShapeType::CORRIDOR) {
+        auto segment_distance_sq = [&](int i, int j) {
+            return SegmentDistanceSq<Real>(x(i), y(i), x(j), y(j));
+        };
+        // Nearest segment through the segment index, skipping boxes further
+        // than the nearest segment found so far
+        int last = count - 1;
+        int segments = std::max(last, 1);
+        int leaves = geometry.segment_leaves;
+        const GeofenceSegmentBox* boxes = geometry.segment_boxes.data();
+        Real nearest = HUGE_VAL;
+        int stack[40];
+        int top = 0;
+        stack[top++] = 1;
+        while(top) {
+            int node = stack[--top];
+            float bound = BoxDistanceBound(boxes[node], (float)lat, (float)lon);
+            if(bound > 0.0f && (Real)bound * bound >= nearest) {
+                continue;
+            }
+            if(node < leaves) {
+                stack[top++] = node * 2 + 1;
+                stack[top++] = node * 2;
+                continue;
+            }
+            int first = (node - leaves) * CORRIDOR_LEAF_SEGMENTS;
+            int end = std::min(first + CORRIDOR_LEAF_SEGMENTS, segments);
+            for(int i = first; i < end; i++) {
+                nearest = std::min(nearest, segment_distance_sq(i, std::min(i + 1, last)));
+            }
+        }
+        return sqrt((double)nearest) - geometry.radius;
+    }
+#endif
+
+#if GEOFENCE_ENABLE_POLYGON
+    Real nearest = HUGE_VAL;
+    bool inside = false;
+    for(int i = 0, j = count - 1; i < count; j = i++) {
+        Real xi = x(i), yi = y(i), xj = x(j), yj = y(j);
+        nearest = std::min(nearest, SegmentDistanceSq<Real>(xi, yi, xj, yj));
+        // Even-odd rule with a ray from the point towards east
+        if(((yi < Real(0)) != (yj < Real(0))) &&
+                (xi + (xj - xi) * -yi / (yj - yi) > Real(0))) {
+            inside = !inside;
+        }
+    }
+    double distance = sqrt((double)nearest);
+    return inside ? -distance : distance;
+#endif
+#endif // GEOFENCE_ENABLE_VERTICES
+    return HUGE_VAL;
+}
+
+bool Geofence::BuildZoneIndex() {
+    ZoneIndex.clear();
+    ZoneIndexOrder.clear();
+    if(!ZoneIndexOrder.reserve(ZoneHot.size())) {
+        return false;
+    }
+    for(int dense = 0; dense < ZoneHot.size(); dense++) {
+        // Zones without geometry have an empty box
+        if(ZoneHot.at(dense).min_lat <= ZoneHot.at(dense).max_lat) {
+            ZoneIndexOrder.append((uint16_t)dense);
+        }
+    }
+    // Leaves hold at least two zones unless there is only one, so the tree
+    // has fewer nodes than zones and building it doesn't allocate again
+    int count = ZoneIndexOrder.size();
+    if(!ZoneIndex.reserve(std::max(count, 1)) || !ZoneIndex.resize(1)) {
+        return false;
+    }
+    BuildZoneIndexNode(0, 0, count);
+    _index_dirty = false;
+    return true;
+}
+
+void Geofence::BuildZoneIndexNode(int node, int first, int count) {
+    GeofenceIndexNode box = {EMPTY_BOX, -EMPTY_BOX, EMPTY_BOX, -EMPTY_BOX, first, count};
+    float min_lat = EMPTY_BOX, max_lat = -EMPTY_BOX, min_lon = EMPTY_BOX, max_lon = -EMPTY_BOX;
+    for(int i = first; i < first + count; i++) {
+        auto& hot = ZoneHot.at(ZoneIndexOrder.at(i));
+        box.min_lat = std::min(box.min_lat, hot.min_lat);
+        box.max_lat = std::max(box.max_lat, hot.max_lat);
+        box.min_lon = std::min(box.min_lon, hot.min_lon);
+        box.max_lon = std::max(box.max_lon, hot.max_lon);
+        // Extent of the box centers
+        float lat = (hot.min_lat + hot.max_lat) * 0.5f;
+        float lon = (hot.min_lon + hot.max_lon) * 0.5f;
+        min_lat = std::min(min_lat, lat);
+        max_lat = std::max(max_lat, lat);
+        min_lon = std::min(min_lon, lon);
+        max_lon = std::max(max_lon, lon);
+    }
+    if(count <= ZONE_INDEX_LEAF_SIZE) {
+        ZoneIndex.at(node) = box;
+        return;
+    }
+
+    bool split_lat = (max_lat - min_lat) > (max_lon - min_lon);
+    uint16_t* order = ZoneIndexOrder.data() + first;
+    int half = count / 2;
+    std::nth_element(order, order + half, order + count,
+        [this, split_lat](uint16_t a, uint16_t b) {
+            auto& hot_a = ZoneHot.at(a);
+            auto& hot_b = ZoneHot.at(b);
+            return split_lat ? (hot_a.min_lat + hot_a.max_lat < hot_b.min_lat + hot_b.max_lat) :
+                (hot_a.min_lon + hot_a.max_lon < hot_b.min_lon + hot_b.max_lon);
+        });
+    box.first = ZoneIndex.size();
+    box.count = 0;
+    ZoneIndex.at(node) = box;
+    ZoneIndex.resize(ZoneIndex.size() + 2);
+    BuildZoneIndexNode(box.first, first, half);
+    BuildZoneIndexNode(box.first + 1, first + half, count - half);
+}
+
+int Geofence::FindNearestZones(double lat, double lon,
+                GeofenceZoneDistance* results,
+                int max_results,
+                uint32_t groups) {
+    CompileDirtyZones();
+    if(_index_dirty && !BuildZoneIndex()) {
+        return SYSTEM_ERROR_NO_MEMORY;
+    }
+    if(max_results <= 0 || ZoneIndexOrder.isEmpty()) {
+        return 0;
+    }
+
+    // Best first: nodes are visited in order of the lower bound of their
+    // distance until no node can hold a zone closer than the results
+    struct Pending {
+        float bound;
+        int node;
+        bool operator<(const Pending& other) const {
+            return bound > other.bound;
+        }
+    };
+    Vector<Pending> queue;
+    if(!queue.reserve(32)) {
+        return SYSTEM_ERROR_NO_MEMORY;
+    }
+    float point_lat = (float)lat;
+    float point_lon = (float)lon;
+    int found = 0;
+    queue.append({BoxDistanceBound(ZoneIndex.at(0), point_lat, point_lon), 0});
+    while(!queue.isEmpty()) {
+        std::pop_heap(queue.begin(), queue.end());
+        Pending pending = queue.takeLast();
+        if(found == max_results && pending.bound >= results[found - 1].distance) {
+            break;
+        }
+        auto& node = ZoneIndex.at(pending.node);
+        if(!node.count) {
+            for(int child = node.first; child < node.first + 2; child++) {
+                if(!queue.append({BoxDistanceBound(ZoneIndex.at(child),
+                        point_lat, point_lon), child})) {
+                    return SYSTEM_ERROR_NO_MEMORY;
+                }
+                std::push_heap(queue.begin(), queue.end());
+            }
+            continue;
+        }
+
+        for(int i = node.first; i < node.first + node.count; i++) {
+            int dense = ZoneIndexOrder.at(i);
+            if(groups != GEOFENCE_GROUP_ALL && !(ZoneGeometry.at(dense).groups & groups)) {
+                continue;
+            }
+            if(found == max_results && BoxDistanceBound(ZoneHot.at(dense),
+                    point_lat, point_lon) >= results[found - 1].distance) {
+                continue;
+            }
+            double distance = ZoneSignedDistance(dense, lat, lon);
+            if(found == max_results && distance >= results[found - 1].distance) {
+                continue;
+            }
+            // Insertion into the sorted results
+            int k = (found < max_results) ? found++ : found - 1;
+            for(; k > 0 && results[k - 1].distance > distance; k--) {
+                results[k] = results[k - 1];
+            }
+            results[k].handle = GetZoneHandle(ZoneSlotIndex.at(dense));
+            results[k].distance = distance;
+        }
+    }
+    return found;
+}
 
+size_t Geofence::GetZoneStateSnapshotSize() const {
+    return SNAPSHOT_HEADER_SIZE + GeofenceZoneStates.size() * SNAPSHOT_RECORD_SIZE;
+}
+
+int Geofence::SaveZoneStates(uint8_t* buffer, size_t size,
+                        uint32_t zone_set_version) {
+    size_t snapshot_size = GetZoneStateSnapshotSize();
+    if(size < snapshot_size) {
+        return SYSTEM_ERROR_TOO_LARGE;
+    }
+
+    /*
+    * Header: magic(2) format(1) reserved(1) version(4) count(2) reserved(2) crc(4)
+    * Record: zone index(2) config hash(4) prev/pending event(1)
+    *         pending elapsed 100ms(3)
+    */
+#if GEOFENCE_ENABLE_VERIFICATION
+    uint32_t now = (uint32_t)System.millis();
+#endif
+    uint8_t* record = buffer + SNAPSHOT_HEADER_SIZE;
+    for(int i = 0; i < GeofenceZoneStates.size(); i++) {
+        auto& state = GeofenceZoneStates.at(i);
+        auto pending = GeofenceEventType::UNKNOWN;
+        uint32_t elapsed = 0;
+#if GEOFENCE_ENABLE_VERIFICATION
+        pending = state.pending_event;
+        if(pending != GeofenceEventType::UNKNOWN) {
+            elapsed = std::min<uint32_t>(
+                (now - state.pending_time_ms) / 100, SNAPSHOT_ELAPSED_MAX);
+        }
+#endif
+        PutLe(record, ZoneSlotIndex.at(i), 2);
+        PutLe(record + 2, ZoneConfigHash(GeofenceZones.at(i)), 4);
+        record[6] = (uint8_t)state.prev_event | ((uint8_t)pending << 4);
+        PutLe(record + 7, elapsed, 3);
+        record += SNAPSHOT_RECORD_SIZE;
+    }
 
+    PutLe(buffer, SNAPSHOT_MAGIC, 2);
+    buffer[2] = SNAPSHOT_FORMAT;
+    buffer[3] = 0;
+    PutLe(buffer + 4, zone_set_version, 4);
+    PutLe(buffer + 8, GeofenceZoneStates.size(), 2);
+    PutLe(buffer + 10, 0, 2);
+    uint32_t crc = Crc32(buffer, 12);
+    crc = Crc32(buffer + SNAPSHOT_HEADER_SIZE,
+        snapshot_size - SNAPSHOT_HEADER_SIZE, crc);
+    PutLe(buffer + 12, crc, 4);
 
+    return (int)snapshot_size;
+}
+
+int Geofence::GetZoneStateSnapshotVersion(const uint8_t* buffer, size_t size,
+                        uint32_t& zone_set_version) {
+    int count = CheckSnapshot(buffer, size);
+    if(count < 0) {
+        return count;
+    }
+    zone_set_version = GetLe(buffer + 4, 4);
+    return SYSTEM_ERROR_NONE;
+}
+
+int Geofence::RestoreZoneStates(const uint8_t* buffer, size_t size) {
+    int count = CheckSnapshot(buffer, size);
+    if(count < 0) {
+        return count;
+    }
 
+#if GEOFENCE_ENABLE_VERIFICATION
+    uint64_t now = System.millis();
+    _verification_timers.Advance(now);
+#endif
+    CompileDirtyZones();
+    int restored = 0;
+    const uint8_t* record = buffer + SNAPSHOT_HEADER_SIZE;
+    for(int r = 0; r < count; r++, record += SNAPSHOT_RECORD_SIZE) {
+        int slot = (int)GetLe(record, 2);
+        if(slot >= _slots.size() || _slots.at(slot).dense < 0) {
+            continue;
+        }
+        int dense = _slots.at(slot).dense;
+        if(GetLe(record + 2, 4) != ZoneConfigHash(GeofenceZones.at(dense))) {
+            continue;
+        }
+        auto prev = (GeofenceEventType)(record[6] & 0x0F);
+        auto pending = (GeofenceEventType)(record[6] >> 4);
+        if(prev > GeofenceEventType::EXIT || pending > GeofenceEventType::EXIT) {
+            continue;
+        }
+        auto& state = GeofenceZoneStates.at(dense);
+        state.prev_event = prev;
+#if GEOFENCE_ENABLE_VERIFICATION
+        state.pending_event = pending;
+        state.pending_time_ms = 0;
+        if(pending != GeofenceEventType::UNKNOWN) {
+            // Unsigned arithmetic keeps millis() - pending_time_ms correct even
+            // when the elapsed time is longer than the current uptime
+            uint32_t elapsed = GetLe(record + 7, 3) * 100;
+            state.pending_time_ms = (uint32_t)now - elapsed;
+            uint32_t verification_ms = ZoneHot.at(dense).verification_ms;
+            if(verification_ms > elapsed) {
+                _verification_timers.Schedule(ZoneSlotIndex.at(dense),
+                    now + (verification_ms - elapsed));
+            }
+            else {
+                _verification_timers.Cancel(ZoneSlotIndex.at(dense));
+            }
+        }
+        else {
+            _verification_timers.Cancel(ZoneSlotIndex.at(dense));
+        }
+#endif
+        restored++;
+    }
 
+    return restored;
+}
 
+uint32_t Geofence::ZoneConfigHash(const ZoneInfo& zone) const {
+    // Only what the zone state depends on, event selection can change freely
+    uint8_t shape = (uint8_t)zone.shape_type;
+    uint32_t crc = Crc32(&shape, sizeof(shape));
+    crc = Crc32(&zone.verification_time_sec, sizeof(zone.verification_time_sec), crc);
+    if(zone.shape_type == GeofenceShapeType::CIRCULAR) {
+        crc = Crc32(&zone.radius, sizeof(zone.radius), crc);
+        crc = Crc32(&zone.center_lat, sizeof(zone.center_lat), crc);
+        crc = Crc32(&zone.center_lon, sizeof(zone.center_lon), crc);
+    }
+    else if(zone.shape_type == GeofenceShapeType::RECTANGLE) {
+        crc = Crc32(&zone.min_lat, sizeof(zone.min_lat), crc);
+        crc = Crc32(&zone.max_lat, sizeof(zone.max_lat), crc);
+        crc = Crc32(&zone.min_lon, sizeof(zone.min_lon), crc);
+        crc = Crc32(&zone.max_lon, sizeof(zone.max_lon), crc);
+    }
+    else {
+        if(zone.shape_type == GeofenceShapeType::CORRIDOR) {
+            crc = Crc32(&zone.radius, sizeof(zone.radius), crc);
+        }
+        for(auto& point : zone.polygon_points) {
+            if(point.enable) {
+                crc = Crc32(&point.lat, sizeof(point.lat), crc);
+                crc = Crc32(&point.lon, sizeof(point.lon), crc);
+            }
+        }
+    }
+    return crc;
+}
@@ -16,11 +16,13 @@
 #pragma once
 
 #include "Particle.h"
+#include "GeofenceDelegate.h"
+#include "GeofenceDistance.h"
 #include <atomic>
 
 //forward declaration of struct and enum class
 struct CallbackContext;
-enum class GeofenceEventType;
+enum class GeofenceEventType : uint8_t;
 
 /**
  * @brief Default maximum dilution of precison that can be used in
@@ -32,9 +34,119 @@ constexpr double GEOFENCE_MAXIMUM_DOP = 7.5; // Middle of moderate DOP values
 /**
  * @brief Type definition of geofence event callback signature.
  *
+ * @details Accepts functions, lambdas and other callables up to
+ * GEOFENCE_DELEGATE_SIZE bytes, or a function taking a context pointer
+ * together with the context, without allocating memory.
+ *
  */
 using GeofenceEventCallback =
-        std::function<void(CallbackContext& context)>;
+        GeofenceDelegate<void(CallbackContext& context)>;
+
+/**
+ * @brief Type definition of batched geofence event callback signature.
+ *
+ * @details Receives the selected events of one loop() call together, in the
+ * order they occurred. The events are only valid during the call.
+ *
+ */
+using GeofenceBatchCallback =
+        GeofenceDelegate<void(const CallbackContext* events, int count)>;
+
+/**
+ * @brief Evaluate zones with the fixed-point engine instead of double
+ * precision
+ *
+ * @details Coordinates are converted to int32 E7 (1e-7 degree, about 1.1 cm)
+ * when a zone is compiled. Polygon crossing tests then use exact integer
+ * arithmetic and circle tests single precision floats only, which avoids
+ * software emulated double precision math on targets with a single precision
+ * FPU. The circle distance stays within 5 cm of the double precision result
+ * for radii up to GEOFENCE_FIXED_MAX_RADIUS and centers up to
+ * GEOFENCE_FIXED_MAX_LAT degrees from the equator. Other circles are still
+ * evaluated in double precision. The fixed-point circle test is always
+ * haversine based, GEOFENCE_DISTANCE_MODEL only applies to the circles it
+ * doesn't handle.
+ *
+ */
+#ifndef GEOFENCE_USE_FIXED_POINT
+#define GEOFENCE_USE_FIXED_POINT 0
+#endif
+
+/**
+ * @brief Largest circle radius in meters evaluated by the fixed-point engine
+ *
+ */
+constexpr double GEOFENCE_FIXED_MAX_RADIUS = 50000.0;
+
+/**
+ * @brief Largest absolute circle center latitude in degrees evaluated by the
+ * fixed-point engine
+ *
+ */
+constexpr double GEOFENCE_FIXED_MAX_LAT = 85.0;
+
+/**
+ * @brief Allocator of the vertex arena holding the polygon vertices of all
+ * zones, a type with static malloc(), realloc() and free() like
+ * spark::DefaultAllocator. Define to place the arena in a dedicated pool.
+ *
+ */
+#ifndef GEOFENCE_VERTEX_ALLOCATOR
+#define GEOFENCE_VERTEX_ALLOCATOR spark::DefaultAllocator
+#endif
+
+/**
+ * @brief Number of consecutive corridor segments covered by a leaf of the
+ * segment index. Smaller leaves prune more segments per fix at the cost of a
+ * larger index.
+ *
+ */
+#ifndef GEOFENCE_CORRIDOR_LEAF_SEGMENTS
+#define GEOFENCE_CORRIDOR_LEAF_SEGMENTS 8
+#endif
+
+/**
+ * @brief Number of inscribed rectangles kept per polygon. A point within one
+ * of them is inside without testing any edge. 0 leaves them out.
+ *
+ */
+#ifndef GEOFENCE_POLYGON_CORES
+#define GEOFENCE_POLYGON_CORES 2
+#endif
+
+/**
+ * @brief Features that can be left out to save flash and RAM
+ *
+ * @details Set to 0 to remove the code and the per zone data of a feature.
+ * Zones of a disabled shape are rejected by AddZone() and SetZoneInfo().
+ * Without verification, verification_time_sec is ignored and events are
+ * confirmed by the first point. Without stats, GetEvaluationStats() and
+ * GetLatencyHistogram() always return zeros. Without async delivery,
+ * callbacks always run in loop().
+ * Circular zones are always available.
+ *
+ */
+#ifndef GEOFENCE_ENABLE_POLYGON
+#define GEOFENCE_ENABLE_POLYGON 1
+#endif
+#ifndef GEOFENCE_ENABLE_CORRIDOR
+#define GEOFENCE_ENABLE_CORRIDOR 1
+#endif
+#ifndef GEOFENCE_ENABLE_RECTANGLE
+#define GEOFENCE_ENABLE_RECTANGLE 1
+#endif
+#ifndef GEOFENCE_ENABLE_VERIFICATION
+#define GEOFENCE_ENABLE_VERIFICATION 1
+#endif
+#ifndef GEOFENCE_ENABLE_STATS
+#define GEOFENCE_ENABLE_STATS 1
+#endif
+#ifndef GEOFENCE_ENABLE_ASYNC
+#define GEOFENCE_ENABLE_ASYNC 1
+#endif
+
+// Polygon vertices are stored for polygons and corridors
+#define GEOFENCE_ENABLE_VERTICES (GEOFENCE_ENABLE_POLYGON || GEOFENCE_ENABLE_CORRIDOR)
 
 /**
  * @brief Max number of polygon points that can be used
@@ -42,7 +154,7 @@ using GeofenceEventCallback =
  */
 constexpr int NUM_OF_POLYGON_POINTS = 10;
 
-enum class GeofenceEventType {
+enum class GeofenceEventType : uint8_t {
     UNKNOWN,                ///< Unknown event type
     POOR_LOCATION,          ///< The current location doesn't pass evaluation quality
     INSIDE,                 ///< The current location is inside of the zone
@@ -51,6 +163,59 @@ enum class GeofenceEventType {
     EXIT,                   ///< The current location has exited the zone
 };
 
+/**
+ * @brief Bit mask of event types, used to select the events a subscriber
+ * receives
+ *
+ */
+using GeofenceEventMask = uint32_t;
+
+/**
+ * @brief Event mask bit of an event type
+ *
+ */
+constexpr GeofenceEventMask GeofenceEventBit(GeofenceEventType type) {
+    return (GeofenceEventMask)1 << (int)type;
+}
+
+constexpr GeofenceEventMask GEOFENCE_EVENT_MASK_ALL = 0x7FFFFFFF;
+
+/**
+ * @brief Event types that can be dispatched, the code for the others is
+ * left out, for example
+ * (GeofenceEventBit(GeofenceEventType::ENTER) | GeofenceEventBit(GeofenceEventType::EXIT))
+ * for a product that only needs ENTER and EXIT
+ *
+ */
+#ifndef GEOFENCE_ENABLED_EVENTS
+#define GEOFENCE_ENABLED_EVENTS GEOFENCE_EVENT_MASK_ALL
+#endif
+
+/**
+ * @brief Check if an event type is enabled by GEOFENCE_ENABLED_EVENTS
+ *
+ */
+constexpr bool GeofenceEventEnabled(GeofenceEventType type) {
+    return (GEOFENCE_ENABLED_EVENTS) & GeofenceEventBit(type);
+}
+
+/**
+ * @brief Event mask flag requesting CallbackContext::distance
+ *
+ * @details Combine with the selected events, e.g.
+ * GEOFENCE_EVENT_MASK_ALL | GEOFENCE_EVENT_DISTANCE. The distance is only
+ * computed for zones with a subscriber asking for it, at most once per zone
+ * and loop.
+ *
+ */
+constexpr GeofenceEventMask GEOFENCE_EVENT_DISTANCE = 0x80000000;
+
+/**
+ * @brief Zone group mask matching zones of any group
+ *
+ */
+constexpr uint32_t GEOFENCE_GROUP_ALL = 0xFFFFFFFF;
+
 struct PointData {
     double lat; /**< Point latitude in degrees */
     double lon; /**< Point longitude in degrees */
@@ -72,10 +237,23 @@ struct PolygonPoint {
 enum class GeofenceShapeType {
     CIRCULAR,
     POLYGONAL,
+    CORRIDOR,       //polygon_points as a polyline, buffered by radius
+    RECTANGLE,      //min_lat to max_lat and min_lon east to max_lon
 };
 
+/**
+ * @brief Check if a shape is enabled by the GEOFENCE_ENABLE_* options
+ *
+ */
+constexpr bool GeofenceShapeEnabled(GeofenceShapeType shape) {
+    return (shape == GeofenceShapeType::CIRCULAR) ||
+        (shape == GeofenceShapeType::POLYGONAL && GEOFENCE_ENABLE_POLYGON) ||
+        (shape == GeofenceShapeType::CORRIDOR && GEOFENCE_ENABLE_CORRIDOR) ||
+        (shape == GeofenceShapeType::RECTANGLE && GEOFENCE_ENABLE_RECTANGLE);
+}
+
 struct ZoneInfo {
-    double radius{0.0}; //radius in meters that define the geofence zone boundary
+    double radius{0.0}; //radius in meters that define the geofence zone boundary, or half width of a corridor
     double center_lat{0.0};                 /**< Center point latitude in degrees */
     double center_lon{0.0};                /**< Center point longitude in degrees */
     Vector<PolygonPoint> polygon_points;
@@ -86,107 +264,1106 @@ struct ZoneInfo {
     bool exit_event{false};
     uint32_t verification_time_sec{0};
     GeofenceShapeType shape_type{GeofenceShapeType::CIRCULAR};
+    uint32_t groups{0}; //bit mask of the groups the zone belongs to
+    double simplify_tolerance{0.0}; //meters, polygons are tested against fewer vertices where the point is further than this from the boundary, 0 to test every vertex
+    double min_lat{0.0};    //rectangle, edges included
+    double max_lat{0.0};
+    double min_lon{0.0};    //west edge, greater than max_lon across the date line
+    double max_lon{0.0};
+};
+
+/**
+ * @brief Stable reference to a zone
+ *
+ * @details A handle stays valid until its zone is removed, independent of
+ * other zones being added or removed. The generation detects handles to
+ * removed zones whose slot has been reused.
+ *
+ */
+struct GeofenceZoneHandle {
+    uint16_t slot{0xFFFF};      //zone index, same as CallbackContext::index
+    uint16_t generation{0};     //0 is never a valid generation
+
+    bool operator==(const GeofenceZoneHandle& other) const {
+        return (slot == other.slot) && (generation == other.generation);
+    }
+    bool operator!=(const GeofenceZoneHandle& other) const {
+        return !(*this == other);
+    }
 };
 
 struct CallbackContext {
     int index; //index of zone (+1 to get the actual zone number)
     GeofenceEventType event_type; //type of event that caused callback
+    GeofenceZoneHandle handle; //handle of zone that caused callback
+    time_t time; //gps_time of the point, interpolated between fixes for crossings
+    double distance; //signed distance from the point to the zone boundary in meters, negative inside, NAN unless requested with GEOFENCE_EVENT_DISTANCE
+};
+
+/**
+ * @brief Zone found by a nearest zone query
+ *
+ */
+struct GeofenceZoneDistance {
+    GeofenceZoneHandle handle;
+    double distance;    //signed distance to the zone boundary in meters, negative inside
+};
+
+/**
+ * @brief Evaluation timing, see Geofence::GetEvaluationStats()
+ *
+ */
+struct GeofenceEvaluationStats {
+    uint32_t slices{0};             //loop() calls that evaluated zones
+    uint32_t passes{0};             //completed evaluations of all zones
+    uint32_t last_slice_us{0};      //duration of the last loop() call
+    uint32_t max_slice_us{0};       //longest loop() call
+    uint32_t last_pass_slices{0};   //loop() calls the last complete pass took
+    uint32_t max_pass_slices{0};    //most loop() calls a pass took
+    uint32_t polygon_tests{0};      //polygon zone evaluations
+    uint32_t fast_rejects{0};       //of those outside the bounding box
+    uint32_t fast_accepts{0};       //of those inside an inscribed rectangle
+};
+
+/**
+ * @brief Latest point, published by one writer and read by loop() without
+ * locks
+ *
+ * @details Sequence lock: the writer makes the sequence odd, stores the
+ * point and makes the sequence even again, so Publish() never waits and can
+ * be called from an interrupt handler. A reader copies the point between two
+ * reads of the sequence and tries again if a write got in between. The point
+ * is kept in relaxed atomic words, so a torn copy is detected instead of
+ * being undefined behavior.
+ *
+ */
+class GeofencePointSeqlock {
+public:
+    GeofencePointSeqlock();
+
+    /**
+     * @brief Publish a point, from a single writer at a time
+     *
+     * @param[in] point point to publish
+     * @param[in] arrival_us micros() time the point arrived
+     */
+    void Publish(const PointData& point, uint32_t arrival_us);
+
+    /**
+     * @brief Copy the latest point
+     *
+     * @param[out] point latest point
+     * @param[out] arrival_us micros() time it arrived
+     * @param[out] sequence number of the publication
+     * @param[in] attempts copies to try while writes interfere
+     *
+     * @return true if a consistent copy was made, false if every attempt
+     * overlapped a write
+     */
+    bool Read(PointData& point, uint32_t& arrival_us, uint32_t& sequence,
+                int attempts) const;
+
+    /**
+     * @brief Number of the latest publication, twice the number of points
+     * published
+     *
+     */
+    uint32_t GetSequence() const {
+        return _sequence.load(std::memory_order_acquire);
+    }
+
+private:
+    struct Payload {
+        PointData point;
+        uint32_t arrival_us;
+    };
+    static constexpr int WORDS = (sizeof(Payload) + 3) / 4;
+
+    std::atomic<uint32_t> _sequence;    //odd while a write is in progress
+    std::atomic<uint32_t> _words[WORDS];
+};
+
+/**
+ * @brief Sub-buckets per power of two of the latency histogram, as a power of
+ * two. 3 keeps each recorded latency within 12.5%.
+ *
+ */
+#ifndef GEOFENCE_LATENCY_SUB_BUCKET_BITS
+#define GEOFENCE_LATENCY_SUB_BUCKET_BITS 3
+#endif
+
+/**
+ * @brief Histogram of event delivery latencies in microseconds, see
+ * Geofence::GetLatencyHistogram()
+ *
+ * @details Log-linear buckets in the style of an HDR histogram: values below
+ * 2^GEOFENCE_LATENCY_SUB_BUCKET_BITS get a bucket each, and every following
+ * power of two is split into that many buckets. The whole 32 bit range is
+ * covered with a fixed number of counters. Recording is lock-free and may
+ * happen from several threads at once.
+ *
+ */
+class GeofenceLatencyHistogram {
+public:
+    static constexpr int SUB_BUCKETS = 1 << GEOFENCE_LATENCY_SUB_BUCKET_BITS;
+    static constexpr int BUCKETS =
+        (33 - GEOFENCE_LATENCY_SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+    GeofenceLatencyHistogram() {
+        Reset();
+    }
+
+    /**
+     * @brief Count a latency
+     *
+     * @param[in] us latency in microseconds
+     */
+    void Record(uint32_t us);
+
+    /**
+     * @brief Clear all counts, not while recording
+     *
+     */
+    void Reset();
+
+    /**
+     * @brief Number of latencies recorded
+     *
+     */
+    uint32_t GetTotalCount() const;
+
+    /**
+     * @brief Largest latency recorded, exactly
+     *
+     */
+    uint32_t GetMax() const {
+        return _max.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Latency that the given percentage of the recorded latencies
+     * don't exceed
+     *
+     * @param[in] percentile 0 to 100
+     *
+     * @return upper bound of the bucket holding the percentile, at most
+     * GetMax(), or 0 if nothing was recorded
+     */
+    uint32_t GetPercentile(double percentile) const;
+
+    /**
+     * @brief Number of latencies in a bucket
+     *
+     * @param[in] bucket 0 to BUCKETS - 1
+     */
+    uint32_t GetCount(int bucket) const {
+        return _counts[bucket].load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Bucket of a latency
+     *
+     */
+    static int BucketOf(uint32_t us);
+
+    /**
+     * @brief Largest latency counted in a bucket
+     *
+     */
+    static uint32_t BucketUpperBound(int bucket);
+
+private:
+    std::atomic<uint32_t> _counts[BUCKETS];
+    std::atomic<uint32_t> _max;
+};
+
+/**
+ * @brief Event order kept by asynchronous delivery, see
+ * Geofence::SetAsyncDelivery()
+ *
+ */
+enum class GeofenceEventOrder {
+    GLOBAL,     //all events in the order they occurred, one worker
+    PER_ZONE,   //events of each zone in order, zones spread over the workers
+};
+
+/**
+ * @brief Asynchronous delivery counters, see Geofence::GetAsyncStats()
+ *
+ */
+struct GeofenceAsyncStats {
+    uint32_t queued{0};         //events handed to the workers
+    uint32_t delivered{0};      //of those whose callback has returned
+    uint32_t dropped{0};        //events lost because their queue was full
+    uint32_t max_pending{0};    //most events waiting in one queue
 };
 
 struct GeofenceZoneState {
     GeofenceEventType prev_event{GeofenceEventType::UNKNOWN};
+#if GEOFENCE_ENABLE_VERIFICATION
     GeofenceEventType pending_event{GeofenceEventType::UNKNOWN};
-    uint64_t pending_time_ms{0};
+    uint32_t pending_time_ms{0};    //low 32 bits of System.millis()
+#endif
+};
+
+#if GEOFENCE_ENABLE_VERIFICATION
+
+/**
+ * @brief Hierarchical timer wheel for the verification deadlines of pending
+ * zone transitions
+ *
+ * @details Six levels of 64 slots each, the first level with 1 ms slots and
+ * each following level 64 times coarser. A timer is filed in the lowest level
+ * whose slot holds its deadline, and moved down a level when the wheel
+ * reaches the start of that slot, so Advance() only visits slots that hold
+ * timers and an expired timer fires on the millisecond. Timers are identified
+ * by the zone slot and cost nothing while not scheduled.
+ *
+ */
+class GeofenceTimerWheel {
+public:
+    GeofenceTimerWheel(int count = 0);
+
+    /**
+     * @brief Make room for timer ids below count
+     *
+     * @return true on success, false if out of memory
+     */
+    bool Resize(int count);
+
+    /**
+     * @brief Schedule a timer, replacing its previous deadline
+     *
+     * @param[in] id timer id
+     * @param[in] deadline System.millis() time the timer expires
+     *
+     * @return true if scheduled, false if the deadline has already passed
+     */
+    bool Schedule(int id, uint64_t deadline);
+
+    /**
+     * @brief Cancel a timer, nothing happens if it isn't scheduled
+     *
+     */
+    void Cancel(int id);
+
+    bool IsScheduled(int id) const {
+        return _timers.at(id).bucket != NONE;
+    }
+
+    uint64_t GetDeadline(int id) const {
+        return _timers.at(id).deadline;
+    }
+
+    /**
+     * @brief Move the wheel forward, expiring the timers due by now
+     *
+     * @param[in] now current System.millis() time
+     * @param[out] expired ids of the expired timers are appended, if given
+     *
+     * @return number of timers that expired
+     */
+    int Advance(uint64_t now, Vector<uint16_t>* expired = nullptr);
+
+    /**
+     * @brief Earliest deadline of the scheduled timers
+     *
+     * @param[out] deadline System.millis() time the next timer expires
+     *
+     * @return true if a timer is scheduled, false if not
+     */
+    bool NextDeadline(uint64_t& deadline) const;
+
+private:
+    static constexpr int SLOT_BITS = 6;
+    static constexpr int SLOTS = 1 << SLOT_BITS;
+    static constexpr int LEVELS = 6;
+    static constexpr uint16_t NONE = 0xFFFF;
+
+    struct Timer {
+        uint64_t deadline;
+        uint16_t next;
+        uint16_t prev;
+        uint16_t bucket;        //level * SLOTS + slot, NONE if not scheduled
+    };
+
+    int Bucket(uint64_t deadline) const;
+    int NextBucket(int level, uint64_t& start) const;
+    void Link(int id, int bucket);
+    void Unlink(int id);
+    uint16_t Detach(int bucket);
+
+    Vector<Timer> _timers;
+    uint16_t _heads[LEVELS * SLOTS];
+    uint64_t _occupied[LEVELS];     //bit per slot with timers
+    uint64_t _time;                 //timers up to this time have expired
+};
+#endif // GEOFENCE_ENABLE_VERIFICATION
+
+#if GEOFENCE_ENABLE_ASYNC
+
+/**
+ * @brief Bounded lock-free queue of events from loop() to a worker thread
+ *
+ * @details Single producer, single consumer ring of a power of two
+ * capacity. Each event is queued with a copy of the callback it is for, so
+ * the worker never touches the subscriptions. Push() never blocks and
+ * fails when the ring is full.
+ *
+ */
+class GeofenceEventQueue {
+public:
+    GeofenceEventQueue() : _mask(0), _head(0), _tail(0), _dropped(0),
+        _max_pending(0) {
+    }
+
+    /**
+     * @brief Move an idle queue, not while either side is using it
+     *
+     */
+    GeofenceEventQueue(GeofenceEventQueue&& other);
+
+    /**
+     * @brief Allocate the ring, dropping queued events
+     *
+     * @param[in] capacity events, rounded up to a power of two
+     *
+     * @return true on success, false if out of memory
+     */
+    bool Resize(int capacity);
+
+    /**
+     * @brief Queue an event, producer side
+     *
+     * @return true if queued, false if the ring is full
+     */
+    bool Push(const CallbackContext& context,
+                const GeofenceEventCallback& callback,
+                bool measure = false, uint32_t due_us = 0);
+
+    /**
+     * @brief Call the callbacks of queued events, consumer side
+     *
+     * @param[in] max_events events to deliver at most, 0 for all
+     * @param[out] latency latencies of the measured events are recorded, if
+     * given
+     *
+     * @return number of events delivered
+     */
+    int Deliver(int max_events, GeofenceLatencyHistogram* latency = nullptr);
+
+    /**
+     * @brief Add the counters of this queue to stats
+     *
+     */
+    void AddStats(GeofenceAsyncStats& stats) const;
+
+private:
+    struct Entry {
+        CallbackContext context;
+        GeofenceEventCallback callback;
+        uint32_t due_us;            //micros() time the event was due
+        bool measure;               //record the latency of the event
+    };
+
+    Vector<Entry> _entries;
+    uint32_t _mask;
+    std::atomic<uint32_t> _head;    //events pushed, written by the producer
+    std::atomic<uint32_t> _tail;    //events delivered, written by the consumer
+    std::atomic<uint32_t> _dropped;     //written by the producer
+    std::atomic<uint32_t> _max_pending; //written by the producer
+};
+#endif // GEOFENCE_ENABLE_ASYNC
+
+/**
+ * @brief Zone data read on every evaluation, packed and stored densely so
+ * that loop() only streams through this array for zones the point is not
+ * near. Derived from the ZoneInfo when the zone is compiled.
+ *
+ */
+struct GeofenceZoneHot {
+    enum : uint8_t {
+        ENABLE = 0x01,
+        INSIDE_EVENT = 0x02,
+        OUTSIDE_EVENT = 0x04,
+        ENTER_EVENT = 0x08,
+        EXIT_EVENT = 0x10,
+        DATELINE = 0x20,        //360 added to negative longitudes
+        DIRTY = 0x80,           //ZoneInfo may have changed, compile again
+    };
+
+    float min_lat{0.0f};        //bounding box rounded outwards, a point
+    float max_lat{0.0f};        //outside of it is outside of the zone
+    float min_lon{0.0f};
+    float max_lon{0.0f};
+#if GEOFENCE_ENABLE_VERIFICATION
+    uint32_t verification_ms{0};
+#endif
+#if GEOFENCE_ENABLE_VERTICES
+    uint32_t vertex_offset{0};  //first polygon vertex in the vertex arena
+    uint16_t num_points{0};     //number of enabled polygon points
+#endif
+    uint8_t shape{0};           //GeofenceShapeType
+    uint8_t flags{DIRTY};
+};
+
+/**
+ * @brief Polygon vertex with the date line offset applied
+ *
+ */
+struct GeofenceVertex {
+    double lat;
+    double lon;
+};
+
+/**
+ * @brief Polygon vertex in E7 units, longitude relative to the zone reference
+ *
+ */
+struct GeofenceFixedVertex {
+    int32_t lat;
+    int32_t lon;
+};
+
+#if GEOFENCE_USE_FIXED_POINT
+using GeofenceCompiledVertex = GeofenceFixedVertex;
+#else
+using GeofenceCompiledVertex = GeofenceVertex;
+#endif
+
+/**
+ * @brief Rectangle within a polygon, in the units of its compiled vertices
+ *
+ */
+struct GeofencePolygonCore {
+    GeofenceCompiledVertex min;
+    GeofenceCompiledVertex max;
+};
+
+/**
+ * @brief Rectangle zone, longitudes as the offset east of its west edge so
+ * that the test is the same across the date line. E7 units in the
+ * fixed-point engine, degrees otherwise.
+ *
+ */
+struct GeofenceRectangle {
+#if GEOFENCE_USE_FIXED_POINT
+    int32_t min_lat;
+    int32_t max_lat;
+    int32_t west;
+    int64_t width;
+#else
+    double min_lat;
+    double max_lat;
+    double west;
+    double width;
+#endif
+};
+
+/**
+ * @brief Bounding box of a run of corridor segments, widened by the corridor
+ * width. Same units as the bounding box in GeofenceZoneHot.
+ *
+ */
+struct GeofenceSegmentBox {
+    float min_lat;
+    float max_lat;
+    float min_lon;
+    float max_lon;
+};
+
+/**
+ * @brief Node of the spatial index over the zone bounding boxes
+ *
+ */
+struct GeofenceIndexNode {
+    float min_lat;
+    float max_lat;
+    float min_lon;
+    float max_lon;
+    int first;      //first of the two child nodes, or first entry of a leaf
+    int count;      //number of zones of a leaf, 0 for inner nodes
+};
+
+/**
+ * @brief Geometry derived from a ZoneInfo when the zone is configured so
+ * that it doesn't have to be recomputed on every evaluation. Only read once
+ * the point is within the bounding box of the zone.
+ *
+ */
+struct GeofenceZoneGeometry {
+    uint32_t groups{0};         //groups the subscriber lists were built for
+    double center_lat{0.0};     //circle
+    double center_lon{0.0};
+    double radius{0.0};         //circle radius or corridor half width
+#if GEOFENCE_ENABLE_RECTANGLE
+    GeofenceRectangle rectangle{};
+#endif
+#if GEOFENCE_ENABLE_POLYGON
+    int8_t convex{0};           //1 or -1 for a convex polygon wound counterclockwise or clockwise
+    // Vertices kept by the simplification, empty if not simplified. It
+    // decides points further than the tolerance from its edges, measured in
+    // latitude units with longitudes scaled to the same length.
+    Vector<GeofenceCompiledVertex> simplified;
+    float simplify_scale{0.0f};
+    float simplify_tolerance{0.0f};
+#endif
+#if GEOFENCE_ENABLE_POLYGON && GEOFENCE_POLYGON_CORES
+    GeofencePolygonCore cores[GEOFENCE_POLYGON_CORES];  //largest first
+    int num_cores{0};
+#endif
+    // Corridor segment index, a complete binary tree of boxes in heap order
+    // (root at 1) whose leaves cover GEOFENCE_CORRIDOR_LEAF_SEGMENTS segments
+#if GEOFENCE_ENABLE_CORRIDOR
+    Vector<GeofenceSegmentBox> segment_boxes;
+    int segment_leaves{0};      //number of leaves, a power of two
+    int corridor_segment{0};    //segment matched last, progress along the route
+#endif
+#if GEOFENCE_USE_FIXED_POINT
+    int32_t ref_lon{0};         //E7 longitude polygon vertices are relative to
+    bool fixed_circle{false};   //circle within the fixed-point error bounds
+    int32_t center_lat_e7{0};   //circle center
+    int32_t center_lon_e7{0};
+    int32_t lat_limit{0};       //E7 offsets beyond which a point is outside
+    int32_t lon_limit{0};
+    float cos_lat{0.0f};        //of the circle center
+    float sin_lat{0.0f};
+    float threshold{0.0f};      //haversine term of the radius
+#endif
 };
 
 class Geofence {
 public:
 
-    Geofence(int num_of_zones) : GeofenceZones(num_of_zones),
-        GeofenceZoneStates(num_of_zones), _maximumDop(GEOFENCE_MAXIMUM_DOP) {
+    Geofence(int num_of_zones);
+
+    /**
+     * @brief Initilize the geofence interface
+     *
+     * @details Sets the GeofenceZoneStates to GeofenceEventType::UNKNOWN in
+     * order to be ready to capture ENTER and EXIT events
+     */
+    void init();
+
+    /**
+     * @brief Called periodically to check for geofence boundary conditions
+     *
+     * @details This is periodically called to calculate geofence points
+     * and their relation to the boundary. Callbacks will be triggered here if
+     * the event type conditions are met (outside, inside, enter, exit)
+     *
+     * With an evaluation budget set, each call evaluates the zones up to the
+     * budget and the next call continues with the following zones. All zones
+     * of a pass are evaluated against the point current at the start of the
+     * pass.
+     */
+    void loop();
+
+    /**
+     * @brief Limit the work done by each call to loop()
+     *
+     * @details A call stops once it has evaluated max_zones enabled zones or
+     * has run for max_us microseconds, whichever comes first, and the next
+     * call resumes with the next zone. Every call evaluates at least one
+     * zone, so a pass over N enabled zones takes at most
+     * ceil(N / max_zones) calls, or N calls with only a time limit. Zones
+     * added or removed during a pass may be evaluated in the next pass
+     * only.
+     *
+     * @param[in] max_zones enabled zones per call, 0 for no limit
+     * @param[in] max_us microseconds per call, 0 for no limit
+     */
+    void SetEvaluationBudget(int max_zones, uint32_t max_us) {
+        _slice_max_zones = max_zones;
+        _slice_max_us = max_us;
+    }
+
+    /**
+     * @brief Check if the last call to loop() completed a pass over all
+     * zones
+     *
+     * @return true if the next call starts a new pass with the latest point
+     */
+    bool IsPassComplete() const {
+        return !_slice_next;
+    }
+
+    /**
+     * @brief Only evaluate the zones when there is something new to evaluate
+     *
+     * @details When enabled, loop() evaluates the zones once for each point
+     * passed to UpdateGeofencePoint() and after zones change. Other calls
+     * only confirm the pending transitions whose verification time has run
+     * out and return right away otherwise, so INSIDE and OUTSIDE events are
+     * dispatched once per point instead of once per call.
+     *
+     * @param[in] enable true for event driven, false to evaluate the zones
+     * on every call (the default)
+     */
+    void SetEventDrivenEvaluation(bool enable) {
+        _event_driven = enable;
+    }
+
+    /**
+     * @brief Time of the next verification deadline
+     *
+     * @details A zone with a verification time confirms an ENTER or EXIT
+     * when its state has been stable that long. Between points the
+     * application only needs to call loop() once this deadline has passed.
+     *
+     * @param[out] deadline_ms System.millis() time the earliest pending
+     * transition is confirmed
+     *
+     * @return true if a transition is pending, false if not
+     */
+    bool GetNextDeadline(uint64_t& deadline_ms) const;
+
+    /**
+     * @brief Timing of the calls to loop()
+     *
+     * @return statistics since construction or the last reset
+     */
+    const GeofenceEvaluationStats& GetEvaluationStats() const {
+#if GEOFENCE_ENABLE_STATS
+        return _stats;
+#else
+        static const GeofenceEvaluationStats none;
+        return none;
+#endif
+    }
+
+    /**
+     * @brief Time from a fix arriving to its events being delivered
+     *
+     * @details Measured from UpdateGeofencePoint() to the start of each
+     * callback, whether it is called from loop(), with a batch or by an
+     * asynchronous worker. INSIDE and OUTSIDE events are measured on the
+     * first pass over a fix only, later passes repeat events that were due
+     * long ago. ENTER and EXIT are measured on the pass that reports them,
+     * from the later of the fix arriving and their verification deadline (to
+     * the millisecond), so the verification_time_sec itself is never
+     * counted.
+     *
+     * @return latencies since construction or the last reset
+     */
+    const GeofenceLatencyHistogram& GetLatencyHistogram() const {
+#if GEOFENCE_ENABLE_STATS
+        return _latency;
+#else
+        static const GeofenceLatencyHistogram none;
+        return none;
+#endif
+    }
+
+    /**
+     * @brief Reset the statistics returned by GetEvaluationStats() and
+     * GetLatencyHistogram()
+     *
+     */
+    void ResetEvaluationStats() {
+#if GEOFENCE_ENABLE_STATS
+        _stats = GeofenceEvaluationStats();
+        _latency.Reset();
+#endif
+    }
+
+    /**
+     * @brief Sets the zone info for configuration of a zone
+     *
+     * @details Number of zones are created by the Geofence ctor, then they have
+     * to be configured through this function, and placed in the vector using
+     * the index passed to it. The zone state is kept unless the shape,
+     * coordinates or verification time change.
+     *
+     * @param[in] index index of vector to store the zone info
+     * @param[in] zone_config reference to the zone info you want to set to
+     */
+    void SetZoneInfo(int index, const ZoneInfo& zone_config) {
+        SetZoneInfo(GetZoneHandle(index), zone_config);
+    }
+
+    /**
+     * @brief Sets the zone info of the zone referenced by a handle
+     *
+     * @param[in] handle handle of the zone
+     * @param[in] zone_config reference to the zone info you want to set to
+     *
+     * @return SYSTEM_ERROR_NONE, SYSTEM_ERROR_NOT_FOUND if the handle is
+     * stale, SYSTEM_ERROR_NOT_SUPPORTED if the shape is compiled out, or
+     * SYSTEM_ERROR_INVALID_STATE if called from an event callback
+     */
+    int SetZoneInfo(GeofenceZoneHandle handle, const ZoneInfo& zone_config);
+
+    /**
+     * @brief Gets the zone info for a given index for modification
+     *
+     * @details Number of zones are created by the Geofence ctor, and this
+     * function returns references to the zone info. The zone is recompiled,
+     * and evaluated, at the next call to loop() so changes made through the
+     * reference take effect there. The reference must not be kept across
+     * calls to loop(), AddZone() or RemoveZone(). Unlike SetZoneInfo(), the
+     * zone state is kept when the shape or coordinates are changed this way.
+     * Use the const overload to only read the zone info.
+     *
+     * @param[in] index index of vector to get the zone info, a zone must be
+     * stored at it, see GetZoneHandle() and GetZoneInfo(GeofenceZoneHandle)
+     *
+     * @return reference to requested zone info
+     */
+    ZoneInfo& GetZoneInfo(int index);
+
+    /**
+     * @brief Gets the zone info for a given index for reading
+     *
+     * @details Does not cause the zone to be recompiled or evaluated. Same
+     * rules for keeping the reference as the non-const overload.
+     *
+     * @param[in] index index of vector to get the zone info
+     *
+     * @return reference to requested zone info, or to a default zone info if
+     * no zone is stored at the index
+     */
+    const ZoneInfo& GetZoneInfo(int index) const;
+
+    /**
+     * @brief Gets the zone info of the zone referenced by a handle for
+     * modification
+     *
+     * @details Same as GetZoneInfo(int) but checks that the handle is valid.
+     *
+     * @param[in] handle handle of the zone
+     *
+     * @return pointer to the zone info, or nullptr if the handle is stale
+     */
+    ZoneInfo* GetZoneInfo(GeofenceZoneHandle handle);
+
+    /**
+     * @brief Gets the zone info of the zone referenced by a handle for reading
+     *
+     * @param[in] handle handle of the zone
+     *
+     * @return pointer to the zone info, or nullptr if the handle is stale
+     */
+    const ZoneInfo* GetZoneInfo(GeofenceZoneHandle handle) const;
+
+    /**
+     * @brief Add a zone
+     *
+     * @details The call takes constant time apart from compiling the zone.
+     * The subscriber lists are rebuilt from all zones at the next loop() and
+     * the spatial index at the next FindNearestZones(), so a batch of changes
+     * is paid for once there rather than per call. Removed zone indices
+     * are reused before new ones are allocated. The states of all other
+     * zones are unaffected.
+     *
+     * @param[in] zone_config zone info of the new zone
+     *
+     * @return handle of the new zone, or an invalid handle if out of memory
+     * or called from an event callback
+     */
+    GeofenceZoneHandle AddZone(const ZoneInfo& zone_config);
+
+    /**
+     * @brief Remove a zone
+     *
+     * @details The call takes constant time, rebuilding the subscriber lists
+     * and spatial index is deferred as for AddZone(). The handle, and all
+     * copies of it, become invalid. Handles and indices of other zones are
+     * unaffected.
+     *
+     * @param[in] handle handle of the zone to remove
+     *
+     * @return SYSTEM_ERROR_NONE, SYSTEM_ERROR_NOT_FOUND if the handle is
+     * stale, or SYSTEM_ERROR_INVALID_STATE if called from an event callback
+     */
+    int RemoveZone(GeofenceZoneHandle handle);
+
+    /**
+     * @brief Get the handle of the zone at a given index
+     *
+     * @param[in] index index of the zone
+     *
+     * @return handle of the zone, or an invalid handle if no zone is stored at
+     * the index
+     */
+    GeofenceZoneHandle GetZoneHandle(int index) const;
+
+    /**
+     * @brief Check if a handle references an existing zone
+     *
+     * @param[in] handle handle of the zone
+     *
+     * @return true if valid, false if the zone was removed
+     */
+    bool IsValidZone(GeofenceZoneHandle handle) const {
+        return (handle.slot < _slots.size()) &&
+            (_slots.at(handle.slot).generation == handle.generation) &&
+                (_slots.at(handle.slot).dense >= 0);
+    }
+
+    /**
+     * @brief Number of zones
+     *
+     */
+    int GetZoneCount() const {
+        return GeofenceZones.size();
+    }
+
+    /**
+     * @brief Is any geofence zone enabled
+     *
+     * @details Check all the geofence zones, and see if any are enabled
+     *
+     * @return true if any enabled, false if none enabled
+     */
+    bool AnyGeofenceEnabled();
+
+    /**
+     * @brief Pass the point data to be used to calculate boundary
+     *
+     * @details This function is called to pass point information that is
+     * used in the loop() function to calculate geofence bounds, from the
+     * start of the next evaluation pass. It is wait-free and may be called
+     * from an interrupt handler or another thread than loop(), as long as
+     * only one of them calls it at a time. Each pass evaluates one consistent
+     * copy of the latest point.
+     *
+     * @param[in] PointData point to be passed for calculation
+     */
+    void UpdateGeofencePoint(const PointData& point) {
+#if GEOFENCE_ENABLE_STATS
+        _latest_point.Publish(point, micros());
+#else
+        _latest_point.Publish(point, 0);
+#endif
+    }
+
+    /**
+     * @brief Register a callback to occur for any geofence event
+     *
+     * @details Registers a callback to be triggered when any geofence event.
+     * occurs. The callback will contain a context with the specific index and
+     * event type that triggered the callback
+     *
+     * @param[in] callback function signature contain the context with the index
+     * and event type that triggered the callback
+     *
+     * @return SYSTEM_ERROR_NONE
+     *
+     * @note Use Subscribe() to get an id for removing the callback later with
+     * Unsubscribe()
+     */
+    int RegisterGeofenceCallback(GeofenceEventCallback callback);
+
+    /**
+     * @brief Subscribe to selected events of all zones
+     *
+     * @details Subscribers are resolved per zone when the zones or
+     * subscriptions change, so a zone event only invokes the callbacks that
+     * asked for it. Callbacks are invoked in the order they were subscribed.
+     * Subscribing from within a callback is not allowed, unsubscribing is.
+     *
+     * @param[in] callback function called for each selected event
+     * @param[in] event_mask events to receive, see GeofenceEventBit()
+     *
+     * @return subscription ID greater than zero, SYSTEM_ERROR_INVALID_STATE if
+     * called from a callback, or SYSTEM_ERROR_NO_MEMORY
+     */
+    int Subscribe(GeofenceEventCallback callback,
+                GeofenceEventMask event_mask = GEOFENCE_EVENT_MASK_ALL) {
+        return AddSubscription(callback, event_mask, GeofenceZoneHandle(),
+                    GEOFENCE_GROUP_ALL);
+    }
+
+    /**
+     * @brief Subscribe to selected events of a single zone
+     *
+     * @param[in] handle handle of the zone
+     * @param[in] callback function called for each selected event
+     * @param[in] event_mask events to receive, see GeofenceEventBit()
+     *
+     * @return subscription ID greater than zero, SYSTEM_ERROR_NOT_FOUND if the
+     * handle is stale or SYSTEM_ERROR_NO_MEMORY
+     */
+    int SubscribeZone(GeofenceZoneHandle handle,
+                GeofenceEventCallback callback,
+                GeofenceEventMask event_mask = GEOFENCE_EVENT_MASK_ALL) {
+        if(!IsValidZone(handle)) {
+            return SYSTEM_ERROR_NOT_FOUND;
+        }
+        return AddSubscription(callback, event_mask, handle, 0);
+    }
+
+    /**
+     * @brief Subscribe to selected events of the zones in any of the given
+     * groups
+     *
+     * @param[in] groups bit mask of groups, matched against ZoneInfo::groups
+     * @param[in] callback function called for each selected event
+     * @param[in] event_mask events to receive, see GeofenceEventBit()
+     *
+     * @return subscription ID greater than zero, or SYSTEM_ERROR_NO_MEMORY
+     */
+    int SubscribeGroup(uint32_t groups,
+                GeofenceEventCallback callback,
+                GeofenceEventMask event_mask = GEOFENCE_EVENT_MASK_ALL) {
+        return AddSubscription(callback, event_mask, GeofenceZoneHandle(),
+                    groups);
     }
 
     /**
-     * @brief Initilize the geofence interface
+     * @brief Subscribe to selected events of the zones in any of the given
+     * groups, delivered once per loop() call
      *
-     * @details Sets the GeofenceZoneStates to GeofenceEventType::UNKNOWN in
-     * order to be ready to capture ENTER and EXIT events
+     * @details Events are collected while the zones are evaluated and passed
+     * to the callback in one array after the last of them, so the events of
+     * a tick can be handled together. A loop() call without selected events
+     * doesn't invoke the callback. The collected events are kept in a buffer
+     * per subscription that grows to the most events of a tick; if it can't
+     * grow the events collected so far are delivered early.
+     *
+     * @param[in] callback function called with the events of a loop() call
+     * @param[in] event_mask events to receive, see GeofenceEventBit()
+     * @param[in] groups bit mask of groups, matched against ZoneInfo::groups
+     *
+     * @return subscription ID greater than zero, SYSTEM_ERROR_INVALID_STATE if
+     * called from a callback, or SYSTEM_ERROR_NO_MEMORY
      */
-    void init();
+    int SubscribeBatch(GeofenceBatchCallback callback,
+                GeofenceEventMask event_mask = GEOFENCE_EVENT_MASK_ALL,
+                uint32_t groups = GEOFENCE_GROUP_ALL) {
+        return AddSubscription(GeofenceEventCallback(), event_mask,
+                    GeofenceZoneHandle(), groups, callback);
+    }
 
     /**
-     * @brief Called periodically to check for geofence boundary conditions
+     * @brief Remove a subscription
      *
-     * @details This is periodically called to calculate geofence points
-     * and their relation to the boundary. Callbacks will be triggered here if
-     * the event type conditions are met (outside, inside, enter, exit)
+     * @param[in] id subscription ID returned by one of the Subscribe functions
+     *
+     * @return SYSTEM_ERROR_NONE, or SYSTEM_ERROR_NOT_FOUND
      */
-    void loop();
+    int Unsubscribe(int id);
 
+#if GEOFENCE_ENABLE_ASYNC
     /**
-     * @brief Sets the zone info for configuration of a zone
+     * @brief Hand events to worker threads instead of calling the subscribers
+     * from loop()
      *
-     * @details Number of zones are created by the Geofence ctor, then they have
-     * to be configured through this function, and placed in the vector using
-     * the index passed to it
+     * @details Each event is queued together with the callback of each of
+     * its subscribers, and the callbacks run when a worker calls
+     * ProcessAsyncEvents(). With GLOBAL order all events go through one queue
+     * for a single worker. With PER_ZONE order every worker has a queue of
+     * its own and the zones are spread over them by index, so the events of a
+     * zone stay in order while different zones are handled in parallel. A
+     * full queue never blocks loop(), the event is dropped and counted
+     * instead. Batch subscriptions are still called from loop().
      *
-     * @param[in] index index of vector to store the zone info
-     * @param[in] zone_config reference to the zone info you want to set to
+     * Callbacks running on a worker must not call into the Geofence, and
+     * events queued before a subscription is removed are still delivered.
+     * Stop the workers before changing the delivery mode; events still queued
+     * are discarded.
+     *
+     * @param[in] capacity events per queue, rounded up to a power of two, 0
+     * to call the subscribers from loop() again
+     * @param[in] order ordering kept between events
+     * @param[in] workers number of queues, must be 1 with GLOBAL order
+     *
+     * @return SYSTEM_ERROR_NONE, SYSTEM_ERROR_INVALID_ARGUMENT,
+     * SYSTEM_ERROR_INVALID_STATE if called from a callback, or
+     * SYSTEM_ERROR_NO_MEMORY
      */
-    void SetZoneInfo(int index, const ZoneInfo& zone_config) {
-        auto zone = GeofenceZones.at(index);
-        zone = zone_config;
-    }
+    int SetAsyncDelivery(int capacity,
+                GeofenceEventOrder order = GeofenceEventOrder::GLOBAL,
+                int workers = 1);
 
     /**
-     * @brief Gets the zone info for a given index
+     * @brief Call the callbacks of the events queued for a worker
      *
-     * @details Number of zones are created by the Geofence ctor, and this
-     * function returns references to the zone info
+     * @details Called from the worker thread, which should call it again
+     * when it returns 0 after a short wait. Each queue must only be drained
+     * by one thread at a time.
      *
-     * @param[in] index index of vector to get the zone info
+     * @param[in] worker queue to drain, below the number of workers
+     * @param[in] max_events events to deliver at most, 0 for all queued
      *
-     * @return reference to requested zone info
+     * @return number of events delivered, or SYSTEM_ERROR_INVALID_ARGUMENT
      */
-    ZoneInfo& GetZoneInfo(int index) {
-        return GeofenceZones.at(index);
-    }
+    int ProcessAsyncEvents(int worker = 0, int max_events = 0);
 
     /**
-     * @brief Is any geofence zone enabled
+     * @brief Counters of the asynchronous delivery since it was last set
      *
-     * @details Check all the geofence zones, and see if any are enabled
+     * @details Safe to call from any thread, the counters of different
+     * queues may be read at slightly different times.
      *
-     * @return true if any enabled, false if none enabled
      */
-    bool AnyGeofenceEnabled();
+    GeofenceAsyncStats GetAsyncStats() const;
+#endif // GEOFENCE_ENABLE_ASYNC
 
     /**
-     * @brief Pass the point data to be used to calculate boundary. Only writes
-     * if there is a change to the stored _geofence_point
+     * @brief Find the zones closest to a point
      *
-     * @details This function is called to pass point information that is
-     * used in the tick() function to calculate geofence bounds
+     * @details Zones are ordered by the signed distance from the point to
+     * their boundary, so zones containing the point come first. A spatial
+     * index over the zone bounding boxes, rebuilt when zones change, limits
+     * the zones measured to those that can still be among the closest.
+     * Circles are measured with the selected distance model, polygons,
+     * rectangles and corridors in a local projection at the point which is
+     * accurate to a few percent up to a few hundred kilometers. Disabled zones are
+     * included.
      *
-     * @param[in] PointData point to be passed for calculation
+     * @param[in] lat latitude of the point in degrees
+     * @param[in] lon longitude of the point in degrees
+     * @param[out] results closest zones, nearest first
+     * @param[in] max_results number of zones to find
+     * @param[in] groups only find zones in any of these groups
+     *
+     * @return number of zones found, or SYSTEM_ERROR_NO_MEMORY
      */
-    void UpdateGeofencePoint(const PointData& point) {
-        _geofence_point = point;
-    }
+    int FindNearestZones(double lat, double lon,
+                GeofenceZoneDistance* results,
+                int max_results,
+                uint32_t groups = GEOFENCE_GROUP_ALL);
 
     /**
-     * @brief Register a callback to occur for any geofence event
+     * @brief Find the zone closest to a point, see FindNearestZones()
      *
-     * @details Registers a callback to be triggered when any geofence event.
-     * occurs. The callback will contain a context with the specific index and
-     * event type that triggered the callback
+     * @param[in] lat latitude of the point in degrees
+     * @param[in] lon longitude of the point in degrees
+     * @param[out] result closest zone
+     * @param[in] groups only find zones in any of these groups
      *
-     * @param[in] callback function signature contain the context with the index
-     * and event type that triggered the callback
+     * @return SYSTEM_ERROR_NONE, SYSTEM_ERROR_NOT_FOUND if there is no zone
+     * or SYSTEM_ERROR_NO_MEMORY
+     */
+    int FindNearestZone(double lat, double lon,
+                GeofenceZoneDistance& result,
+                uint32_t groups = GEOFENCE_GROUP_ALL) {
+        int ret = FindNearestZones(lat, lon, &result, 1, groups);
+        return (ret < 0) ? ret : (ret ? SYSTEM_ERROR_NONE : SYSTEM_ERROR_NOT_FOUND);
+    }
+
+    /**
+     * @brief Enable detection of zone crossings between consecutive fixes
      *
-     * @return SYSTEM_ERROR_NONE
+     * @details Without it a device sampling slowly can pass through a small
+     * zone between two fixes without any event. When enabled, the segment
+     * from the previous fix to the current one is intersected with the
+     * circle and polygon zones whose bounding box it overlaps:
+     * - a zone entered and left between the fixes reports ENTER and EXIT
+     * - ENTER and EXIT events between the fixes carry the time the segment
+     * crossed the boundary
+     * Event times are interpolated linearly between the gps_time of the two
+     * fixes. Only zones without verification time are affected, corridors
+     * are not.
+     *
+     * @param[in] enable true to test segments between fixes
      */
-    int RegisterGeofenceCallback(GeofenceEventCallback callback);
+    void SetCrossingDetection(bool enable) {
+        _crossing_detection = enable;
+        _have_previous_point = false;
+    }
 
     /**
      * @brief Set the maximum HDOP figure any given location must have before a
@@ -199,8 +1376,95 @@ public:
         _maximumDop = abs(dop);
     }
 
+    /**
+     * @brief Number of polygon vertices held by the vertex arena
+     *
+     * @details Includes vertices of released ranges, which are reclaimed
+     * by the next allocation once they make up half of the arena.
+     *
+     * @return number of vertices
+     */
+    int GetVertexArenaSize() const {
+#if GEOFENCE_ENABLE_VERTICES
+        return ZoneVertices.size();
+#else
+        return 0;
+#endif
+    }
+
+    /**
+     * @brief Size in bytes of a zone state snapshot for the current zones
+     *
+     * @return snapshot size in bytes
+     */
+    size_t GetZoneStateSnapshotSize() const;
+
+    /**
+     * @brief Write a snapshot of all zone states to a buffer
+     *
+     * @details The snapshot is a packed, CRC protected record of the last
+     * confirmed and pending event of every zone, suitable to be written to a
+     * file or flash region before a reset. Pending verification timers are
+     * stored as elapsed time so they continue across the reset.
+     *
+     * @param[out] buffer buffer receiving the snapshot
+     * @param[in] size size of the buffer in bytes
+     * @param[in] zone_set_version application defined version of the zone
+     * configuration
+     *
+     * @return number of bytes written, or SYSTEM_ERROR_TOO_LARGE if the buffer
+     * is too small
+     */
+    int SaveZoneStates(uint8_t* buffer, size_t size, uint32_t zone_set_version);
+
+    /**
+     * @brief Get the zone set version a snapshot was taken with
+     *
+     * @details Lets the application compare it with the version of the
+     * current zone configuration before calling RestoreZoneStates(), for
+     * example to discard snapshots of an unrelated zone set.
+     *
+     * @param[in] buffer buffer containing the snapshot
+     * @param[in] size size of the snapshot in bytes
+     * @param[out] zone_set_version version passed to SaveZoneStates()
+     *
+     * @return SYSTEM_ERROR_NONE, or SYSTEM_ERROR_BAD_DATA if the snapshot is
+     * corrupt
+     */
+    static int GetZoneStateSnapshotVersion(const uint8_t* buffer, size_t size,
+                        uint32_t& zone_set_version);
+
+    /**
+     * @brief Restore zone states from a snapshot written by SaveZoneStates()
+     *
+     * @details Call after the zones have been configured and init() has been
+     * called. Each zone state in the snapshot is restored to the zone stored
+     * at the same index, if its shape, coordinates and verification time are
+     * unchanged since the snapshot was taken. All other zones keep their
+     * current state, so a snapshot of an older zone set only restores the
+     * zones that are still the same. Use GetZoneStateSnapshotVersion() to
+     * check the zone set version first.
+     *
+     * @param[in] buffer buffer containing the snapshot
+     * @param[in] size size of the snapshot in bytes
+     *
+     * @return number of zones restored, or SYSTEM_ERROR_BAD_DATA if the
+     * snapshot is corrupt
+     */
+    int RestoreZoneStates(const uint8_t* buffer, size_t size);
+
 private:
 
+    /**
+     * @brief Calculate a hash of the configuration of a zone used to detect
+     * configuration changes between a snapshot and a restore
+     *
+     * @param[in] zone struct containing the zone information
+     *
+     * @return CRC-32 of the zone configuration
+     */
+    uint32_t ZoneConfigHash(const ZoneInfo& zone) const;
+
     /**
      * @brief Checks if the circular geofence is outside the circle boundary
      *
@@ -209,25 +1473,134 @@ private:
      * greater than the radius, it is outside the boundary. If smaller inside
      * the boundary
      *
-     * @param[in] zone struct containing the zone information
+     * @param[in] geometry compiled geometry of the circle
+     * @param[out] distance if not null, receives the signed distance to the
+     * boundary when it is a by-product of the test, NAN otherwise
      *
      * @return true if outside boundary, false if not
      */
-    bool IsCircularGeofenceOutside(ZoneInfo& zone);
+    bool IsCircularGeofenceOutside(const GeofenceZoneGeometry& geometry,
+                        double* distance = nullptr);
 
     /**
      * @brief Checks to see if polygonal geofence is outside the polygon
      * boundary
      *
-     * @details Calls IsPointInPolygon() and if it returns true the point is
-     * inside the boundary. If it returns false the point is outside the
-     * boundary
+     * @details Points in one of the inscribed rectangles are inside. Convex
+     * polygons are tested in O(log n) against the fan of triangles around
+     * their first vertex. Simplified polygons are ray cast against the
+     * simplified vertices unless the point is within the tolerance of one
+     * of their edges. Everything else, including points too close to a
+     * line of the convex test to trust its rounding, goes through
+     * IsPointInPolygon(), so all give the same result. Called once the
+     * point is within the bounding box of the zone.
      *
-     * @param[in] zone struct containg the zone info
+     * @param[in] hot hot data of the zone
+     * @param[in] geometry compiled geometry of the polygon
      *
      * @return true if outside the boundary, false if not
      */
-    bool IsPolygonalGeofenceOutside(ZoneInfo& zone);
+    bool IsPolygonalGeofenceOutside(const GeofenceZoneHot& hot,
+                        const GeofenceZoneGeometry& geometry);
+
+    /**
+     * @brief Checks if the point is outside of a rectangle zone
+     *
+     * @details Four comparisons in the units of the engine, with the
+     * longitude taken east of the west edge.
+     *
+     * @param[in] geometry compiled geometry of the rectangle
+     *
+     * @return true if outside the rectangle, false if not
+     */
+    bool IsRectangularGeofenceOutside(const GeofenceZoneGeometry& geometry);
+
+    /**
+     * @brief Checks if the point is further from a corridor polyline than
+     * the corridor half width
+     *
+     * @details The segments around the one matched on the previous call are
+     * tried first, since a tracked vehicle mostly follows the route. Otherwise
+     * the segment index is descended to the leaves whose boxes contain the
+     * point, so only a few segments are measured even on long routes. The
+     * distance to a segment is measured in a local equirectangular projection
+     * at the point, accurate for segments up to tens of kilometers.
+     *
+     * @param[in] hot hot data of the zone
+     * @param[in,out] geometry compiled geometry of the corridor, the matched
+     * segment is stored in it
+     *
+     * @return true if outside the corridor, false if not
+     */
+    bool IsCorridorGeofenceOutside(const GeofenceZoneHot& hot,
+                        GeofenceZoneGeometry& geometry);
+
+    /**
+     * @brief Evaluate the current point against the shape of a zone, once it
+     * is within the bounding box
+     *
+     * @param[in] hot hot data of the zone
+     * @param[in,out] geometry compiled geometry of the zone
+     * @param[out] distance if not null, receives the signed distance to the
+     * boundary for circles, see IsCircularGeofenceOutside()
+     *
+     * @return true if outside the zone, false if not
+     */
+    bool IsZoneOutside(const GeofenceZoneHot& hot,
+                        GeofenceZoneGeometry& geometry,
+                        double* distance = nullptr);
+
+    /**
+     * @brief Find where the segment from the previous fix to the current
+     * point crosses the boundary of a zone
+     *
+     * @details Circles are intersected in a local projection around the
+     * center, polygon edges in the latitude and longitude plane like the
+     * point in polygon test.
+     *
+     * @param[in] hot hot data of the zone
+     * @param[in] geometry compiled geometry of the zone
+     * @param[out] first first crossing, as fraction of the segment
+     * @param[out] last last crossing, as fraction of the segment
+     *
+     * @return number of crossings, 0 for corridors
+     */
+    int FindSegmentCrossings(const GeofenceZoneHot& hot,
+                        const GeofenceZoneGeometry& geometry,
+                        float& first,
+                        float& last);
+
+    /**
+     * @brief Check the segment from the previous fix to the current point
+     * against the bounding box of a zone
+     *
+     * @param[in] hot hot data of the zone
+     *
+     * @return true if the segment may cross the zone
+     */
+    bool IsSegmentInBoundingBox(const GeofenceZoneHot& hot) const;
+
+    /**
+     * @brief Time at a fraction of the segment from the previous fix to the
+     * current point
+     *
+     * @param[in] fraction position along the segment, 0 to 1
+     *
+     * @return interpolated gps_time
+     */
+    time_t CrossingTime(float fraction) const;
+
+    /**
+     * @brief Check the current point against the bounding box of a zone
+     *
+     * @details The box is rounded outwards by more than the float rounding
+     * of the point, so a point outside the box is always outside the zone.
+     *
+     * @param[in] hot hot data of the zone
+     *
+     * @return true if the point may be inside the zone
+     */
+    bool IsInBoundingBox(const GeofenceZoneHot& hot) const;
 
     /**
      * @brief Uses the even-odd rule using the ray casting method from a point
@@ -241,16 +1614,332 @@ private:
      * If there are an odd number of nodes it is inside the polygon. If there
      * are an even number of nodes it is outside
      *
-     * @param[in] poly_point vector containing the vertices of the polygon
+     * @param[in] points enabled vertices of the polygon, date line offset
+     * applied
+     * @param[in] count number of vertices
      * @param[in] point_lat latitude of the given point
-     * @param[in] point_lon longitude of the given point
+     * @param[in] point_lon longitude of the given point, date line offset
+     * applied
      *
      * @return true if inside the polygon, false if outside the polygon
      */
-    bool IsPointInPolygon(Vector<PolygonPoint>& poly_point,
+    bool IsPointInPolygon(const GeofenceVertex* points,
+                    int count,
                     double point_lat,
                     double point_lon);
 
+    /**
+     * @brief Compile the zones whose zone info may have changed
+     *
+     */
+    void CompileDirtyZones();
+
+    /**
+     * @brief Evaluate one zone against the point of the current pass and
+     * dispatch its events
+     *
+     * @param[in] dense index of the zone in GeofenceZones
+     * @param[in] poor_location true if the point doesn't meet the DOP
+     * requirement
+     * @param[in] segment true if crossings since the previous fix are tested
+     */
+    void EvaluateZone(int dense, bool poor_location, bool segment);
+
+    /**
+     * @brief Advance the verification timers and confirm the zones whose
+     * timer expired
+     *
+     * @param[in] evaluated zones from this dense index on are left to the
+     * current pass
+     */
+    void ConfirmExpiredZones(int evaluated);
+
+    /**
+     * @brief Confirm the pending transition of a zone whose verification
+     * timer expired, without evaluating its geometry again
+     *
+     * @param[in] dense index of the zone in GeofenceZones
+     */
+    void ConfirmZone(int dense);
+
+    /**
+     * @brief Update the state of a zone and dispatch the events it triggers
+     *
+     * @param[in] dense index of the zone in GeofenceZones
+     * @param[in] outside_geofence the point is outside the zone
+     * @param[in] context context with the zone and time filled in
+     * @param[in] crossings boundary crossings since the previous fix
+     * @param[in] first fraction of the segment at the first crossing
+     * @param[in] last fraction of the segment at the last crossing
+     */
+    void DispatchZoneEvents(int dense, bool outside_geofence,
+                        CallbackContext& context, int crossings,
+                        float first, float last);
+
+    /**
+     * @brief Fill in the zone, handle and time of an event context
+     *
+     */
+    void InitContext(int dense, CallbackContext& context) const;
+
+    /**
+     * @brief Start an evaluation pass with the latest point
+     *
+     */
+    void BeginPass();
+
+    /**
+     * @brief Finish an evaluation pass, the point becomes the previous fix
+     *
+     */
+    void EndPass();
+
+    /**
+     * @brief Signed distance from a point to the boundary of a zone
+     *
+     * @param[in] dense index of the zone in GeofenceZones
+     * @param[in] lat latitude of the point in degrees
+     * @param[in] lon longitude of the point in degrees
+     *
+     * @return distance in meters, negative inside the zone
+     */
+    double ZoneSignedDistance(int dense, double lat, double lon);
+
+    /**
+     * @brief Build the spatial index over the zone bounding boxes
+     *
+     * @details Top down, splitting the zones at the median of the longer
+     * axis of their box centers.
+     *
+     * @return true on success, false if out of memory
+     */
+    bool BuildZoneIndex();
+
+    /**
+     * @brief Fill a node of the spatial index and build its children
+     *
+     * @param[in] node index of the node in ZoneIndex
+     * @param[in] first first entry of ZoneIndexOrder covered by the node
+     * @param[in] count number of entries covered by the node
+     */
+    void BuildZoneIndexNode(int node, int first, int count);
+
+    /**
+     * @brief Derive the compiled geometry of a zone from its zone info
+     *
+     * @param[in] dense index of the zone in GeofenceZones
+     */
+    void CompileZone(int dense);
+
+    /**
+     * @brief Build the segment index of a corridor and its bounding box
+     *
+     * @details Leaf boxes cover the vertices of their segments, widened by
+     * the corridor half width in latitude and by the half width over the
+     * cosine of the most polar latitude of the leaf in longitude. Inner
+     * boxes are the union of their children.
+     *
+     * @param[in] zone zone info of a corridor zone
+     * @param[in,out] hot hot data of the zone, the bounding box is set
+     * @param[in,out] geometry compiled geometry of the zone
+     * @param[in] offset date line offset of the polyline
+     *
+     * @return true on success, false if out of memory
+     */
+    bool CompileCorridor(const ZoneInfo& zone,
+                        GeofenceZoneHot& hot,
+                        GeofenceZoneGeometry& geometry,
+                        double offset);
+
+#if GEOFENCE_ENABLE_POLYGON
+    /**
+     * @brief Simplify a concave polygon for IsPolygonalGeofenceOutside()
+     *
+     * @details Douglas-Peucker on the ring with the zone tolerance, in
+     * coordinates where a degree of longitude is scaled to its length at the
+     * middle latitude. Every dropped vertex is within the tolerance of the
+     * edge replacing it, so the simplified and the original polygon only
+     * differ within the tolerance of the simplified edges: its dilation by
+     * the tolerance is an outer and its erosion an inner approximation.
+     * The tolerance is halved until the simplified ring doesn't intersect
+     * itself. Nothing is kept unless it drops at least a quarter of the
+     * vertices.
+     *
+     * @param[in] zone zone info of the polygon
+     * @param[in] hot hot data of the polygon
+     * @param[in,out] geometry compiled geometry of the polygon
+     */
+    void SimplifyPolygon(const ZoneInfo& zone,
+                        const GeofenceZoneHot& hot,
+                        GeofenceZoneGeometry& geometry);
+#endif
+
+#if GEOFENCE_ENABLE_POLYGON && GEOFENCE_POLYGON_CORES
+    /**
+     * @brief Find rectangles inside a polygon for IsPolygonalGeofenceOutside()
+     * to accept points in without testing edges
+     *
+     * @details Boxes with the aspect of the bounding box are grown around
+     * points of a grid inside the polygon until they touch an edge. The
+     * largest is then stretched side by side, and the next one is grown from
+     * the grid points it does not cover. Each box costs O(n) edge tests per
+     * step of a binary search. The boxes are shrunk by a margin well above
+     * the rounding of ray casting so that both agree.
+     *
+     * @param[in] hot hot data of the polygon
+     * @param[in,out] geometry compiled geometry of the polygon, cores are set
+     */
+    void CompilePolygonCores(const GeofenceZoneHot& hot,
+                        GeofenceZoneGeometry& geometry);
+#endif
+
+#if GEOFENCE_USE_FIXED_POINT
+    /**
+     * @brief Derive the circle geometry used by the fixed-point engine
+     *
+     * @param[in] zone zone info of a circular zone
+     * @param[in,out] geometry compiled geometry of the zone
+     */
+    void CompileCircleFixed(const ZoneInfo& zone, GeofenceZoneGeometry& geometry);
+
+    /**
+     * @brief Single precision haversine test of the current point against a
+     * circle
+     *
+     * @details Points further than the latitude or longitude limit are
+     * outside without any floating point math. Otherwise the haversine term
+     * is evaluated with small angle series in float on the E7 offsets and
+     * compared to the term of the radius.
+     *
+     * @param[in] geometry compiled geometry of the circle
+     *
+     * @return true if outside the circle, false if not
+     */
+    bool IsCircularGeofenceOutsideFixed(const GeofenceZoneGeometry& geometry);
+
+    /**
+     * @brief Even-odd ray casting test of the current point in exact integer
+     * arithmetic
+     *
+     * @details Longitudes are relative to the first polygon vertex and
+     * wrapped to +/-180 degrees, which accounts for polygons crossing the
+     * international date line. The edge intersection is compared by cross
+     * multiplying the E7 offsets in 64 bits instead of dividing.
+     *
+     * @param[in] geometry compiled geometry of the polygon
+     * @param[in] points vertices of the polygon in the vertex arena
+     * @param[in] count number of vertices
+     *
+     * @return true if inside the polygon, false if outside the polygon
+     */
+    bool IsPointInPolygonFixed(const GeofenceZoneGeometry& geometry,
+                        const GeofenceFixedVertex* points,
+                        int count);
+#endif
+
+    /**
+     * @brief Move the polygon vertices of a zone to a new range of the vertex
+     * arena
+     *
+     * @details The previous range is released, it is reused when the arena
+     * is compacted. The arena grows geometrically instead of by the size of
+     * each polygon.
+     *
+     * @param[in,out] hot hot data of the zone, vertex_offset and num_points
+     * are updated
+     * @param[in] count number of vertices needed
+     *
+     * @return true on success, false if out of memory
+     */
+    bool AllocateVertices(GeofenceZoneHot& hot, int count);
+
+    /**
+     * @brief Close the gaps left in the vertex arena by released ranges
+     *
+     * @details Live ranges are moved down in place, in the order of their
+     * offsets.
+     */
+    void CompactVertices();
+
+    /**
+     * @brief Send an event to the subscribers of a zone
+     *
+     * @param[in] dense index of the zone in GeofenceZones
+     * @param[in] context event to send
+     */
+    void DispatchEvent(int dense, CallbackContext& context);
+
+    /**
+     * @brief Add a subscription, see Subscribe()
+     *
+     * @param[in] callback function called for each selected event
+     * @param[in] event_mask events to receive
+     * @param[in] handle zone to receive events of, if valid
+     * @param[in] groups groups to receive events of, if handle is not valid
+     * @param[in] batch_callback called with the events of a loop() call
+     * instead of callback, if set
+     *
+     * @return subscription ID greater than zero, or SYSTEM_ERROR_NO_MEMORY
+     */
+    int AddSubscription(GeofenceEventCallback callback,
+                GeofenceEventMask event_mask,
+                GeofenceZoneHandle handle,
+                uint32_t groups,
+                GeofenceBatchCallback batch_callback = GeofenceBatchCallback());
+
+#if GEOFENCE_ENABLE_STATS
+    /**
+     * @brief Find when an event being dispatched was due
+     *
+     * @param[in] dense index of the zone in GeofenceZones
+     * @param[in] type event type
+     * @param[out] due_us micros() time the event was due
+     *
+     * @return true if the latency of the event is measured
+     */
+    bool GetEventDue(int dense, GeofenceEventType type, uint32_t& due_us) const;
+
+#if GEOFENCE_ENABLE_VERIFICATION
+    /**
+     * @brief micros() time the verification timer of a zone ran out, or now
+     * if it hasn't
+     *
+     */
+    uint32_t VerificationDeadlineUs(int dense) const;
+#endif
+
+    /**
+     * @brief Record the latency of an event whose callback is called now
+     *
+     */
+    void RecordLatency(bool measured, uint32_t due_us) {
+        if(measured) {
+            _latency.Record(micros() - due_us);
+        }
+    }
+#endif // GEOFENCE_ENABLE_STATS
+
+    /**
+     * @brief Pass the collected events of a batch subscription to its
+     * callback
+     *
+     * @param[in] index index of the subscription in EventSubscriptions
+     */
+    void DeliverBatch(int index);
+
+    /**
+     * @brief Deliver the events collected by all batch subscriptions during
+     * a loop() call
+     *
+     */
+    void DeliverBatches();
+
+    /**
+     * @brief Build the list of subscribers of every zone
+     *
+     */
+    void BuildSubscriberLists();
+
     /**
      * @brief Check to see how many Polygon Points are enabled
      *
@@ -268,19 +1957,20 @@ private:
      * trigger an event
      *
      * @details Checks the GeofenceZoneState using the given zone_index to see
-     * if the pending event is stable and the pending time has exceeded the
-     * verification_sec. If not reset the pending event to the current state
-     * (inside or outside) for the next call to this function to evaluate again
+     * if the pending event is stable and its verification timer has expired.
+     * If not reset the pending event to the current state (inside or outside)
+     * and schedule its timer for the next call to this function to evaluate
+     * again
      *
      * @param[in] outside_geofence currently inside or outside the geofence
-     * @param[in] zone the given zone info we want to process
+     * @param[in] hot hot data of the zone we want to process
      * @param[in] zone_index the given zone index to be used to look up the
      * correct GeofenceZoneState.
      *
      * @return true if triggered, false if not
      */
     bool IsEventTriggered(bool outside_geofence,
-                        ZoneInfo& zone,
+                        const GeofenceZoneHot& hot,
                         int zone_index);
 
     /**
@@ -299,7 +1989,8 @@ private:
     double CalculateLonDatelineOffset(Vector<PolygonPoint>& poly_points);
 
     /**
-     * \brief           Calculate distance and bearing between `2` latitude and longitude coordinates
+     * \brief           Calculate distance between `2` latitude and longitude coordinates with the
+     *                  selected GEOFENCE_DISTANCE_MODEL
      * \param[in]       las: Latitude start coordinate, in units of degrees
      * \param[in]       los: Longitude start coordinate, in units of degrees
      * \param[in]       lae: Latitude end coordinate, in units of degrees
@@ -323,10 +2014,97 @@ private:
      */
     inline double D2R(double x) {return ((x) * (0.01745329251994));}
 
+    struct ZoneSlot {
+        int dense;              //index in GeofenceZones, -1 if free
+        int next_free;          //next free slot, -1 for end of list
+        uint16_t generation;
+    };
+
+    // Zones are stored densely for evaluation, slots map stable indices and
+    // handles to the dense position. loop() reads ZoneHot and
+    // GeofenceZoneStates for every zone, ZoneGeometry only for zones whose
+    // bounding box contains the point and GeofenceZones (configuration)
+    // only when a zone is compiled.
     Vector<ZoneInfo> GeofenceZones;
+    Vector<GeofenceZoneHot> ZoneHot;
     Vector<GeofenceZoneState> GeofenceZoneStates;
-    Vector<GeofenceEventCallback> EventCallback;
+    Vector<GeofenceZoneGeometry> ZoneGeometry;
+    Vector<int> ZoneSlotIndex;  //slot index of each dense zone
+    // Polygon vertices of all zones, ranges referenced by ZoneHot
+#if GEOFENCE_ENABLE_VERTICES
+    Vector<GeofenceCompiledVertex, GEOFENCE_VERTEX_ALLOCATOR> ZoneVertices;
+    int _released_vertices;     //in released ranges of ZoneVertices
+#endif
+    // Spatial index over ZoneHot boxes, leaves reference dense zones in
+    // ZoneIndexOrder. Rebuilt on the next query after zones change.
+    Vector<GeofenceIndexNode> ZoneIndex;
+    Vector<uint16_t> ZoneIndexOrder;
+    bool _index_dirty;
+    bool _zones_dirty;          //any zone flagged GeofenceZoneHot::DIRTY
+    Vector<ZoneSlot> _slots;
+    int _free_slot;
+
+    struct Subscription {
+        GeofenceEventCallback callback;
+        GeofenceEventMask event_mask;
+        GeofenceZoneHandle handle;      //zone scope, if valid
+        uint32_t groups;                //group scope, if handle is not valid
+        int id;                         //0 once unsubscribed
+        GeofenceBatchCallback batch_callback;   //replaces callback, if set
+        Vector<CallbackContext> batch;  //events of the current loop() call
+#if GEOFENCE_ENABLE_STATS
+        Vector<uint32_t> batch_due_us;  //due times of the measured events
+#endif
+    };
+
+    // Subscribers of dense zone i are
+    // ZoneSubscribers[ZoneSubscriberStart[i]..ZoneSubscriberStart[i+1]]
+    Vector<Subscription> EventSubscriptions;
+    Vector<uint16_t> ZoneSubscribers;
+    Vector<int> ZoneSubscriberStart;
+    Vector<GeofenceEventMask> ZoneEventMask; //union of subscriber event masks
+    bool _subscribers_dirty;
+    bool _dispatching;
+    bool _batch_pending;        //events collected for batch subscriptions
+#if GEOFENCE_ENABLE_ASYNC
+    Vector<GeofenceEventQueue> _async_queues;   //one per worker, empty if inline
+#endif
+    int _last_subscription_id;
 
-    PointData _geofence_point;
+    GeofencePointSeqlock _latest_point;     //from UpdateGeofencePoint()
+    uint32_t _point_sequence;   //publication of _geofence_point
+    PointData _geofence_point;  //evaluated by the current pass
+    float _point_lat_f;         //_geofence_point converted once per pass
+    float _point_lon_f;
+#if GEOFENCE_USE_FIXED_POINT
+    int32_t _point_lat_e7;      //_geofence_point converted once per pass
+    int32_t _point_lon_e7;
+    int32_t _previous_lat_e7;   //_previous_point converted
+    int32_t _previous_lon_e7;
+#endif
+    // Last evaluated fix, start of the crossing segment
+    PointData _previous_point;
+    float _previous_lat_f;
+    float _previous_lon_f;
+    bool _have_previous_point;
+    bool _crossing_detection;
+    int _slice_next;            //dense index the next loop() call resumes at
+    int _slice_max_zones;
+    uint32_t _slice_max_us;
+#if GEOFENCE_ENABLE_STATS
+    uint32_t _pass_slices;      //loop() calls of the current pass
+    GeofenceEvaluationStats _stats;
+    GeofenceLatencyHistogram _latency;
+    uint32_t _pass_point_us;    //arrival of _geofence_point
+    bool _pass_measured;        //first pass over _geofence_point
+    uint32_t _dispatch_due_us;  //micros() time the dispatched events were due
+    bool _dispatch_measured;    //record the latency of the dispatched events
+#endif
+#if GEOFENCE_ENABLE_VERIFICATION
+    GeofenceTimerWheel _verification_timers;    //by zone slot
+    Vector<uint16_t> _expired_timers;
+#endif
+    bool _event_driven;
+    bool _evaluate_pending;     //changed zones since the last pass
     double _maximumDop;
 };
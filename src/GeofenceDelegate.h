@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/**
+ * @brief Size of the inline storage of a GeofenceDelegate in bytes. Large
+ * enough for a std::function, a function pointer with a context pointer, or
+ * a lambda capturing a few pointers.
+ *
+ */
+#ifndef GEOFENCE_DELEGATE_SIZE
+#define GEOFENCE_DELEGATE_SIZE (4 * sizeof(void*))
+#endif
+
+template<typename Signature, size_t Size = GEOFENCE_DELEGATE_SIZE>
+class GeofenceDelegate;
+
+/**
+ * @brief Fixed size callable wrapper that never allocates
+ *
+ * @details Stores a function pointer, a function pointer with a context
+ * pointer, or any callable object that fits in Size bytes inline. Callables
+ * that don't fit are rejected at compile time instead of being moved to the
+ * heap. Invoking the delegate is a single indirect call.
+ *
+ */
+template<typename R, typename... Args, size_t Size>
+class GeofenceDelegate<R(Args...), Size> {
+public:
+
+    GeofenceDelegate() : _invoke(nullptr), _ops(nullptr) {
+    }
+
+    GeofenceDelegate(std::nullptr_t) : GeofenceDelegate() {
+    }
+
+    /**
+     * @brief Wrap a callable object or function
+     *
+     * @param[in] callable function, function pointer or callable object
+     */
+    template<typename F, typename Fn = typename std::decay<F>::type,
+            typename = typename std::enable_if<
+                !std::is_same<Fn, GeofenceDelegate>::value>::type>
+    GeofenceDelegate(F&& callable) : GeofenceDelegate() {
+        static_assert(sizeof(Fn) <= Size,
+            "Callable too large for GeofenceDelegate, increase GEOFENCE_DELEGATE_SIZE");
+        static_assert(alignof(Fn) <= alignof(Storage),
+            "Callable alignment not supported by GeofenceDelegate");
+        if(IsNull<Fn>(callable)) {
+            return;
+        }
+        new(&_storage) Fn(std::forward<F>(callable));
+        _invoke = &Invoke<Fn>;
+        _ops = OpsFor<Fn>::Get();
+    }
+
+    /**
+     * @brief Wrap a function taking an application context pointer as first
+     * argument
+     *
+     * @param[in] function function to call
+     * @param[in] context pointer passed to the function on every call
+     */
+    GeofenceDelegate(R (*function)(void* context, Args...), void* context) :
+            GeofenceDelegate(Bound{function, context}) {
+    }
+
+    GeofenceDelegate(const GeofenceDelegate& other) : GeofenceDelegate() {
+        CopyFrom(other);
+    }
+
+    GeofenceDelegate(GeofenceDelegate&& other) : GeofenceDelegate() {
+        MoveFrom(other);
+    }
+
+    ~GeofenceDelegate() {
+        Reset();
+    }
+
+    GeofenceDelegate& operator=(const GeofenceDelegate& other) {
+        if(this != &other) {
+            Reset();
+            CopyFrom(other);
+        }
+        return *this;
+    }
+
+    GeofenceDelegate& operator=(GeofenceDelegate&& other) {
+        if(this != &other) {
+            Reset();
+            MoveFrom(other);
+        }
+        return *this;
+    }
+
+    R operator()(Args... args) const {
+        return _invoke(&_storage, std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const {
+        return _invoke != nullptr;
+    }
+
+private:
+
+    using Storage = typename std::aligned_storage<Size, alignof(std::max_align_t)>::type;
+
+    struct Ops {
+        void (*copy)(void* dest, const void* src);
+        void (*move)(void* dest, void* src);
+        void (*destroy)(void* p);
+    };
+
+    struct Bound {
+        R (*function)(void* context, Args...);
+        void* context;
+
+        R operator()(Args... args) const {
+            return function(context, std::forward<Args>(args)...);
+        }
+    };
+
+    template<typename Fn>
+    struct OpsFor {
+        static void Copy(void* dest, const void* src) {
+            new(dest) Fn(*static_cast<const Fn*>(src));
+        }
+        static void Move(void* dest, void* src) {
+            new(dest) Fn(std::move(*static_cast<Fn*>(src)));
+        }
+        static void Destroy(void* p) {
+            static_cast<Fn*>(p)->~Fn();
+        }
+        static const Ops* Get() {
+            // Constant initialized, no guard variable required
+            static const Ops ops = {Copy, Move, Destroy};
+            return &ops;
+        }
+    };
+
+    template<typename Fn>
+    static R Invoke(const void* storage, Args... args) {
+        return (*static_cast<Fn*>(const_cast<void*>(storage)))(
+            std::forward<Args>(args)...);
+    }
+
+    // Empty function pointers and std::function objects become empty
+    // delegates
+    template<typename F>
+    static bool IsNull(const F& callable) {
+        return IsNullImpl(callable, 0);
+    }
+    template<typename F>
+    static auto IsNullImpl(const F& callable, int) -> decltype(!callable) {
+        return !callable;
+    }
+    template<typename F>
+    static bool IsNullImpl(const F&, long) {
+        return false;
+    }
+
+    void CopyFrom(const GeofenceDelegate& other) {
+        if(other._ops) {
+            other._ops->copy(&_storage, &other._storage);
+            _invoke = other._invoke;
+            _ops = other._ops;
+        }
+    }
+
+    void MoveFrom(GeofenceDelegate& other) {
+        if(other._ops) {
+            other._ops->move(&_storage, &other._storage);
+            _invoke = other._invoke;
+            _ops = other._ops;
+            other.Reset();
+        }
+    }
+
+    void Reset() {
+        if(_ops) {
+            _ops->destroy(&_storage);
+        }
+        _invoke = nullptr;
+        _ops = nullptr;
+    }
+
+    Storage _storage;
+    R (*_invoke)(const void* storage, Args... args);
+    const Ops* _ops;
+};
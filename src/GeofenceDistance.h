@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <math.h>
+
+/**
+ * @brief Mean earth radius in meters used by the spherical distance models
+ *
+ */
+constexpr double GEOFENCE_EARTH_RADIUS_M = 6371000.0;
+
+/**
+ * @brief WGS84 ellipsoid semi-major axis in meters and flattening
+ *
+ */
+constexpr double GEOFENCE_WGS84_A = 6378137.0;
+constexpr double GEOFENCE_WGS84_F = 1.0 / 298.257223563;
+
+/**
+ * @brief Distance models selectable with GEOFENCE_DISTANCE_MODEL
+ *
+ * @details Each model provides a static Distance() returning the distance in
+ * meters between two coordinates given in degrees. The spherical models
+ * differ from the WGS84 ellipsoid by up to about 0.5% by construction;
+ * run the "distance" benchmark for the cost and error of each one.
+ *
+ */
+namespace GeofenceDistanceModels {
+
+constexpr double DEG_TO_RAD = 0.01745329251994;
+
+/**
+ * @brief Equirectangular projection at the mean latitude. Cheapest model,
+ * accurate for zones of a few kilometers away from the poles.
+ *
+ */
+struct Equirectangular {
+    static double Distance(double las, double los, double lae, double loe) {
+        double dlon = loe - los;
+        if(dlon > 180.0) {dlon -= 360.0;}
+        else if(dlon < -180.0) {dlon += 360.0;}
+        double x = dlon * DEG_TO_RAD * cos((las + lae) * 0.5 * DEG_TO_RAD);
+        double y = (lae - las) * DEG_TO_RAD;
+        return GEOFENCE_EARTH_RADIUS_M * sqrt(x * x + y * y);
+    }
+};
+
+/**
+ * @brief Great circle distance with the haversine formula on a sphere. The
+ * default model.
+ *
+ */
+struct Haversine {
+    static double Distance(double las, double los, double lae, double loe) {
+        double df = (lae - las) * DEG_TO_RAD;
+        double dfi = (loe - los) * DEG_TO_RAD;
+        las *= DEG_TO_RAD;
+        lae *= DEG_TO_RAD;
+
+        /*
+        * a = sin(df / 2)^2 + cos(las) * cos(lae) * sin(dfi / 2)^2
+        * d = RADIUS * 2 * atan(a / (1 - a))
+        */
+        double a = sin(df * 0.5) * sin(df * 0.5) +
+            sin(dfi * 0.5) * sin(dfi * 0.5) * cos(las) * cos(lae);
+        return GEOFENCE_EARTH_RADIUS_M * 2.0 * atan2(sqrt(a), sqrt(1.0 - a));
+    }
+};
+
+/**
+ * @brief Great circle distance from the chord between the unit vectors of
+ * both coordinates on a sphere. No special cases at the poles or the date
+ * line.
+ *
+ */
+struct Chord {
+    static double Distance(double las, double los, double lae, double loe) {
+        las *= DEG_TO_RAD;
+        los *= DEG_TO_RAD;
+        lae *= DEG_TO_RAD;
+        loe *= DEG_TO_RAD;
+        double dx = cos(lae) * cos(loe) - cos(las) * cos(los);
+        double dy = cos(lae) * sin(loe) - cos(las) * sin(los);
+        double dz = sin(lae) - sin(las);
+        double chord = sqrt(dx * dx + dy * dy + dz * dz);
+        return GEOFENCE_EARTH_RADIUS_M * 2.0 * asin(fmin(chord * 0.5, 1.0));
+    }
+};
+
+/**
+ * @brief Geodesic distance on the WGS84 ellipsoid with Vincenty's inverse
+ * formula. Accurate to well below a millimeter, but iterative and by far the
+ * most expensive model. For nearly antipodal points, where the iteration
+ * doesn't converge, the last estimate is returned.
+ *
+ */
+struct Vincenty {
+    static double Distance(double las, double los, double lae, double loe) {
+        const double a = GEOFENCE_WGS84_A;
+        const double f = GEOFENCE_WGS84_F;
+        const double b = a * (1.0 - f);
+
+        double L = (loe - los) * DEG_TO_RAD;
+        double U1 = atan((1.0 - f) * tan(las * DEG_TO_RAD));
+        double U2 = atan((1.0 - f) * tan(lae * DEG_TO_RAD));
+        double sinU1 = sin(U1), cosU1 = cos(U1);
+        double sinU2 = sin(U2), cosU2 = cos(U2);
+
+        double lambda = L;
+        double sin_sigma = 0.0, cos_sigma = 1.0, sigma = 0.0;
+        double cos_sq_alpha = 1.0, cos_2sigma_m = 0.0;
+        for(int i = 0; i < 100; i++) {
+            double sin_lambda = sin(lambda), cos_lambda = cos(lambda);
+            double t1 = cosU2 * sin_lambda;
+            double t2 = cosU1 * sinU2 - sinU1 * cosU2 * cos_lambda;
+            sin_sigma = sqrt(t1 * t1 + t2 * t2);
+            if(sin_sigma == 0.0) {
+                return 0.0;     //coincident points
+            }
+            cos_sigma = sinU1 * sinU2 + cosU1 * cosU2 * cos_lambda;
+            sigma = atan2(sin_sigma, cos_sigma);
+            double sin_alpha = cosU1 * cosU2 * sin_lambda / sin_sigma;
+            cos_sq_alpha = 1.0 - sin_alpha * sin_alpha;
+            //equatorial line when cos_sq_alpha is zero
+            cos_2sigma_m = (cos_sq_alpha != 0.0) ?
+                cos_sigma - 2.0 * sinU1 * sinU2 / cos_sq_alpha : 0.0;
+            double C = f / 16.0 * cos_sq_alpha * (4.0 + f * (4.0 - 3.0 * cos_sq_alpha));
+            double prev = lambda;
+            lambda = L + (1.0 - C) * f * sin_alpha * (sigma + C * sin_sigma *
+                (cos_2sigma_m + C * cos_sigma * (-1.0 + 2.0 * cos_2sigma_m * cos_2sigma_m)));
+            if(fabs(lambda - prev) < 1e-12) {
+                break;
+            }
+        }
+
+        double u_sq = cos_sq_alpha * (a * a - b * b) / (b * b);
+        double A = 1.0 + u_sq / 16384.0 * (4096.0 + u_sq * (-768.0 + u_sq * (320.0 - 175.0 * u_sq)));
+        double B = u_sq / 1024.0 * (256.0 + u_sq * (-128.0 + u_sq * (74.0 - 47.0 * u_sq)));
+        double delta_sigma = B * sin_sigma * (cos_2sigma_m + B / 4.0 *
+            (cos_sigma * (-1.0 + 2.0 * cos_2sigma_m * cos_2sigma_m) -
+                B / 6.0 * cos_2sigma_m * (-3.0 + 4.0 * sin_sigma * sin_sigma) *
+                    (-3.0 + 4.0 * cos_2sigma_m * cos_2sigma_m)));
+        return b * A * (sigma - delta_sigma);
+    }
+};
+
+} // namespace GeofenceDistanceModels
+
+/**
+ * @brief Distance model used to evaluate circular zones, one of the
+ * GeofenceDistanceModels
+ *
+ */
+#ifndef GEOFENCE_DISTANCE_MODEL
+#define GEOFENCE_DISTANCE_MODEL GeofenceDistanceModels::Haversine
+#endif
+
+using GeofenceDistanceModel = GEOFENCE_DISTANCE_MODEL;
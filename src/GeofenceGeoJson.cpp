@@ -0,0 +1,592 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "GeofenceGeoJson.h"
+#include <stdlib.h>
+#include <string.h>
+
+GeofenceGeoJsonReader::GeofenceGeoJsonReader(int max_vertices) :
+    _max_vertices(max_vertices) {
+    _defaults.enable = true;
+    // Reserve once so that the vertex buffers never grow while reading,
+    // Begin() reports if this failed
+    _vertices.reserve(max_vertices);
+    _zone.polygon_points.reserve(max_vertices);
+    Begin(nullptr);
+}
+
+void GeofenceGeoJsonReader::SetZoneDefaults(const ZoneInfo& zone) {
+    _defaults = zone;
+    _defaults.polygon_points.clear();
+}
+
+void GeofenceGeoJsonReader::Begin(GeoJsonZoneCallback callback) {
+    _callback = callback;
+    _depth = 0;
+    _lexer = Lexer::VALUE;
+    _expect = Expect::VALUE;
+    _key = Key::OTHER;
+    _token_len = 0;
+    _token_truncated = false;
+    _zone_count = 0;
+    _skipped_count = 0;
+    _error = SYSTEM_ERROR_NONE;
+    _offset = 0;
+    _error_offset = 0;
+    _done = false;
+    _feature_index = 0;
+    BeginFeature();
+    if(_vertices.capacity() < _max_vertices ||
+            _zone.polygon_points.capacity() < _max_vertices) {
+        _error = SYSTEM_ERROR_NO_MEMORY;
+    }
+}
+
+int GeofenceGeoJsonReader::Parse(const char* data, size_t length) {
+    if(_error) {
+        return _error;
+    }
+    for(size_t i = 0; i < length; i++, _offset++) {
+        int ret = ProcessChar(data[i]);
+        if(ret) {
+            return Fail(ret);
+        }
+    }
+    return SYSTEM_ERROR_NONE;
+}
+
+int GeofenceGeoJsonReader::End() {
+    if(_error) {
+        return _error;
+    }
+    // A bare scalar document is terminated by the end of input
+    int ret = ProcessChar(' ');
+    if(ret) {
+        return Fail(ret);
+    }
+    if(!_done) {
+        return Fail(SYSTEM_ERROR_NOT_ENOUGH_DATA);
+    }
+    return SYSTEM_ERROR_NONE;
+}
+
+int GeofenceGeoJsonReader::Fail(int error) {
+    if(!_error) {
+        _error = error;
+        _error_offset = _offset;
+    }
+    return _error;
+}
+
+int GeofenceGeoJsonReader::ProcessChar(char c) {
+    switch(_lexer) {
+        case Lexer::STRING:
+            if(c == '\\') {
+                _lexer = Lexer::STRING_ESCAPE;
+            }
+            else if(c == '"') {
+                _lexer = Lexer::VALUE;
+                _token[_token_len] = '\0';
+                return OnString();
+            }
+            else if(_token_len < (int)sizeof(_token) - 1) {
+                _token[_token_len++] = c;
+            }
+            else {
+                _token_truncated = true;
+            }
+            return SYSTEM_ERROR_NONE;
+
+        case Lexer::STRING_ESCAPE:
+            // Escaped characters never match the names the reader is
+            // interested in, so they are only kept to close the string
+            _token_truncated = true;
+            _lexer = Lexer::STRING;
+            return SYSTEM_ERROR_NONE;
+
+        case Lexer::NUMBER:
+            if((c >= '0' && c <= '9') || c == '.' || c == '-' || c == '+' ||
+                    c == 'e' || c == 'E') {
+                if(_token_len >= (int)sizeof(_token) - 1) {
+                    return SYSTEM_ERROR_BAD_DATA;
+                }
+                _token[_token_len++] = c;
+                return SYSTEM_ERROR_NONE;
+            }
+            else {
+                _lexer = Lexer::VALUE;
+                _token[_token_len] = '\0';
+                int ret = OnNumber();
+                if(ret) {
+                    return ret;
+                }
+            }
+            break; // Process the delimiter
+
+        case Lexer::LITERAL:
+            if(c >= 'a' && c <= 'z') {
+                if(_token_len >= (int)sizeof(_token) - 1) {
+                    return SYSTEM_ERROR_BAD_DATA;
+                }
+                _token[_token_len++] = c;
+                return SYSTEM_ERROR_NONE;
+            }
+            else {
+                _lexer = Lexer::VALUE;
+                _token[_token_len] = '\0';
+                int ret = OnLiteral();
+                if(ret) {
+                    return ret;
+                }
+            }
+            break; // Process the delimiter
+
+        default:
+            break;
+    }
+
+    switch(c) {
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\n':
+            return SYSTEM_ERROR_NONE;
+        case '{':
+        case '[':
+            if(_expect != Expect::VALUE || _done) {
+                return SYSTEM_ERROR_BAD_DATA;
+            }
+            return OpenContainer(c == '[');
+        case '}':
+        case ']':
+            return CloseContainer(c == ']');
+        case ':':
+            if(_expect != Expect::COLON) {
+                return SYSTEM_ERROR_BAD_DATA;
+            }
+            _expect = Expect::VALUE;
+            return SYSTEM_ERROR_NONE;
+        case ',':
+            if(_expect != Expect::NEXT || !_depth) {
+                return SYSTEM_ERROR_BAD_DATA;
+            }
+            Top()->index++;
+            _expect = (Top()->array) ? Expect::VALUE : Expect::KEY;
+            return SYSTEM_ERROR_NONE;
+        case '"':
+            if((_expect != Expect::VALUE && _expect != Expect::KEY) || _done) {
+                return SYSTEM_ERROR_BAD_DATA;
+            }
+            _lexer = Lexer::STRING;
+            _token_len = 0;
+            _token_truncated = false;
+            return SYSTEM_ERROR_NONE;
+        default:
+            break;
+    }
+
+    if(_expect != Expect::VALUE || _done) {
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+    _token_len = 0;
+    _token[_token_len++] = c;
+    if((c >= '0' && c <= '9') || c == '-') {
+        _lexer = Lexer::NUMBER;
+    }
+    else if(c >= 'a' && c <= 'z') {
+        _lexer = Lexer::LITERAL;
+    }
+    else {
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+    return SYSTEM_ERROR_NONE;
+}
+
+int GeofenceGeoJsonReader::OpenContainer(bool array) {
+    if(_depth >= GEOFENCE_GEOJSON_MAX_DEPTH) {
+        return SYSTEM_ERROR_LIMIT_EXCEEDED;
+    }
+
+    Frame* parent = Top();
+    Frame frame = {array, Role::OTHER, 0, 0, (parent) ? parent->index : 0};
+
+    if(!parent) {
+        // The root object is either a collection, a feature or a geometry
+        if(!array) {
+            frame.role = Role::FEATURE;
+            _feature_index = 0;
+            BeginFeature();
+        }
+    }
+    else if(!parent->array) {
+        if(parent->role == Role::FEATURE) {
+            if(array && _key == Key::FEATURES) {
+                frame.role = Role::FEATURES;
+            }
+            else if(!array && _key == Key::GEOMETRY) {
+                frame.role = Role::GEOMETRY;
+            }
+            else if(!array && _key == Key::PROPERTIES) {
+                frame.role = Role::PROPERTIES;
+            }
+        }
+        if((parent->role == Role::FEATURE || parent->role == Role::GEOMETRY) &&
+                array && _key == Key::COORDINATES) {
+            frame.role = Role::COORDINATES;
+            frame.coord_depth = 1;
+            _position_len = 0;
+        }
+    }
+    else if(parent->role == Role::FEATURES && !array) {
+        frame.role = Role::FEATURE;
+        _feature_index = parent->index;
+        BeginFeature();
+    }
+    else if(parent->role == Role::COORDINATES && array) {
+        frame.role = Role::COORDINATES;
+        frame.coord_depth = parent->coord_depth + 1;
+        _position_len = 0;
+    }
+
+    _stack[_depth++] = frame;
+    _key = Key::OTHER;
+    _expect = (array) ? Expect::VALUE : Expect::KEY;
+    return SYSTEM_ERROR_NONE;
+}
+
+int GeofenceGeoJsonReader::CloseContainer(bool array) {
+    Frame* top = Top();
+    if(!top || top->array != array) {
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+    // Only a complete member or an empty container may be closed
+    bool empty = (top->index == 0) &&
+        (_expect == ((array) ? Expect::VALUE : Expect::KEY));
+    if(_expect != Expect::NEXT && !empty) {
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+
+    if(top->role == Role::COORDINATES && _position_len) {
+        CommitPosition();
+    }
+    if(top->role == Role::FEATURE) {
+        int ret = EndFeature();
+        if(ret) {
+            return ret;
+        }
+    }
+
+    _depth--;
+    return EndValue();
+}
+
+int GeofenceGeoJsonReader::EndValue() {
+    _expect = Expect::NEXT;
+    if(!_depth) {
+        _done = true;
+    }
+    return SYSTEM_ERROR_NONE;
+}
+
+void GeofenceGeoJsonReader::OnKey() {
+    static const struct {
+        const char* name;
+        Key key;
+    } keys[] = {
+        {"type", Key::TYPE},
+        {"features", Key::FEATURES},
+        {"geometry", Key::GEOMETRY},
+        {"properties", Key::PROPERTIES},
+        {"coordinates", Key::COORDINATES},
+        {"radius", Key::RADIUS},
+        {"enable", Key::ENABLE},
+        {"inside_event", Key::INSIDE_EVENT},
+        {"outside_event", Key::OUTSIDE_EVENT},
+        {"enter_event", Key::ENTER_EVENT},
+        {"exit_event", Key::EXIT_EVENT},
+        {"verification_time_sec", Key::VERIFICATION_TIME},
+        {"simplify_tolerance", Key::SIMPLIFY_TOLERANCE},
+    };
+
+    _key = Key::OTHER;
+    if(_token_truncated) {
+        return;
+    }
+    for(auto& entry : keys) {
+        if(!strcmp(_token, entry.name)) {
+            _key = entry.key;
+            return;
+        }
+    }
+}
+
+int GeofenceGeoJsonReader::OnString() {
+    if(_expect == Expect::KEY) {
+        OnKey();
+        _expect = Expect::COLON;
+        return SYSTEM_ERROR_NONE;
+    }
+
+    Frame* top = Top();
+    if(top && !top->array && _key == Key::TYPE &&
+            (top->role == Role::GEOMETRY || top->role == Role::FEATURE)) {
+        if(!strcmp(_token, "Point")) {
+            _geometry = Geometry::POINT;
+        }
+        else if(!strcmp(_token, "LineString")) {
+            _geometry = Geometry::LINE_STRING;
+        }
+        else if(!strcmp(_token, "Polygon")) {
+            _geometry = Geometry::POLYGON;
+        }
+        else if(!strcmp(_token, "MultiPolygon")) {
+            _geometry = Geometry::MULTI_POLYGON;
+        }
+        else if(strcmp(_token, "Feature") &&
+                    strcmp(_token, "FeatureCollection")) {
+            _geometry = Geometry::UNSUPPORTED;
+        }
+    }
+    return EndValue();
+}
+
+int GeofenceGeoJsonReader::OnNumber() {
+    char* end = nullptr;
+    double value = strtod(_token, &end);
+    if(end != _token + _token_len) {
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+
+    Frame* top = Top();
+    if(top && top->role == Role::COORDINATES) {
+        OnCoordinate(value);
+    }
+    else if(top && top->role == Role::PROPERTIES && !top->array) {
+        if(_key == Key::RADIUS) {
+            _zone.radius = value;
+            _have_radius = true;
+        }
+        else if(_key == Key::VERIFICATION_TIME && value >= 0.0) {
+            _zone.verification_time_sec = (uint32_t)value;
+        }
+        else if(_key == Key::SIMPLIFY_TOLERANCE && value >= 0.0) {
+            _zone.simplify_tolerance = value;
+        }
+    }
+    return EndValue();
+}
+
+int GeofenceGeoJsonReader::OnLiteral() {
+    bool value = false;
+    if(!strcmp(_token, "true")) {
+        value = true;
+    }
+    else if(strcmp(_token, "false") && strcmp(_token, "null")) {
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+
+    Frame* top = Top();
+    if(top && top->role == Role::PROPERTIES && !top->array) {
+        switch(_key) {
+            case Key::ENABLE:
+                _zone.enable = value;
+            break;
+            case Key::INSIDE_EVENT:
+                _zone.inside_event = value;
+            break;
+            case Key::OUTSIDE_EVENT:
+                _zone.outside_event = value;
+            break;
+            case Key::ENTER_EVENT:
+                _zone.enter_event = value;
+            break;
+            case Key::EXIT_EVENT:
+                _zone.exit_event = value;
+            break;
+            default:
+            break;
+        }
+    }
+    return EndValue();
+}
+
+void GeofenceGeoJsonReader::OnCoordinate(double value) {
+    if(_position_len < 2) {
+        _position[_position_len] = value;
+    }
+    _position_len++; // Altitude and other extra members are ignored
+}
+
+void GeofenceGeoJsonReader::CommitPosition() {
+    Frame* top = Top();
+    int depth = top->coord_depth;
+    int ring = 0, polygon = 0;
+
+    if(_position_len < 2 || (_position_depth && _position_depth != depth)) {
+        _overflow = true; // Malformed geometry, skip the feature
+        _position_len = 0;
+        return;
+    }
+    _position_depth = depth;
+    _position_len = 0;
+
+    switch(depth) {
+        case 1: // Point: [lon, lat]
+            _zone.center_lon = _position[0];
+            _zone.center_lat = _position[1];
+            _have_point = true;
+            return;
+        case 2: // LineString: [position][lon, lat]
+        break;
+        case 3: // Polygon: [ring][position][lon, lat]
+            ring = _stack[_depth - 2].index_in_parent;
+        break;
+        case 4: // MultiPolygon: [polygon][ring][position][lon, lat]
+            ring = _stack[_depth - 2].index_in_parent;
+            polygon = _stack[_depth - 3].index_in_parent;
+        break;
+        default: // Unsupported geometry, validated at the end of the feature
+            return;
+    }
+
+    // Holes cannot be represented by a zone
+    if(ring) {
+        return;
+    }
+    if(polygon != _last_polygon_index) {
+        if(_polygon_count >= GEOFENCE_GEOJSON_MAX_POLYGONS) {
+            _overflow = true;
+            return;
+        }
+        _polygon_start[_polygon_count++] = _vertices.size();
+        _last_polygon_index = polygon;
+    }
+    if(_vertices.size() >= _max_vertices) {
+        _overflow = true;
+        return;
+    }
+    _vertices.append({_position[1], _position[0], true});
+}
+
+void GeofenceGeoJsonReader::BeginFeature() {
+    // Keep the reserved vertex buffer of the zone across the assignment
+    Vector<PolygonPoint> points(std::move(_zone.polygon_points));
+    _zone = _defaults;
+    _zone.polygon_points = std::move(points);
+    _zone.polygon_points.clear();
+    _vertices.clear();
+    _polygon_count = 0;
+    _last_polygon_index = -1;
+    _position_len = 0;
+    _geometry = Geometry::UNKNOWN;
+    _position_depth = 0;
+    _have_point = false;
+    _overflow = false;
+    _have_radius = false;
+}
+
+int GeofenceGeoJsonReader::EndFeature() {
+    int ret = SYSTEM_ERROR_NONE;
+    Geometry geometry = _geometry;
+    Geometry inferred = Geometry::UNKNOWN;
+
+    switch(_position_depth) {
+        case 1: inferred = Geometry::POINT; break;
+        case 2: inferred = Geometry::LINE_STRING; break;
+        case 3: inferred = Geometry::POLYGON; break;
+        case 4: inferred = Geometry::MULTI_POLYGON; break;
+        case 0: break;
+        default: inferred = Geometry::UNSUPPORTED; break;
+    }
+    if(geometry == Geometry::UNKNOWN) {
+        geometry = inferred;
+    }
+    else if(inferred != Geometry::UNKNOWN && inferred != geometry) {
+        geometry = Geometry::UNSUPPORTED;
+    }
+
+    if(geometry == Geometry::UNKNOWN) {
+        // No geometry at all, e.g. the enclosing FeatureCollection
+    }
+    else if(_overflow || geometry == Geometry::UNSUPPORTED) {
+        _skipped_count++;
+    }
+    else if(geometry == Geometry::POINT) {
+        if(_have_point && _zone.radius > 0.0) {
+            _zone.shape_type = GeofenceShapeType::CIRCULAR;
+            _zone.polygon_points.clear();
+            _zone_count++;
+            if(_callback) {
+                ret = _callback(_zone, _feature_index);
+            }
+        }
+        else {
+            _skipped_count++;
+        }
+    }
+    else if(geometry == Geometry::LINE_STRING) {
+        if(_polygon_count && _vertices.size() >= 2 && _zone.radius > 0.0) {
+            _zone.shape_type = GeofenceShapeType::CORRIDOR;
+            _zone.polygon_points.clear();
+            if(!_zone.polygon_points.append(_vertices)) {
+                ret = SYSTEM_ERROR_NO_MEMORY;
+            }
+            else {
+                _zone_count++;
+                if(_callback) {
+                    ret = _callback(_zone, _feature_index);
+                }
+            }
+        }
+        else {
+            _skipped_count++;
+        }
+    }
+    else {
+        for(int i = 0; i < _polygon_count && !ret; i++) {
+            int end = (i + 1 < _polygon_count) ?
+                _polygon_start[i + 1] : _vertices.size();
+            ret = EmitPolygon(_polygon_start[i], end);
+        }
+        if(!_polygon_count) {
+            _skipped_count++;
+        }
+    }
+
+    BeginFeature();
+    return ret;
+}
+
+int GeofenceGeoJsonReader::EmitPolygon(int start, int end) {
+    // GeoJSON rings repeat the first position as the last one
+    if(end - start > 1 &&
+            _vertices.at(start).lat == _vertices.at(end - 1).lat &&
+            _vertices.at(start).lon == _vertices.at(end - 1).lon) {
+        end--;
+    }
+    if(end - start < 3) {
+        _skipped_count++;
+        return SYSTEM_ERROR_NONE;
+    }
+
+    _zone.shape_type = GeofenceShapeType::POLYGONAL;
+    _zone.polygon_points.clear();
+    if(!_zone.polygon_points.append(_vertices.data() + start, end - start)) {
+        return SYSTEM_ERROR_NO_MEMORY;
+    }
+    _zone_count++;
+    return (_callback) ? _callback(_zone, _feature_index) : SYSTEM_ERROR_NONE;
+}
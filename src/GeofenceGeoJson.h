@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "Geofence.h"
+
+/**
+ * @brief Default maximum number of vertices buffered for a single GeoJSON
+ * feature. Features with more vertices are skipped.
+ *
+ */
+#ifndef GEOFENCE_GEOJSON_MAX_VERTICES
+#define GEOFENCE_GEOJSON_MAX_VERTICES (64)
+#endif
+
+/**
+ * @brief Maximum number of polygons taken from a single MultiPolygon feature
+ *
+ */
+constexpr int GEOFENCE_GEOJSON_MAX_POLYGONS = 8;
+
+/**
+ * @brief Maximum JSON nesting depth accepted by the reader
+ *
+ */
+constexpr int GEOFENCE_GEOJSON_MAX_DEPTH = 16;
+
+/**
+ * @brief Type definition of the callback receiving each imported zone.
+ *
+ * @details The zone is only valid for the duration of the call. Returning
+ * anything other than SYSTEM_ERROR_NONE stops the import and the error is
+ * returned from Parse().
+ *
+ */
+using GeoJsonZoneCallback =
+        GeofenceDelegate<int(const ZoneInfo& zone, int feature_index)>;
+
+/**
+ * @brief Single pass, streaming GeoJSON reader producing geofence zones
+ *
+ * @details The document is fed in arbitrarily sized chunks and tokenized
+ * without building a DOM. Memory use is fixed at construction and is
+ * independent of the document size: only the vertices of the feature being
+ * read are buffered, in buffers of max_vertices allocated by the constructor.
+ * The zone passed to the callback reuses them for every feature.
+ *
+ * Supported input is a FeatureCollection, a single Feature or a bare geometry.
+ * Polygon features produce one POLYGONAL zone, MultiPolygon features one zone
+ * per polygon, Point features with a "radius" property (in meters) one
+ * CIRCULAR zone and LineString features with a "radius" property one CORRIDOR
+ * zone of that half width. Only the exterior ring of a polygon is used, holes
+ * are ignored. Other geometry types are skipped.
+ *
+ * The following feature properties override the zone defaults:
+ * "radius", "enable", "inside_event", "outside_event", "enter_event",
+ * "exit_event", "verification_time_sec" and "simplify_tolerance".
+ */
+class GeofenceGeoJsonReader {
+public:
+
+    GeofenceGeoJsonReader(int max_vertices = GEOFENCE_GEOJSON_MAX_VERTICES);
+
+    /**
+     * @brief Set the zone used as template for every imported zone
+     *
+     * @details Configuration not present in the feature properties (event
+     * flags, verification time, ...) is copied from this zone. By default
+     * imported zones are enabled and have no events selected.
+     *
+     * @param[in] zone template zone info
+     */
+    void SetZoneDefaults(const ZoneInfo& zone);
+
+    /**
+     * @brief Start a new document
+     *
+     * @param[in] callback called once for each imported zone
+     */
+    void Begin(GeoJsonZoneCallback callback);
+
+    /**
+     * @brief Feed the next chunk of the document
+     *
+     * @param[in] data pointer to the chunk
+     * @param[in] length length of the chunk in bytes
+     *
+     * @return SYSTEM_ERROR_NONE, SYSTEM_ERROR_BAD_DATA if the document is
+     * malformed, SYSTEM_ERROR_LIMIT_EXCEEDED if it nests too deeply,
+     * SYSTEM_ERROR_NO_MEMORY if the constructor couldn't allocate the vertex
+     * buffers, or the error returned by the zone callback
+     */
+    int Parse(const char* data, size_t length);
+
+    /**
+     * @brief Finish the document
+     *
+     * @return SYSTEM_ERROR_NONE if the complete document was read, otherwise
+     * the first error encountered or SYSTEM_ERROR_NOT_ENOUGH_DATA if the
+     * document was truncated
+     */
+    int End();
+
+    /**
+     * @brief Number of zones passed to the callback since Begin()
+     *
+     */
+    int ZoneCount() const {
+        return _zone_count;
+    }
+
+    /**
+     * @brief Number of features that were skipped because they had an
+     * unsupported geometry, too many vertices or no radius
+     *
+     */
+    int SkippedFeatureCount() const {
+        return _skipped_count;
+    }
+
+    /**
+     * @brief Byte offset in the document at which the first error occured
+     *
+     */
+    size_t ErrorOffset() const {
+        return _error_offset;
+    }
+
+private:
+
+    enum class Lexer {
+        VALUE,
+        STRING,
+        STRING_ESCAPE,
+        NUMBER,
+        LITERAL,
+    };
+
+    enum class Expect {
+        VALUE,
+        KEY,
+        COLON,
+        NEXT,
+    };
+
+    enum class Role : uint8_t {
+        OTHER,
+        FEATURE,
+        FEATURES,
+        GEOMETRY,
+        PROPERTIES,
+        COORDINATES,
+    };
+
+    enum class Key : uint8_t {
+        OTHER,
+        TYPE,
+        FEATURES,
+        GEOMETRY,
+        PROPERTIES,
+        COORDINATES,
+        RADIUS,
+        ENABLE,
+        INSIDE_EVENT,
+        OUTSIDE_EVENT,
+        ENTER_EVENT,
+        EXIT_EVENT,
+        VERIFICATION_TIME,
+        SIMPLIFY_TOLERANCE,
+    };
+
+    enum class Geometry : uint8_t {
+        UNKNOWN,
+        POINT,
+        LINE_STRING,
+        POLYGON,
+        MULTI_POLYGON,
+        UNSUPPORTED,
+    };
+
+    struct Frame {
+        bool array;
+        Role role;
+        uint8_t coord_depth;    // 1 for the coordinates array itself
+        int index;              // element index within this container
+        int index_in_parent;    // element index of this container in its parent
+    };
+
+    int Fail(int error);
+    int ProcessChar(char c);
+    int OpenContainer(bool array);
+    int CloseContainer(bool array);
+    int EndValue();
+    int OnString();
+    int OnNumber();
+    int OnLiteral();
+    void OnKey();
+    void OnCoordinate(double value);
+    void CommitPosition();
+    void BeginFeature();
+    int EndFeature();
+    int EmitPolygon(int start, int end);
+    Frame* Top() {
+        return (_depth > 0) ? &_stack[_depth - 1] : nullptr;
+    }
+
+    GeoJsonZoneCallback _callback;
+    ZoneInfo _defaults;
+    ZoneInfo _zone;
+
+    Frame _stack[GEOFENCE_GEOJSON_MAX_DEPTH];
+    int _depth;
+    Lexer _lexer;
+    Expect _expect;
+    Key _key;
+    char _token[32];
+    int _token_len;
+    bool _token_truncated;
+
+    // Per feature accumulation
+    Vector<PolygonPoint> _vertices;
+    int _polygon_start[GEOFENCE_GEOJSON_MAX_POLYGONS];
+    int _polygon_count;
+    int _last_polygon_index;
+    int _max_vertices;
+    double _position[2];
+    int _position_len;
+    Geometry _geometry;
+    int _position_depth;
+    bool _have_point;
+    bool _overflow;
+    bool _have_radius;
+    int _feature_index;
+
+    int _zone_count;
+    int _skipped_count;
+    int _error;
+    size_t _offset;
+    size_t _error_offset;
+    bool _done;
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <chrono>
 #include <functional>
 
 // List of all defined system errors
@@ -43,26 +44,48 @@ using namespace spark;
 
 class SystemClass {
 public:
-    SystemClass() : _tick(0) {}
+    SystemClass() : _tick_us(0), _real_time(false) {}
 
     system_tick_t Uptime() const {
-        return (system_tick_t)_tick;
+        return (system_tick_t)millis();
     }
 
     unsigned uptime() const {
-        return _tick / 1000;
+        return millis() / 1000;
     }
 
     uint64_t millis() const {
-        return _tick;
+        return micros() / 1000;
+    }
+
+    uint64_t micros() const {
+        if(_real_time) {
+            return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+        return _tick_us;
+    }
+
+    // Follow the steady clock instead of inc(), for benchmarks
+    void setRealTime(bool enable) {
+        _real_time = enable;
     }
 
     void inc(int i = 1) {
-        _tick += i;
+        _tick_us += (uint64_t)i * 1000;
+    }
+
+    void incMicros(int i = 1) {
+        _tick_us += i;
     }
 
 private:
-    uint64_t _tick;
+    uint64_t _tick_us;
+    bool _real_time;
 };
 
 extern SystemClass System;
+
+inline unsigned long micros() {
+    return (unsigned long)System.micros();
+}
@@ -0,0 +1,648 @@
+/*
+ * Host benchmarks for the geofence library.
+ *
+ * Build the geofence-benchmark target with optimizations enabled
+ * (cmake -DCMAKE_BUILD_TYPE=Release) and run it without arguments to run
+ * every benchmark, or pass benchmark names to select some.
+ */
+
+#include <chrono>
+#include <functional>
+#include <math.h>
+#include <stdio.h>
+#include <string>
+#include <string.h>
+#include <thread>
+
+#include "Geofence.h"
+#include "GeofenceGeoJson.h"
+
+using BenchClock = std::chrono::steady_clock;
+
+// Fix to callback latency percentiles of a run
+static void PrintLatency(const char* name, const GeofenceLatencyHistogram& latency) {
+    printf("%s latency: %u events, p50 %u us, p99 %u us, p99.9 %u us, max %u us\n",
+        name, (unsigned)latency.GetTotalCount(), (unsigned)latency.GetPercentile(50.0),
+        (unsigned)latency.GetPercentile(99.0), (unsigned)latency.GetPercentile(99.9),
+        (unsigned)latency.GetMax());
+}
+
+static double ElapsedSec(BenchClock::time_point start) {
+    return std::chrono::duration<double>(BenchClock::now() - start).count();
+}
+
+// Synthetic FeatureCollection with polygon and point features spread over
+// the San Francisco bay area
+static std::string MakeFeatureCollection(int features) {
+    std::string json = "{\"type\":\"FeatureCollection\",\"features\":[\n";
+    char buf[256];
+    for(int i = 0; i < features; i++) {
+        double lat = 37.0 + (i % 100) * 0.01;
+        double lon = -122.5 + (i / 100 % 100) * 0.01;
+        json += (i) ? ",\n" : "";
+        if(i % 4) {
+            json += "{\"type\":\"Feature\",\"properties\":{\"name\":\"yard\",\"inside_event\":true},"
+                    "\"geometry\":{\"type\":\"Polygon\",\"coordinates\":[[";
+            for(int v = 0; v <= 8; v++) {
+                int k = v % 8;
+                snprintf(buf, sizeof(buf), "%s[%.6f,%.6f]", (v) ? "," : "",
+                    lon + 0.004 * (k == 1 || k == 2 || k == 3) + 0.002 * (k == 0 || k == 4),
+                    lat + 0.004 * (k == 3 || k == 4 || k == 5) + 0.002 * (k == 2 || k == 6));
+                json += buf;
+            }
+            json += "]]}}";
+        }
+        else {
+            snprintf(buf, sizeof(buf), "{\"type\":\"Feature\",\"properties\":{\"radius\":%d,"
+                "\"enter_event\":true},\"geometry\":{\"type\":\"Point\",\"coordinates\":[%.6f,%.6f]}}",
+                100 + i % 500, lon, lat);
+            json += buf;
+        }
+    }
+    json += "\n]}\n";
+    return json;
+}
+
+static void BenchGeoJson() {
+    const std::string json = MakeFeatureCollection(20000);
+    const size_t chunk = 4096;
+    const int iterations = 5;
+    GeofenceGeoJsonReader reader;
+    int zones = 0;
+
+    auto start = BenchClock::now();
+    for(int n = 0; n < iterations; n++) {
+        reader.Begin([&zones](const ZoneInfo& zone, int feature_index) {
+            zones++;
+            return SYSTEM_ERROR_NONE;
+        });
+        for(size_t i = 0; i < json.size(); i += chunk) {
+            reader.Parse(json.data() + i, std::min(chunk, json.size() - i));
+        }
+        if(reader.End()) {
+            printf("geojson: parse error at %u\n", (unsigned)reader.ErrorOffset());
+            return;
+        }
+    }
+    double sec = ElapsedSec(start);
+    printf("geojson: %.1f MB document, %d zones/pass, %.1f MB/s, %.0f zones/s\n",
+        json.size() / 1e6, zones / iterations,
+        json.size() * iterations / sec / 1e6, zones / sec);
+}
+
+// Per event callback dispatch: the previous std::function list copied each
+// callback in the loop, compare with calling std::function and the delegate
+// by reference. The large capture doesn't fit the std::function small buffer
+// so every copy allocates.
+template<typename Callback, bool copy>
+static double DispatchNs(const Vector<Callback>& callbacks, int events) {
+    CallbackContext context = {};
+    auto start = BenchClock::now();
+    for(int n = 0; n < events / callbacks.size(); n++) {
+        context.index = n;
+        if(copy) {
+            for(auto callback : callbacks) {
+                callback(context);
+            }
+        }
+        else {
+            for(auto& callback : callbacks) {
+                callback(context);
+            }
+        }
+    }
+    return ElapsedSec(start) * 1e9 / events;
+}
+
+template<typename Lambda>
+static void BenchDispatchCase(const char* name, Lambda lambda) {
+    const int events = 10000000;
+    Vector<std::function<void(CallbackContext&)>> functions;
+    Vector<GeofenceEventCallback> delegates;
+    for(int i = 0; i < 4; i++) {
+        functions.append(lambda);
+        delegates.append(lambda);
+    }
+    printf("dispatch %s: std::function copy %.2f ns/event, std::function ref %.2f ns/event, "
+        "delegate %.2f ns/event\n", name,
+        DispatchNs<std::function<void(CallbackContext&)>, true>(functions, events),
+        DispatchNs<std::function<void(CallbackContext&)>, false>(functions, events),
+        DispatchNs<GeofenceEventCallback, false>(delegates, events));
+}
+
+static void BenchDispatch() {
+    static volatile uint32_t sink;
+    uint32_t a = 1, b = 2, c = 3;
+
+    BenchDispatchCase("small", [&a](CallbackContext& context) {
+        sink = context.index + a;
+    });
+    BenchDispatchCase("large", [&a, &b, &c](CallbackContext& context) {
+        sink = context.index + a + b + c;
+    });
+
+    // End to end, every zone reports an INSIDE event on each loop
+    const int zones = 64;
+    const int loops = 20000;
+    Geofence geofence(zones);
+    geofence.init();
+    for(int i = 0; i < zones; i++) {
+        auto& zone = geofence.GetZoneInfo(i);
+        zone.enable = true;
+        zone.inside_event = true;
+        zone.shape_type = GeofenceShapeType::CIRCULAR;
+        zone.center_lat = 37.76887;
+        zone.center_lon = -122.48248;
+        zone.radius = 1000.0 + i;
+    }
+    int events = 0;
+    int id = geofence.Subscribe([&events](CallbackContext& context) {
+        events++;
+    });
+    auto start = BenchClock::now();
+    for(int n = 0; n < loops; n++) {
+        geofence.UpdateGeofencePoint({ 37.76705, -122.48593, 0.0, 0.0, 0 });
+        geofence.loop();
+    }
+    double sec = ElapsedSec(start);
+    printf("dispatch loop: %d zones, %.1f events/loop, %.0f ns/loop\n",
+        zones, (double)events / loops, sec * 1e9 / loops);
+    PrintLatency("dispatch loop", geofence.GetLatencyHistogram());
+
+    // Same events delivered once per loop
+    geofence.Unsubscribe(id);
+    events = 0;
+    int calls = 0;
+    geofence.SubscribeBatch([&](const CallbackContext* batch, int count) {
+        calls++;
+        events += count;
+    });
+    geofence.loop();
+    geofence.ResetEvaluationStats();
+    start = BenchClock::now();
+    for(int n = 0; n < loops; n++) {
+        geofence.UpdateGeofencePoint({ 37.76705, -122.48593, 0.0, 0.0, 0 });
+        geofence.loop();
+    }
+    sec = ElapsedSec(start);
+    printf("dispatch batch: %d zones, %.1f events/loop, %.1f calls/loop, "
+        "%.0f ns/loop\n", zones, (double)events / (loops + 1),
+        (double)calls / (loops + 1), sec * 1e9 / loops);
+    PrintLatency("dispatch batch", geofence.GetLatencyHistogram());
+}
+
+// Zone evaluation cost of the selected engine, half circles and half
+// 8 vertex polygons around a point that is inside about half of them
+static void BenchEvaluate() {
+    const int zones = 256;
+    const int loops = 2000;
+    Geofence geofence(zones);
+    geofence.init();
+    for(int i = 0; i < zones; i++) {
+        auto& zone = geofence.GetZoneInfo(i);
+        double lat = 37.70 + (i % 16) * 0.01;
+        double lon = -122.50 + (i / 16) * 0.01;
+        zone.enable = true;
+        zone.inside_event = true;
+        if(i % 2) {
+            zone.shape_type = GeofenceShapeType::CIRCULAR;
+            zone.center_lat = lat;
+            zone.center_lon = lon;
+            zone.radius = 10000.0;
+        }
+        else {
+            zone.shape_type = GeofenceShapeType::POLYGONAL;
+            for(int v = 0; v < 8; v++) {
+                double angle = v * M_PI / 4.0;
+                zone.polygon_points.append({lat + 0.1 * sin(angle),
+                    lon + 0.1 * cos(angle), true});
+            }
+        }
+    }
+    int events = 0;
+    geofence.RegisterGeofenceCallback([&events](CallbackContext& context) {
+        events++;
+    });
+    auto start = BenchClock::now();
+    for(int n = 0; n < loops; n++) {
+        geofence.UpdateGeofencePoint({ 37.70 + (n % 20) * 0.01,
+            -122.45 + (n % 7) * 0.01, 0.0, 0.0, 0 });
+        geofence.loop();
+    }
+    double sec = ElapsedSec(start);
+    printf("evaluate %s: %d zones, %.0f ns/zone, %.1f inside/loop\n",
+        GEOFENCE_USE_FIXED_POINT ? "fixed" : "double", zones,
+        sec * 1e9 / loops / zones, (double)events / loops);
+    auto& stats = geofence.GetEvaluationStats();
+    printf("evaluate polygons: %.0f%% fast reject, %.0f%% fast accept\n",
+        100.0 * stats.fast_rejects / stats.polygon_tests,
+        100.0 * stats.fast_accepts / stats.polygon_tests);
+    printf("evaluate bytes/zone: %u read every loop (hot %u, state %u), "
+        "%u geometry when near, %u config + %u per vertex\n",
+        (unsigned)(sizeof(GeofenceZoneHot) + sizeof(GeofenceZoneState)),
+        (unsigned)sizeof(GeofenceZoneHot), (unsigned)sizeof(GeofenceZoneState),
+        (unsigned)sizeof(GeofenceZoneGeometry), (unsigned)sizeof(ZoneInfo),
+        (unsigned)sizeof(PolygonPoint));
+}
+
+// Cost of each distance model and its largest error, relative to the WGS84
+// geodesic and in meters against the haversine great circle, for distances
+// up to 50 km per latitude band
+template<typename Model>
+static void BenchDistanceModel(const char* name, const Vector<double>& pairs) {
+    const int iterations = 20;
+    volatile double sink = 0.0;
+    auto start = BenchClock::now();
+    for(int n = 0; n < iterations; n++) {
+        for(int i = 0; i < pairs.size(); i += 4) {
+            sink = sink + Model::Distance(pairs[i], pairs[i + 1], pairs[i + 2], pairs[i + 3]);
+        }
+    }
+    double ns = ElapsedSec(start) * 1e9 / iterations / (pairs.size() / 4);
+
+    const double bands[] = {0.0, 30.0, 60.0, 85.0};
+    double geodesic_error[3] = {};
+    double sphere_error[3] = {};
+    for(int i = 0; i < pairs.size(); i += 4) {
+        double d = Model::Distance(pairs[i], pairs[i + 1], pairs[i + 2], pairs[i + 3]);
+        double geodesic = GeofenceDistanceModels::Vincenty::Distance(
+            pairs[i], pairs[i + 1], pairs[i + 2], pairs[i + 3]);
+        double sphere = GeofenceDistanceModels::Haversine::Distance(
+            pairs[i], pairs[i + 1], pairs[i + 2], pairs[i + 3]);
+        for(int band = 0; band < 3; band++) {
+            if(fabs(pairs[i]) >= bands[band] && fabs(pairs[i]) < bands[band + 1]) {
+                geodesic_error[band] = std::max(geodesic_error[band],
+                    fabs(d - geodesic) / geodesic);
+                sphere_error[band] = std::max(sphere_error[band], fabs(d - sphere));
+            }
+        }
+    }
+    printf("distance %-15s %6.1f ns/call", name, ns);
+    for(int band = 0; band < 3; band++) {
+        printf(" | %2.0f-%2.0f deg %.3f%% %.3f m", bands[band], bands[band + 1],
+            geodesic_error[band] * 100.0, sphere_error[band]);
+    }
+    printf("\n");
+}
+
+static void BenchDistance() {
+    Vector<double> pairs;
+    uint32_t seed = 1;
+    auto random = [&seed]() {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 8) / (double)(1 << 24);
+    };
+    for(int i = 0; i < 100000; i++) {
+        double lat = (random() * 2.0 - 1.0) * 85.0;
+        double lon = (random() * 2.0 - 1.0) * 180.0;
+        double offset = 0.45 * random();    //up to 50 km
+        double angle = random() * 2.0 * M_PI;
+        double lae = std::max(-89.9, std::min(89.9, lat + offset * sin(angle)));
+        pairs.append(lat);
+        pairs.append(lon);
+        pairs.append(lae);
+        pairs.append(lon + offset * cos(angle) / cos(lat * M_PI / 180.0));
+    }
+    BenchDistanceModel<GeofenceDistanceModels::Equirectangular>("equirectangular", pairs);
+    BenchDistanceModel<GeofenceDistanceModels::Haversine>("haversine", pairs);
+    BenchDistanceModel<GeofenceDistanceModels::Chord>("chord", pairs);
+    BenchDistanceModel<GeofenceDistanceModels::Vincenty>("vincenty", pairs);
+}
+
+// Corridor evaluation cost against the route length, for fixes following
+// the route (progress cache hits) and fixes jumping anywhere near it
+static void BenchCorridor() {
+    const int loops = 20000;
+    for(int points : {100, 1000, 10000, 60000}) {
+        Geofence geofence(1);
+        geofence.init();
+        auto& zone = geofence.GetZoneInfo(0);
+        zone.enable = true;
+        zone.inside_event = true;
+        zone.shape_type = GeofenceShapeType::CORRIDOR;
+        zone.radius = 200.0;
+        for(int i = 0; i < points; i++) {
+            zone.polygon_points.append({45.0 + 0.02 * sin(i * 0.01),
+                7.0 + 0.001 * i, true});
+        }
+        int events = 0;
+        geofence.RegisterGeofenceCallback([&events](CallbackContext& context) {
+            events++;
+        });
+        geofence.loop();
+
+        double ns[2];
+        for(int jump = 0; jump < 2; jump++) {
+            uint32_t seed = 1;
+            auto start = BenchClock::now();
+            for(int n = 0; n < loops; n++) {
+                seed = seed * 1103515245 + 12345;
+                int i = jump ? (int)((seed >> 8) % points) : n * points / loops;
+                double lat = 45.0 + 0.02 * sin(i * 0.01) + ((seed >> 4) % 5 - 2) * 0.001;
+                geofence.UpdateGeofencePoint({ lat, 7.0 + 0.001 * i, 0.0, 0.0, 0 });
+                geofence.loop();
+            }
+            ns[jump] = ElapsedSec(start) * 1e9 / loops;
+        }
+        printf("corridor %s: %5d points, %.0f ns/fix following, %.0f ns/fix jumping, "
+            "%.2f inside/fix\n", GEOFENCE_USE_FIXED_POINT ? "fixed" : "double",
+            points, ns[0], ns[1], events / (2.0 * loops));
+    }
+}
+
+// Nearest zone query cost against the number of zones, circles and
+// polygons spread over one degree
+static void BenchNearest() {
+    const int queries = 20000;
+    for(int zones : {100, 1000, 10000}) {
+        Geofence geofence(0);
+        uint32_t seed = 1;
+        auto random = [&seed]() {
+            seed = seed * 1103515245 + 12345;
+            return (seed >> 8) / (double)(1 << 24);
+        };
+        for(int i = 0; i < zones; i++) {
+            ZoneInfo zone;
+            double lat = 37.0 + random();
+            double lon = -122.5 + random();
+            if(i % 2) {
+                zone.center_lat = lat;
+                zone.center_lon = lon;
+                zone.radius = 200.0;
+            }
+            else {
+                zone.shape_type = GeofenceShapeType::POLYGONAL;
+                for(int v = 0; v < 8; v++) {
+                    zone.polygon_points.append({lat + 0.002 * sin(v * M_PI / 4.0),
+                        lon + 0.002 * cos(v * M_PI / 4.0), true});
+                }
+            }
+            geofence.AddZone(zone);
+        }
+        GeofenceZoneDistance results[8];
+        double ns[2];
+        for(int k : {1, 8}) {
+            auto start = BenchClock::now();
+            for(int n = 0; n < queries; n++) {
+                geofence.FindNearestZones(37.0 + random(), -122.5 + random(), results, k);
+            }
+            ns[k > 1] = ElapsedSec(start) * 1e9 / queries;
+        }
+        printf("nearest %s: %5d zones, %.0f ns/query k=1, %.0f ns/query k=8\n",
+            GEOFENCE_USE_FIXED_POINT ? "fixed" : "double", zones, ns[0], ns[1]);
+    }
+}
+
+// Cost of loop() called every second with a new point every 10 seconds,
+// evaluating every call against event driven evaluation
+static void BenchIdle() {
+    const int zones = 256;
+    const int loops = 20000;
+    for(bool event_driven : {false, true}) {
+        Geofence geofence(0);
+        for(int i = 0; i < zones; i++) {
+            ZoneInfo zone;
+            zone.enable = true;
+            zone.inside_event = true;
+            zone.enter_event = true;
+            zone.verification_time_sec = 5;
+            zone.center_lat = 37.70 + (i % 16) * 0.01;
+            zone.center_lon = -122.50 + (i / 16) * 0.01;
+            zone.radius = 2000.0;
+            geofence.AddZone(zone);
+        }
+        geofence.SetEventDrivenEvaluation(event_driven);
+        int events = 0;
+        geofence.RegisterGeofenceCallback([&events](CallbackContext& context) {
+            events++;
+        });
+        auto start = BenchClock::now();
+        for(int n = 0; n < loops; n++) {
+            if(n % 10 == 0) {
+                geofence.UpdateGeofencePoint({ 37.70 + (n / 10 % 20) * 0.01,
+                    -122.45 + (n / 10 % 7) * 0.01, 0.0, 0.0, 0 });
+            }
+            geofence.loop();
+            System.inc(1000);
+        }
+        double sec = ElapsedSec(start);
+        printf("idle %s %s: %d zones, %.0f ns/loop, %.1f events/loop\n",
+            GEOFENCE_USE_FIXED_POINT ? "fixed" : "double",
+            event_driven ? "event driven" : "periodic", zones,
+            sec * 1e9 / loops, (double)events / loops);
+    }
+}
+
+// Polygon containment cost against the number of vertices, regular
+// polygons tested with the convex fast path and the same polygons with
+// every fourth vertex pulled in, which are ray cast
+static void BenchConvex() {
+    const int loops = 20000;
+    for(int vertices : {8, 64, 512, 4096}) {
+        double ns[2];
+        for(int concave = 0; concave < 2; concave++) {
+            Geofence geofence(0);
+            ZoneInfo zone;
+            zone.enable = true;
+            zone.inside_event = true;
+            zone.shape_type = GeofenceShapeType::POLYGONAL;
+            for(int i = 0; i < vertices; i++) {
+                double angle = i * 2.0 * M_PI / vertices;
+                double scale = (concave && i % 4 == 0) ? 0.999 : 1.0;
+                zone.polygon_points.append({ 37.77 + 0.01 * scale * sin(angle),
+                    -122.48 + 0.01 * scale * cos(angle), true });
+            }
+            geofence.AddZone(zone);
+            uint32_t seed = 1;
+            auto start = BenchClock::now();
+            for(int n = 0; n < loops; n++) {
+                seed = seed * 1103515245 + 12345;
+                double lat = 37.76 + ((seed >> 8) % 1000) * 0.00002;
+                double lon = -122.49 + ((seed >> 18) % 1000) * 0.00002;
+                geofence.UpdateGeofencePoint({ lat, lon, 0.0, 0.0, 0 });
+                geofence.loop();
+            }
+            ns[concave] = ElapsedSec(start) * 1e9 / loops;
+        }
+        printf("convex %s: %4d vertices, %.0f ns/fix convex, %.0f ns/fix ray cast\n",
+            GEOFENCE_USE_FIXED_POINT ? "fixed" : "double", vertices, ns[0], ns[1]);
+    }
+}
+
+// Concave polygon of GIS export detail, tested in full and simplified with
+// a few tolerances, at points spread over its bounding box
+static void BenchSimplify() {
+    const int loops = 20000;
+    const int vertices = 4000;
+    for(double tolerance : {0.0, 1.0, 5.0, 20.0}) {
+        Geofence geofence(0);
+        ZoneInfo zone;
+        zone.enable = true;
+        zone.inside_event = true;
+        zone.shape_type = GeofenceShapeType::POLYGONAL;
+        zone.simplify_tolerance = tolerance;
+        for(int i = 0; i < vertices; i++) {
+            double angle = i * 2.0 * M_PI / vertices;
+            double r = 0.01 * (1.0 + 0.4 * sin(5.0 * angle)) + 1e-7 * sin(i * 0.7);
+            zone.polygon_points.append({ 37.77 + r * sin(angle),
+                -122.48 + r * cos(angle), true });
+        }
+        auto compile_start = BenchClock::now();
+        geofence.AddZone(zone);
+        geofence.loop();
+        double compile_ms = ElapsedSec(compile_start) * 1e3;
+        int events = 0;
+        geofence.RegisterGeofenceCallback([&events](CallbackContext& context) {
+            events++;
+        });
+        uint32_t seed = 1;
+        auto start = BenchClock::now();
+        for(int n = 0; n < loops; n++) {
+            seed = seed * 1103515245 + 12345;
+            double lat = 37.756 + ((seed >> 8) % 1000) * 0.000028;
+            seed = seed * 1103515245 + 12345;
+            double lon = -122.494 + ((seed >> 8) % 1000) * 0.000028;
+            geofence.UpdateGeofencePoint({ lat, lon, 0.0, 0.0, 0 });
+            geofence.loop();
+        }
+        printf("simplify %s: tolerance %4.1f m, %.0f ns/fix, %.2f inside/fix, "
+            "%.1f ms to compile\n", GEOFENCE_USE_FIXED_POINT ? "fixed" : "double",
+            tolerance, ElapsedSec(start) * 1e9 / loops, (double)events / loops,
+            compile_ms);
+    }
+}
+
+static void BenchRectangle() {
+    const int loops = 20000;
+    const int zones = 64;
+    for(auto shape : {GeofenceShapeType::RECTANGLE, GeofenceShapeType::POLYGONAL}) {
+        Geofence geofence(zones);
+        auto compile_start = BenchClock::now();
+        for(int i = 0; i < zones; i++) {
+            ZoneInfo zone;
+            zone.enable = true;
+            zone.inside_event = true;
+            zone.shape_type = shape;
+            zone.min_lat = 37.70 + (i / 8) * 0.02;
+            zone.max_lat = zone.min_lat + 0.015;
+            zone.min_lon = -122.50 + (i % 8) * 0.02;
+            zone.max_lon = zone.min_lon + 0.015;
+            if(shape == GeofenceShapeType::POLYGONAL) {
+                zone.polygon_points.append({zone.min_lat, zone.min_lon, true});
+                zone.polygon_points.append({zone.min_lat, zone.max_lon, true});
+                zone.polygon_points.append({zone.max_lat, zone.max_lon, true});
+                zone.polygon_points.append({zone.max_lat, zone.min_lon, true});
+            }
+            geofence.AddZone(zone);
+        }
+        geofence.loop();
+        double compile_us = ElapsedSec(compile_start) * 1e6;
+        int events = 0;
+        geofence.RegisterGeofenceCallback([&events](CallbackContext& context) {
+            events++;
+        });
+        uint32_t seed = 1;
+        auto start = BenchClock::now();
+        for(int n = 0; n < loops; n++) {
+            seed = seed * 1103515245 + 12345;
+            double lat = 37.69 + ((seed >> 8) % 1000) * 0.00018;
+            seed = seed * 1103515245 + 12345;
+            double lon = -122.51 + ((seed >> 8) % 1000) * 0.00018;
+            geofence.UpdateGeofencePoint({ lat, lon, 0.0, 0.0, 0 });
+            geofence.loop();
+        }
+        printf("rectangle %s: %s, %d zones, %.0f ns/fix, %.2f inside/fix, "
+            "%.0f us to compile, %u vertex bytes\n",
+            GEOFENCE_USE_FIXED_POINT ? "fixed" : "double",
+            shape == GeofenceShapeType::RECTANGLE ? "rectangle" : "polygon  ",
+            zones, ElapsedSec(start) * 1e9 / loops, (double)events / loops,
+            compile_us, (unsigned)(geofence.GetVertexArenaSize() *
+                sizeof(GeofenceCompiledVertex)));
+    }
+}
+
+// loop() time with a handler taking about 1 us per event, called from loop()
+// and from a worker thread
+static void BenchAsync() {
+    const int zones = 64;
+    const int loops = 2000;
+    for(int capacity : {0, 256}) {
+        Geofence geofence(zones);
+        geofence.init();
+        for(int i = 0; i < zones; i++) {
+            auto& zone = geofence.GetZoneInfo(i);
+            zone.enable = true;
+            zone.inside_event = true;
+            zone.center_lat = 37.76887;
+            zone.center_lon = -122.48248;
+            zone.radius = 1000.0 + i;
+        }
+        std::atomic<int> events(0);
+        geofence.RegisterGeofenceCallback([&events](CallbackContext& context) {
+            auto start = BenchClock::now();
+            while(ElapsedSec(start) < 1e-6) {
+            }
+            events++;
+        });
+        geofence.SetAsyncDelivery(capacity);
+        std::atomic<bool> stop(false);
+        std::thread worker([&]() {
+            while(capacity && !stop) {
+                if(!geofence.ProcessAsyncEvents()) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+        auto start = BenchClock::now();
+        for(int n = 0; n < loops; n++) {
+            geofence.UpdateGeofencePoint({ 37.76705, -122.48593, 0.0, 0.0, 0 });
+            geofence.loop();
+        }
+        double sec = ElapsedSec(start);
+        while(geofence.GetAsyncStats().delivered != geofence.GetAsyncStats().queued) {
+            std::this_thread::yield();
+        }
+        stop = true;
+        worker.join();
+        auto stats = geofence.GetAsyncStats();
+        printf("async %s: %d zones, %.1f us/loop, %.1f events/loop handled, "
+            "%.1f dropped/loop, %u max pending\n",
+            capacity ? "worker" : "inline", zones, sec * 1e6 / loops,
+            (double)events / loops, (double)stats.dropped / loops,
+            (unsigned)stats.max_pending);
+        PrintLatency(capacity ? "async worker" : "async inline",
+            geofence.GetLatencyHistogram());
+    }
+}
+
+static const struct {
+    const char* name;
+    void (*run)();
+} Benchmarks[] = {
+    {"geojson", BenchGeoJson},
+    {"dispatch", BenchDispatch},
+    {"evaluate", BenchEvaluate},
+    {"distance", BenchDistance},
+    {"corridor", BenchCorridor},
+    {"nearest", BenchNearest},
+    {"idle", BenchIdle},
+    {"convex", BenchConvex},
+    {"simplify", BenchSimplify},
+    {"rectangle", BenchRectangle},
+    {"async", BenchAsync},
+};
+
+int main(int argc, char* argv[]) {
+    // Evaluation and latency statistics in real time
+    System.setRealTime(true);
+    for(auto& bench : Benchmarks) {
+        bool selected = (argc < 2);
+        for(int i = 1; i < argc; i++) {
+            selected |= !strcmp(argv[i], bench.name);
+        }
+        if(selected) {
+            bench.run();
+        }
+    }
+    return 0;
+}
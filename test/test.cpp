@@ -1,4 +1,7 @@
 #include <atomic>
+#include <algorithm>
+#include <thread>
+#include <vector>
 
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
@@ -751,3 +754,1969 @@ TEST_CASE("Confidence Level Test") {
     REQUIRE(badCount.exchange(0) == 0); // Not considered a poor location
     REQUIRE(enterCount.exchange(0) == 1); REQUIRE(exitCount.exchange(0) == 0); REQUIRE(insideCount.exchange(0) == 1); REQUIRE(outsideCount.exchange(0) == 0);
 }
+
+TEST_CASE("Zone State Snapshot Restore Test") {
+    auto configure = [](Geofence& fence) {
+        fence.init();
+        for(int i = 0; i < 2; i++) {
+            fence.GetZoneInfo(i).enable = true;
+            fence.GetZoneInfo(i).radius = 2700.0;
+            fence.GetZoneInfo(i).center_lat = 37.76887;
+            fence.GetZoneInfo(i).center_lon = -122.48248;
+            fence.GetZoneInfo(i).enter_event = true;
+            fence.GetZoneInfo(i).exit_event = true;
+            fence.GetZoneInfo(i).shape_type = GeofenceShapeType::CIRCULAR;
+        }
+        fence.GetZoneInfo(2).enable = true;
+        fence.GetZoneInfo(2).radius = 2700.0;
+        fence.GetZoneInfo(2).center_lat = 37.76887;
+        fence.GetZoneInfo(2).center_lon = -122.48248;
+        fence.GetZoneInfo(2).enter_event = true;
+        fence.GetZoneInfo(2).verification_time_sec = 3;
+        fence.GetZoneInfo(2).shape_type = GeofenceShapeType::CIRCULAR;
+    };
+
+    Geofence before(3);
+    configure(before);
+    before.UpdateGeofencePoint(TestPoints[0]); //outside the zones
+    before.loop();
+    System.inc(3000);
+    before.loop();
+    before.UpdateGeofencePoint(TestPoints[6]); //inside the zones
+    before.loop();
+    REQUIRE(before.RegisterGeofenceCallback(geofenceCallback) == SYSTEM_ERROR_NONE);
+    REQUIRE(enterCount.exchange(0) == 0);
+    System.inc(2000);
+
+    uint8_t snapshot[64];
+    REQUIRE(before.GetZoneStateSnapshotSize() == 16 + 3 * 10);
+    REQUIRE(before.SaveZoneStates(snapshot, 16, 7) == SYSTEM_ERROR_TOO_LARGE);
+    REQUIRE(before.SaveZoneStates(snapshot, sizeof(snapshot), 7) == 46);
+
+    uint32_t version = 0;
+    REQUIRE(Geofence::GetZoneStateSnapshotVersion(snapshot, 46, version) == SYSTEM_ERROR_NONE);
+    REQUIRE(version == 7);
+    REQUIRE(Geofence::GetZoneStateSnapshotVersion(snapshot, 45, version) == SYSTEM_ERROR_BAD_DATA);
+
+    // Same zone set: all zones restored, exit fires on the first fix outside
+    {
+        Geofence after(3);
+        configure(after);
+        REQUIRE(after.RestoreZoneStates(snapshot, 46) == 3);
+        REQUIRE(after.RegisterGeofenceCallback(geofenceCallback) == SYSTEM_ERROR_NONE);
+        after.UpdateGeofencePoint(TestPoints[0]); //outside the zones
+        after.loop();
+        REQUIRE(exitCount.exchange(0) == 2);
+        REQUIRE(enterCount.exchange(0) == 0);
+    }
+
+    // The pending verification timer continues where it left off
+    {
+        Geofence after(3);
+        configure(after);
+        REQUIRE(after.RestoreZoneStates(snapshot, 46) == 3);
+        REQUIRE(after.RegisterGeofenceCallback(geofenceCallback) == SYSTEM_ERROR_NONE);
+        after.UpdateGeofencePoint(TestPoints[6]); //inside the zones
+        after.loop();
+        REQUIRE(enterCount.exchange(0) == 0);
+        System.inc(1000);
+        after.loop();
+        REQUIRE(enterCount.exchange(0) == 1);
+    }
+
+    // Changed zone set: only zones with unchanged configuration are restored
+    {
+        Geofence after(3);
+        configure(after);
+        after.GetZoneInfo(1).radius = 100.0;
+        after.GetZoneInfo(0).inside_event = true; // Event selection doesn't matter
+        REQUIRE(after.RestoreZoneStates(snapshot, 46) == 2);
+        REQUIRE(after.RegisterGeofenceCallback(geofenceCallback) == SYSTEM_ERROR_NONE);
+        after.UpdateGeofencePoint(TestPoints[0]); //outside the zones
+        after.loop();
+        REQUIRE(exitCount.exchange(0) == 1);
+    }
+
+    // Removed zones don't pass their state on to the zones moved in their place
+    {
+        Geofence after(3);
+        configure(after);
+        REQUIRE(after.RemoveZone(after.GetZoneHandle(0)) == SYSTEM_ERROR_NONE);
+        REQUIRE(after.RestoreZoneStates(snapshot, 46) == 2);
+        REQUIRE(after.RegisterGeofenceCallback(geofenceCallback) == SYSTEM_ERROR_NONE);
+        after.UpdateGeofencePoint(TestPoints[6]); //inside the zones
+        after.loop();
+        REQUIRE(enterCount.exchange(0) == 0);
+        System.inc(1000);
+        after.loop();
+        REQUIRE(enterCount.exchange(0) == 1); // Pending state of zone 2 kept
+        after.UpdateGeofencePoint(TestPoints[0]); //outside the zones
+        after.loop();
+        REQUIRE(exitCount.exchange(0) == 1);
+    }
+
+    // A zone added in place of a removed one only gets the state if unchanged
+    {
+        Geofence after(3);
+        configure(after);
+        REQUIRE(after.RemoveZone(after.GetZoneHandle(1)) == SYSTEM_ERROR_NONE);
+        ZoneInfo moved = after.GetZoneInfo(2);
+        moved.center_lat += 0.001;
+        auto handle = after.AddZone(moved);
+        REQUIRE(handle.slot == 1);
+        REQUIRE(after.RestoreZoneStates(snapshot, 46) == 2);
+    }
+
+    // Corrupt snapshots are rejected
+    {
+        Geofence after(3);
+        configure(after);
+        REQUIRE(after.RestoreZoneStates(snapshot, 45) == SYSTEM_ERROR_BAD_DATA);
+        snapshot[20] ^= 0x01;
+        REQUIRE(after.RestoreZoneStates(snapshot, 46) == SYSTEM_ERROR_BAD_DATA);
+    }
+    badCount = 0; enterCount = 0; exitCount = 0; insideCount = 0; outsideCount = 0;
+}
+
+TEST_CASE("Set Zone Info Test") {
+    Geofence test(2);
+    test.init();
+
+    ZoneInfo zone;
+    zone.enable = true;
+    zone.radius = 2700.0;
+    zone.center_lat = 37.76887;
+    zone.center_lon = -122.48248;
+    zone.inside_event = true;
+    test.SetZoneInfo(1, zone);
+    REQUIRE(test.GetZoneInfo(1).enable == true);
+    REQUIRE(test.GetZoneInfo(1).radius == 2700.0);
+    REQUIRE(test.GetZoneInfo(0).enable == false);
+
+    REQUIRE(test.RegisterGeofenceCallback(geofenceCallback) == SYSTEM_ERROR_NONE);
+    test.UpdateGeofencePoint(TestPoints[6]); //inside the zone
+    test.loop();
+    REQUIRE(insideCount.exchange(0) == 1);
+
+    // Changing only the events keeps the zone state, moving the zone resets it
+    zone.exit_event = true;
+    REQUIRE(test.SetZoneInfo(test.GetZoneHandle(1), zone) == SYSTEM_ERROR_NONE);
+    test.UpdateGeofencePoint(TestPoints[0]); //outside the zone
+    test.loop();
+    REQUIRE(exitCount.exchange(0) == 1);
+    test.UpdateGeofencePoint(TestPoints[6]); //inside the zone
+    test.loop();
+    REQUIRE(insideCount.exchange(0) == 1);
+    zone.center_lat = 37.76825;
+    zone.center_lon = -122.49245;
+    test.SetZoneInfo(1, zone);
+    test.UpdateGeofencePoint(TestPoints[0]); //outside the zone
+    test.loop();
+    REQUIRE(exitCount.exchange(0) == 0);
+    badCount = 0; enterCount = 0; exitCount = 0; insideCount = 0; outsideCount = 0;
+}
+
+TEST_CASE("Dynamic Zone Set Test") {
+    Geofence test(0);
+    test.init();
+    REQUIRE(test.GetZoneCount() == 0);
+    REQUIRE(test.IsValidZone(GeofenceZoneHandle()) == false);
+
+    ZoneInfo park;
+    park.enable = true;
+    park.radius = 2700.0;
+    park.center_lat = 37.76887;
+    park.center_lon = -122.48248;
+    park.enter_event = true;
+    park.exit_event = true;
+
+    ZoneInfo dateline;
+    dateline.enable = true;
+    dateline.shape_type = GeofenceShapeType::POLYGONAL;
+    dateline.polygon_points = {{7.870459,175.459385,true},
+        {4.504215,175.459385,true},{4.790698,-176.611013,true},
+        {10.058798,-176.248620,true}};
+    dateline.enter_event = true;
+    dateline.exit_event = true;
+
+    auto a = test.AddZone(park);
+    auto b = test.AddZone(dateline);
+    auto c = test.AddZone(park);
+    REQUIRE(test.GetZoneCount() == 3);
+    REQUIRE(a.slot == 0);
+    REQUIRE(b.slot == 1);
+    REQUIRE(c.slot == 2);
+    REQUIRE(test.GetZoneHandle(1) == b);
+    REQUIRE(test.GetZoneInfo(b)->shape_type == GeofenceShapeType::POLYGONAL);
+
+    Vector<CallbackContext> events;
+    test.RegisterGeofenceCallback([&events](CallbackContext& context) {
+        events.append(context);
+    });
+
+    test.UpdateGeofencePoint(TestPoints[0]); //outside all zones
+    test.loop();
+    test.UpdateGeofencePoint(TestPoints[6]); //inside the park zones
+    test.loop();
+    REQUIRE(events.size() == 2);
+    REQUIRE(events.at(0).event_type == GeofenceEventType::ENTER);
+    REQUIRE(events.at(0).handle == a);
+    REQUIRE(events.at(1).index == 2);
+    REQUIRE(events.at(1).handle == c);
+    events.clear();
+
+    // Removing a zone doesn't affect the others
+    REQUIRE(test.RemoveZone(a) == SYSTEM_ERROR_NONE);
+    REQUIRE(test.RemoveZone(a) == SYSTEM_ERROR_NOT_FOUND);
+    REQUIRE(test.IsValidZone(a) == false);
+    REQUIRE(test.GetZoneInfo(a) == nullptr);
+    REQUIRE(test.GetZoneCount() == 2);
+    const Geofence& view = test;
+    REQUIRE(view.GetZoneInfo(a) == nullptr);
+    REQUIRE(view.GetZoneInfo(a.slot).enable == false);
+    REQUIRE(view.GetZoneInfo(99).enable == false);
+    REQUIRE(test.GetZoneInfo(c)->radius == 2700.0);
+    REQUIRE(test.GetZoneInfo(b)->polygon_points.size() == 4);
+
+    // The removed index is reused with a new generation
+    auto d = test.AddZone(dateline);
+    REQUIRE(d.slot == a.slot);
+    REQUIRE(d != a);
+    REQUIRE(test.IsValidZone(a) == false);
+    REQUIRE(test.IsValidZone(d) == true);
+
+    test.UpdateGeofencePoint(TestPoints[7]); //inside the dateline zones
+    test.loop();
+    REQUIRE(events.size() == 2);
+    REQUIRE(events.at(0).event_type == GeofenceEventType::EXIT);
+    REQUIRE(events.at(0).handle == c); // Kept its inside state
+    REQUIRE(events.at(1).event_type == GeofenceEventType::ENTER);
+    REQUIRE(events.at(1).handle == b);
+    events.clear();
+
+    test.UpdateGeofencePoint(TestPoints[0]); //outside all zones
+    test.loop();
+    REQUIRE(events.size() == 2);
+    REQUIRE(events.at(0).event_type == GeofenceEventType::EXIT);
+    REQUIRE(events.at(0).handle == b);
+    REQUIRE(events.at(1).event_type == GeofenceEventType::EXIT);
+    REQUIRE(events.at(1).handle == d); // New zone learnt its state on the previous fix
+}
+
+TEST_CASE("Scoped Subscription Test") {
+    Geofence test(0);
+    test.init();
+
+    ZoneInfo depot;
+    depot.enable = true;
+    depot.radius = 2700.0;
+    depot.center_lat = 37.76887;
+    depot.center_lon = -122.48248;
+    depot.enter_event = true;
+    depot.exit_event = true;
+    depot.inside_event = true;
+    depot.outside_event = true;
+    depot.groups = 0x01;
+    auto depot1 = test.AddZone(depot);
+    auto depot2 = test.AddZone(depot);
+    depot.groups = 0x02;
+    auto yard = test.AddZone(depot);
+
+    int all = 0, zone_exit = 0, group_enter = 0, group_any = 0, once = 0;
+    int all_id = test.Subscribe([&all](CallbackContext& context) {
+        all++;
+    });
+    REQUIRE(all_id > 0);
+    REQUIRE(test.SubscribeZone(depot2, [&](CallbackContext& context) {
+        REQUIRE(context.handle == depot2);
+        zone_exit++;
+    }, GeofenceEventBit(GeofenceEventType::EXIT)) > 0);
+    REQUIRE(test.SubscribeGroup(0x01, [&](CallbackContext& context) {
+        REQUIRE(context.handle != yard);
+        group_enter++;
+    }, GeofenceEventBit(GeofenceEventType::ENTER)) > 0);
+    REQUIRE(test.SubscribeGroup(0x03, [&](CallbackContext& context) {
+        group_any++;
+    }, GeofenceEventBit(GeofenceEventType::ENTER) |
+        GeofenceEventBit(GeofenceEventType::EXIT)) > 0);
+    int once_id = 0;
+    once_id = test.Subscribe([&](CallbackContext& context) {
+        once++;
+        REQUIRE(test.Unsubscribe(once_id) == SYSTEM_ERROR_NONE);
+        REQUIRE(test.Subscribe([](CallbackContext& context) {}) == SYSTEM_ERROR_INVALID_STATE);
+    });
+
+    test.UpdateGeofencePoint(TestPoints[0]); //outside all zones
+    test.loop();
+    REQUIRE(all == 3);
+    REQUIRE(once == 1);
+    REQUIRE(group_enter == 0);
+
+    test.UpdateGeofencePoint(TestPoints[6]); //inside all zones
+    test.loop();
+    REQUIRE(all == 3 + 6);
+    REQUIRE(group_enter == 2);
+    REQUIRE(group_any == 3);
+    REQUIRE(zone_exit == 0);
+
+    test.UpdateGeofencePoint(TestPoints[0]); //outside all zones
+    test.loop();
+    REQUIRE(zone_exit == 1);
+    REQUIRE(group_any == 6);
+    REQUIRE(once == 1);
+
+    // Unsubscribed and removed zones no longer produce callbacks
+    REQUIRE(test.Unsubscribe(all_id) == SYSTEM_ERROR_NONE);
+    REQUIRE(test.Unsubscribe(all_id) == SYSTEM_ERROR_NOT_FOUND);
+    REQUIRE(test.RemoveZone(depot2) == SYSTEM_ERROR_NONE);
+    REQUIRE(test.SubscribeZone(depot2, [](CallbackContext& context) {}) == SYSTEM_ERROR_NOT_FOUND);
+    test.UpdateGeofencePoint(TestPoints[6]); //inside all zones
+    test.loop();
+    REQUIRE(all == 3 + 6 + 6);
+    REQUIRE(group_enter == 3);
+    REQUIRE(group_any == 8);
+
+    // Group membership changes are picked up by the next loop
+    test.GetZoneInfo(depot1)->groups = 0;
+    test.UpdateGeofencePoint(TestPoints[0]); //outside all zones
+    test.loop();
+    REQUIRE(group_any == 9);
+}
+
+TEST_CASE("Zone Change From Callback Test") {
+    Geofence test(0);
+    test.init();
+
+    ZoneInfo park;
+    park.enable = true;
+    park.radius = 2700.0;
+    park.center_lat = 37.76887;
+    park.center_lon = -122.48248;
+    park.enter_event = true;
+    auto first = test.AddZone(park);
+    auto second = test.AddZone(park);
+
+    // Zones can't change while their subscriber lists are in use
+    struct {
+        Geofence* test;
+        ZoneInfo* zone;
+        GeofenceZoneHandle remove;
+        int events;
+        int rejected;
+    } calls = {&test, &park, first, 0, 0};
+    test.Subscribe([&calls](CallbackContext& context) {
+        calls.events++;
+        calls.rejected += !calls.test->IsValidZone(calls.test->AddZone(*calls.zone));
+        calls.rejected += (calls.test->RemoveZone(calls.remove) == SYSTEM_ERROR_INVALID_STATE);
+        calls.rejected += (calls.test->SetZoneInfo(context.handle, *calls.zone) ==
+            SYSTEM_ERROR_INVALID_STATE);
+    });
+
+    test.UpdateGeofencePoint(TestPoints[0]); //outside the zones
+    test.loop();
+    test.UpdateGeofencePoint(TestPoints[6]); //inside the zones
+    test.loop();
+    REQUIRE(calls.events == 2);
+    REQUIRE(calls.rejected == 6);
+    REQUIRE(test.GetZoneCount() == 2);
+    REQUIRE(test.IsValidZone(first));
+    REQUIRE(test.IsValidZone(second));
+
+    // Outside of callbacks they can
+    REQUIRE(test.RemoveZone(first) == SYSTEM_ERROR_NONE);
+    REQUIRE(test.IsValidZone(test.AddZone(park)));
+}
+
+TEST_CASE("Boundary Accuracy Test") {
+    Geofence test(1);
+    test.init();
+    auto& zone = test.GetZoneInfo(0);
+    zone.enable = true;
+    zone.inside_event = true;
+    zone.outside_event = true;
+
+    GeofenceEventType last = GeofenceEventType::UNKNOWN;
+    test.RegisterGeofenceCallback([&last](CallbackContext& context) {
+        last = context.event_type;
+    });
+    auto evaluate = [&](double lat, double lon) {
+        last = GeofenceEventType::UNKNOWN;
+        test.UpdateGeofencePoint({ lat, lon, 0.0, 0.0, 0 });
+        test.loop();
+        return last;
+    };
+
+    // Points 5 cm on either side of circles of 10 m to 50 km, both engines
+    // have to agree with the exact distance
+    const double radius_m = 6371000.0;
+    uint32_t seed = 12345;
+    auto random = [&seed]() {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 8) / (double)(1 << 24);
+    };
+    for(int n = 0; n < 2000; n++) {
+        double center_lat = (random() * 2.0 - 1.0) * 80.0;
+        double center_lon = (random() * 2.0 - 1.0) * 180.0;
+        double radius = 10.0 * pow(5000.0, random());
+        double bearing = random() * 2.0 * M_PI;
+        test.GetZoneInfo(0).shape_type = GeofenceShapeType::CIRCULAR;
+        test.GetZoneInfo(0).center_lat = center_lat;
+        test.GetZoneInfo(0).center_lon = center_lon;
+        test.GetZoneInfo(0).radius = radius;
+
+        for(double offset : {-0.05, 0.05}) {
+            double d = (radius + offset) / radius_m;
+            double la1 = center_lat * M_PI / 180.0;
+            double lo1 = center_lon * M_PI / 180.0;
+            double la2 = asin(sin(la1) * cos(d) + cos(la1) * sin(d) * cos(bearing));
+            double lo2 = lo1 + atan2(sin(bearing) * sin(d) * cos(la1),
+                cos(d) - sin(la1) * sin(la2));
+            double lon = lo2 * 180.0 / M_PI;
+            lon = (lon > 180.0) ? lon - 360.0 : (lon < -180.0) ? lon + 360.0 : lon;
+            REQUIRE(evaluate(la2 * 180.0 / M_PI, lon) ==
+                ((offset > 0) ? GeofenceEventType::OUTSIDE : GeofenceEventType::INSIDE));
+        }
+    }
+
+    // Points 1e-7 degrees from the edges of a polygon across the dateline
+    test.GetZoneInfo(0).shape_type = GeofenceShapeType::POLYGONAL;
+    test.GetZoneInfo(0).polygon_points = {
+        { 10.0, 179.9995, true }, { 10.001, 179.9995, true },
+        { 10.001, -179.9995, true }, { 10.0, -179.9995, true } };
+    REQUIRE(evaluate(10.0000001, 180.0) == GeofenceEventType::INSIDE);
+    REQUIRE(evaluate(9.9999999, 180.0) == GeofenceEventType::OUTSIDE);
+    REQUIRE(evaluate(10.0009999, -179.9995001) == GeofenceEventType::INSIDE);
+    REQUIRE(evaluate(10.0009999, -179.9994999) == GeofenceEventType::OUTSIDE);
+    REQUIRE(evaluate(10.0005, 179.9995001) == GeofenceEventType::INSIDE);
+    REQUIRE(evaluate(10.0005, 179.9994999) == GeofenceEventType::OUTSIDE);
+}
+
+TEST_CASE("Large Polygon Test") {
+    Geofence test(1);
+    test.init();
+    GeofenceEventType last = GeofenceEventType::UNKNOWN;
+    test.RegisterGeofenceCallback([&last](CallbackContext& context) {
+        last = context.event_type;
+    });
+    auto evaluate = [&](double lat, double lon) {
+        last = GeofenceEventType::UNKNOWN;
+        test.UpdateGeofencePoint({ lat, lon, 0.0, 0.0, 0 });
+        test.loop();
+        return last;
+    };
+
+    // 24 sided polygon around the Polo Field, more than NUM_OF_POLYGON_POINTS
+    ZoneInfo zone;
+    zone.enable = true;
+    zone.inside_event = true;
+    zone.outside_event = true;
+    zone.shape_type = GeofenceShapeType::POLYGONAL;
+    for(int i = 0; i < 24; i++) {
+        double angle = i * M_PI / 12.0;
+        zone.polygon_points.append({ 37.768 + 0.002 * sin(angle),
+            -122.4855 + 0.003 * cos(angle), true });
+    }
+    test.SetZoneInfo(0, zone);
+    REQUIRE(evaluate(37.768, -122.4855) == GeofenceEventType::INSIDE);
+    REQUIRE(evaluate(37.7699, -122.4855) == GeofenceEventType::INSIDE);
+    REQUIRE(evaluate(37.7701, -122.4855) == GeofenceEventType::OUTSIDE);
+    REQUIRE(evaluate(37.768, -122.4884) == GeofenceEventType::INSIDE);
+    REQUIRE(evaluate(37.768, -122.4886) == GeofenceEventType::OUTSIDE);
+
+    // Down to a square, back within the inline vertices
+    for(int i = 0; i < 24; i++) {
+        zone.polygon_points.at(i).enable = (i % 6 == 0);
+    }
+    test.SetZoneInfo(0, zone);
+    REQUIRE(evaluate(37.768, -122.4855) == GeofenceEventType::INSIDE);
+    REQUIRE(evaluate(37.7695, -122.4855) == GeofenceEventType::INSIDE);
+    REQUIRE(evaluate(37.7695, -122.4840) == GeofenceEventType::OUTSIDE);
+}
+
+static ZoneInfo RegularPolygonZone(double lat, double lon, int vertices) {
+    ZoneInfo zone;
+    zone.enable = true;
+    zone.inside_event = true;
+    zone.shape_type = GeofenceShapeType::POLYGONAL;
+    for(int i = 0; i < vertices; i++) {
+        double angle = i * 2.0 * M_PI / vertices;
+        zone.polygon_points.append({ lat + 0.001 * sin(angle),
+            lon + 0.001 * cos(angle), true });
+    }
+    return zone;
+}
+
+TEST_CASE("Vertex Arena Test") {
+    Geofence test(0);
+    test.init();
+    Vector<int> inside;
+    test.RegisterGeofenceCallback([&inside](CallbackContext& context) {
+        inside.append(context.index);
+    });
+    auto evaluate = [&](double lat, double lon) {
+        inside.clear();
+        test.UpdateGeofencePoint({ lat, lon, 0.0, 0.0, 0 });
+        test.loop();
+        return (inside.size() == 1) ? inside.at(0) : -1;
+    };
+
+    const int sizes[] = {4, 24, 6, 12, 3};
+    GeofenceZoneHandle handles[5];
+    int total = 0;
+    for(int i = 0; i < 5; i++) {
+        handles[i] = test.AddZone(RegularPolygonZone(10.0 + i * 0.01, 20.0, sizes[i]));
+        total += sizes[i];
+    }
+    REQUIRE(test.GetVertexArenaSize() == total);
+    for(int i = 0; i < 5; i++) {
+        REQUIRE(evaluate(10.0 + i * 0.01, 20.0) == handles[i].slot);
+    }
+
+    // Same number of vertices is compiled in place, a different number
+    // releases the range and takes a new one
+    test.GetZoneInfo(handles[1])->polygon_points.at(0).lat += 0.0001;
+    REQUIRE(evaluate(10.01, 20.0) == handles[1].slot);
+    REQUIRE(test.GetVertexArenaSize() == total);
+    test.GetZoneInfo(handles[3])->polygon_points.at(1).enable = false;
+    REQUIRE(evaluate(10.03, 20.0) == handles[3].slot);
+    REQUIRE(test.GetVertexArenaSize() == total + 11);
+
+    // Removing a zone only releases its range
+    REQUIRE(test.RemoveZone(handles[1]) == SYSTEM_ERROR_NONE);
+    REQUIRE(test.GetVertexArenaSize() == total + 11);
+    REQUIRE(evaluate(10.01, 20.0) == -1);
+
+    // Once half of the arena is released, the next allocation compacts it
+    // and the remaining zones are intact
+    handles[1] = test.AddZone(RegularPolygonZone(10.05, 20.0, 5));
+    REQUIRE(test.GetVertexArenaSize() == 4 + 6 + 11 + 3 + 5);
+    for(int i : {0, 2, 3, 4}) {
+        REQUIRE(evaluate(10.0 + i * 0.01, 20.0) == handles[i].slot);
+    }
+    REQUIRE(evaluate(10.05, 20.0) == handles[1].slot);
+
+    // Polygons turned into circles give their vertices back too
+    test.GetZoneInfo(handles[0])->shape_type = GeofenceShapeType::CIRCULAR;
+    test.GetZoneInfo(handles[0])->center_lat = 10.0;
+    test.GetZoneInfo(handles[0])->center_lon = 20.0;
+    test.GetZoneInfo(handles[0])->radius = 50.0;
+    REQUIRE(evaluate(10.0, 20.0) == handles[0].slot);
+    REQUIRE(test.RemoveZone(handles[4]) == SYSTEM_ERROR_NONE);
+    REQUIRE(test.RemoveZone(handles[1]) == SYSTEM_ERROR_NONE);
+    REQUIRE(test.GetVertexArenaSize() == 29);
+    // 12 released vertices are less than half, the arena just grows
+    handles[1] = test.AddZone(RegularPolygonZone(10.05, 20.0, 3));
+    REQUIRE(test.GetVertexArenaSize() == 29 + 3);
+    REQUIRE(evaluate(10.05, 20.0) == handles[1].slot);
+    REQUIRE(evaluate(10.02, 20.0) == handles[2].slot);
+    REQUIRE(evaluate(10.03, 20.0) == handles[3].slot);
+}
+
+TEST_CASE("Corridor Zone Test") {
+    Geofence test(0);
+    test.init();
+    bool inside = false;
+    test.RegisterGeofenceCallback([&inside](CallbackContext& context) {
+        inside = true;
+    });
+    auto evaluate = [&](double lat, double lon) {
+        inside = false;
+        test.UpdateGeofencePoint({ lat, lon, 0.0, 0.0, 0 });
+        test.loop();
+        return inside;
+    };
+
+    // Winding route of 3000 points, about 80 m apart
+    ZoneInfo route;
+    route.enable = true;
+    route.inside_event = true;
+    route.shape_type = GeofenceShapeType::CORRIDOR;
+    route.radius = 200.0;
+    for(int i = 0; i < 3000; i++) {
+        route.polygon_points.append({45.0 + 0.02 * sin(i * 0.01), 7.0 + 0.001 * i, true});
+    }
+    auto handle = test.AddZone(route);
+    REQUIRE(test.IsValidZone(handle));
+
+    // Reference distance to the densely sampled route around a vertex, the
+    // route doesn't come back to the same place
+    auto route_distance = [&route](int vertex, double lat, double lon) {
+        double best = 1e9;
+        for(int i = std::max(vertex - 20, 0);
+                i < std::min(vertex + 20, route.polygon_points.size() - 1); i++) {
+            auto& a = route.polygon_points.at(i);
+            auto& b = route.polygon_points.at(i + 1);
+            for(int k = 0; k <= 16; k++) {
+                best = std::min(best, GeofenceDistanceModels::Haversine::Distance(
+                    a.lat + (b.lat - a.lat) * k / 16.0, a.lon + (b.lon - a.lon) * k / 16.0,
+                    lat, lon));
+            }
+        }
+        return best;
+    };
+
+    // Following the route and jumping around it, away from the boundary the
+    // result matches the reference
+    uint32_t seed = 7;
+    auto random = [&seed]() {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 8) / (double)(1 << 24);
+    };
+    int checked = 0;
+    for(int n = 0; n < 600; n++) {
+        int i = (n < 300) ? n * 10 : (int)(random() * 3000);
+        auto& point = route.polygon_points.at(i);
+        double lat = point.lat + (random() - 0.5) * 0.008;
+        double lon = point.lon + (random() - 0.5) * 0.008;
+        double distance = route_distance(i, lat, lon);
+        if(fabs(distance - 200.0) > 5.0) {
+            REQUIRE(evaluate(lat, lon) == (distance < 200.0));
+            checked++;
+        }
+    }
+    REQUIRE(checked > 500);
+    REQUIRE_FALSE(evaluate(46.0, 8.0));
+
+    // Round caps around the end points
+    REQUIRE(evaluate(45.0, 7.0 - 0.0019));      // 150 m before the start
+    REQUIRE_FALSE(evaluate(45.0, 7.0 - 0.0032)); // 250 m
+
+    // Across the date line
+    ZoneInfo crossing = route;
+    crossing.polygon_points.clear();
+    crossing.polygon_points.append({10.0, 179.99, true});
+    crossing.polygon_points.append({10.0, -179.99, true});
+    REQUIRE(test.SetZoneInfo(handle, crossing) == SYSTEM_ERROR_NONE);
+    REQUIRE(evaluate(10.001, 180.0));           // 111 m
+    REQUIRE(evaluate(9.999, -179.995));
+    REQUIRE_FALSE(evaluate(10.003, -179.995));  // 333 m
+    REQUIRE_FALSE(evaluate(10.0, 179.0));
+
+    // A single point is a circle, disabled points are ignored
+    crossing.polygon_points.at(1).enable = false;
+    REQUIRE(test.SetZoneInfo(handle, crossing) == SYSTEM_ERROR_NONE);
+    REQUIRE(evaluate(10.001, 179.99));
+    REQUIRE_FALSE(evaluate(10.0, -179.995));
+}
+
+TEST_CASE("Crossing Detection Test") {
+    Geofence test(0);
+    test.init();
+    Vector<CallbackContext> events;
+    test.RegisterGeofenceCallback([&events](CallbackContext& context) {
+        events.append(context);
+    });
+    auto evaluate = [&](double lat, double lon, time_t time) {
+        events.clear();
+        test.UpdateGeofencePoint({ lat, lon, 0.0, 0.0, time });
+        test.loop();
+        return events.size();
+    };
+
+    // 100 m circle and a 0.002 degree square, about 1.7 km apart
+    ZoneInfo circle;
+    circle.enable = true;
+    circle.enter_event = true;
+    circle.exit_event = true;
+    circle.center_lat = 40.0;
+    circle.center_lon = -105.0;
+    circle.radius = 100.0;
+    auto circle_handle = test.AddZone(circle);
+    ZoneInfo square = circle;
+    square.shape_type = GeofenceShapeType::POLYGONAL;
+    square.polygon_points.append({39.999, -104.9808, true});
+    square.polygon_points.append({39.999, -104.9788, true});
+    square.polygon_points.append({40.001, -104.9788, true});
+    square.polygon_points.append({40.001, -104.9808, true});
+    auto square_handle = test.AddZone(square);
+
+    // Fixes 60 s apart on either side of the zones miss them
+    REQUIRE(evaluate(40.0, -105.01, 1000) == 0);
+    REQUIRE(evaluate(40.0, -104.97, 1060) == 0);
+
+    // Driving back through both zones with crossing detection
+    test.SetCrossingDetection(true);
+    REQUIRE(evaluate(40.0, -104.97, 1060) == 0);
+    REQUIRE(evaluate(40.0, -105.01, 1120) == 4);
+    // Square from -104.9788 to -104.9808, circle from about -104.99883 to
+    // -105.00117, at 1.5 s per 0.001 degree
+    REQUIRE(events.at(0).handle == circle_handle);
+    REQUIRE(events.at(0).event_type == GeofenceEventType::ENTER);
+    REQUIRE(events.at(0).time == 1103);
+    REQUIRE(events.at(1).event_type == GeofenceEventType::EXIT);
+    REQUIRE(events.at(1).time == 1107);
+    REQUIRE(events.at(2).handle == square_handle);
+    REQUIRE(events.at(2).event_type == GeofenceEventType::ENTER);
+    REQUIRE(events.at(2).time == 1073);
+    REQUIRE(events.at(3).event_type == GeofenceEventType::EXIT);
+    REQUIRE(events.at(3).time == 1076);
+
+    // Passing north of both zones
+    REQUIRE(evaluate(40.0015, -105.01, 1150) == 0);
+    REQUIRE(evaluate(40.0015, -104.97, 1180) == 0);
+
+    // Entering and leaving report when the boundary was crossed
+    REQUIRE(evaluate(40.0, -104.980, 1240) == 1);
+    REQUIRE(events.at(0).event_type == GeofenceEventType::ENTER);
+    REQUIRE(events.at(0).time == 1233);
+    REQUIRE(evaluate(39.996, -104.980, 1300) == 1);
+    REQUIRE(events.at(0).event_type == GeofenceEventType::EXIT);
+    REQUIRE(events.at(0).time == 1255);
+
+    // Verification time can't be met between fixes
+    square.verification_time_sec = 10;
+    test.SetZoneInfo(square_handle, square);
+    REQUIRE(evaluate(40.0, -104.97, 1360) == 0);
+    REQUIRE(evaluate(40.0, -105.01, 1420) == 2);
+    REQUIRE(events.at(0).handle == circle_handle);
+
+    // Fixes across the date line take the short way past zones close to it
+    REQUIRE(test.RemoveZone(circle_handle) == SYSTEM_ERROR_NONE);
+    square.verification_time_sec = 0;
+    square.polygon_points.clear();
+    square.polygon_points.append({9.99, 179.90, true});
+    square.polygon_points.append({9.99, 179.95, true});
+    square.polygon_points.append({10.01, 179.95, true});
+    square.polygon_points.append({10.01, 179.90, true});
+    REQUIRE(test.SetZoneInfo(square_handle, square) == SYSTEM_ERROR_NONE);
+    REQUIRE(evaluate(10.0, 179.99, 1500) == 0);
+    REQUIRE(evaluate(10.0, -179.99, 1520) == 0);
+    REQUIRE(evaluate(10.0, 179.99, 1540) == 0);
+    REQUIRE(evaluate(10.0, 179.85, 1580) == 2);
+    REQUIRE(events.at(0).event_type == GeofenceEventType::ENTER);
+    REQUIRE(events.at(1).event_type == GeofenceEventType::EXIT);
+
+    // Across the gap of a U shaped zone, from one arm to the other
+    square.polygon_points.clear();
+    square.polygon_points.append({40.000, -104.990, true});
+    square.polygon_points.append({40.000, -104.980, true});
+    square.polygon_points.append({40.003, -104.980, true});
+    square.polygon_points.append({40.003, -104.983, true});
+    square.polygon_points.append({40.001, -104.983, true});
+    square.polygon_points.append({40.001, -104.987, true});
+    square.polygon_points.append({40.003, -104.987, true});
+    square.polygon_points.append({40.003, -104.990, true});
+    REQUIRE(test.SetZoneInfo(square_handle, square) == SYSTEM_ERROR_NONE);
+    REQUIRE(evaluate(40.002, -104.989, 2000) == 0);
+    REQUIRE(evaluate(40.002, -104.981, 2080) == 2);
+    REQUIRE(events.at(0).event_type == GeofenceEventType::EXIT);
+    REQUIRE(events.at(0).time == 2020);
+    REQUIRE(events.at(1).event_type == GeofenceEventType::ENTER);
+    REQUIRE(events.at(1).time == 2060);
+    REQUIRE(evaluate(40.0005, -104.981, 2140) == 0); // Back along the base
+    REQUIRE(evaluate(40.0005, -104.989, 2200) == 0);
+}
+
+TEST_CASE("Nearest Zones Test") {
+    Geofence test(0);
+
+    // Circles, squares and short corridors around Denver, in two groups
+    uint32_t seed = 3;
+    auto random = [&seed]() {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 8) / (double)(1 << 24);
+    };
+    for(int i = 0; i < 400; i++) {
+        ZoneInfo zone;
+        zone.enable = (i % 7) != 0;
+        zone.groups = 1 << (i % 2);
+        double lat = 39.5 + random();
+        double lon = -105.5 + random();
+        if(i % 3 == 0) {
+            zone.center_lat = lat;
+            zone.center_lon = lon;
+            zone.radius = 100.0 + 2000.0 * random();
+        }
+        else {
+            zone.shape_type = (i % 3 == 1) ? GeofenceShapeType::POLYGONAL :
+                GeofenceShapeType::CORRIDOR;
+            zone.radius = 50.0;
+            double size = 0.001 + 0.01 * random();
+            zone.polygon_points.append({lat, lon, true});
+            zone.polygon_points.append({lat, lon + size, true});
+            zone.polygon_points.append({lat + size, lon + size, true});
+            zone.polygon_points.append({lat + size, lon, true});
+        }
+        REQUIRE(test.IsValidZone(test.AddZone(zone)));
+    }
+
+    // The closest zones match the ordering of all zones
+    GeofenceZoneDistance all[400];
+    GeofenceZoneDistance nearest[5];
+    for(int n = 0; n < 50; n++) {
+        double lat = 39.4 + 1.2 * random();
+        double lon = -105.6 + 1.2 * random();
+        uint32_t groups = (n % 3) ? GEOFENCE_GROUP_ALL : 2;
+        int total = test.FindNearestZones(lat, lon, all, 400, groups);
+        REQUIRE(total == ((groups == 2) ? 200 : 400));
+        for(int i = 1; i < total; i++) {
+            REQUIRE(all[i - 1].distance <= all[i].distance);
+        }
+        REQUIRE(test.FindNearestZones(lat, lon, nearest, 5, groups) == 5);
+        for(int i = 0; i < 5; i++) {
+            REQUIRE(nearest[i].distance == all[i].distance);
+            REQUIRE(test.GetZoneInfo(nearest[i].handle)->groups & groups);
+        }
+    }
+
+    // Signed distances
+    Geofence depots(0);
+    GeofenceZoneDistance result;
+    REQUIRE(depots.FindNearestZone(40.0, -105.0, result) == SYSTEM_ERROR_NOT_FOUND);
+    ZoneInfo circle;
+    circle.center_lat = 40.0;
+    circle.center_lon = -105.0;
+    circle.radius = 500.0;
+    auto circle_handle = depots.AddZone(circle);
+    ZoneInfo square;
+    square.shape_type = GeofenceShapeType::POLYGONAL;
+    square.polygon_points.append({40.0, -104.9, true});
+    square.polygon_points.append({40.0, -104.8, true});
+    square.polygon_points.append({40.1, -104.8, true});
+    square.polygon_points.append({40.1, -104.9, true});
+    auto square_handle = depots.AddZone(square);
+
+    REQUIRE(depots.FindNearestZone(40.0, -105.0, result) == SYSTEM_ERROR_NONE);
+    REQUIRE(result.handle == circle_handle);
+    REQUIRE(result.distance == Approx(-500.0).margin(0.1));
+    REQUIRE(depots.FindNearestZone(40.01, -105.0, result) == SYSTEM_ERROR_NONE);
+    REQUIRE(result.distance == Approx(1111.95 - 500.0).margin(1.0));
+    // 0.01 degrees south of the square, then inside 0.01 degrees from its
+    // west edge
+    REQUIRE(depots.FindNearestZone(39.99, -104.85, result) == SYSTEM_ERROR_NONE);
+    REQUIRE(result.handle == square_handle);
+    REQUIRE(result.distance == Approx(1111.95).margin(1.0));
+    REQUIRE(depots.FindNearestZone(40.05, -104.89, result) == SYSTEM_ERROR_NONE);
+    REQUIRE(result.handle == square_handle);
+    REQUIRE(result.distance == Approx(-1111.95 * cos(40.05 * M_PI / 180.0)).margin(1.0));
+
+    // The index follows zone changes
+    depots.GetZoneInfo(circle_handle)->center_lon = -104.85;
+    depots.GetZoneInfo(circle_handle)->center_lat = 39.99;
+    REQUIRE(depots.FindNearestZone(39.99, -104.85, result) == SYSTEM_ERROR_NONE);
+    REQUIRE(result.handle == circle_handle);
+    REQUIRE(depots.RemoveZone(circle_handle) == SYSTEM_ERROR_NONE);
+    REQUIRE(depots.FindNearestZone(39.99, -104.85, result) == SYSTEM_ERROR_NONE);
+    REQUIRE(result.handle == square_handle);
+}
+
+TEST_CASE("Event Distance Test") {
+    Geofence test(0);
+    test.init();
+    ZoneInfo circle;
+    circle.enable = true;
+    circle.inside_event = true;
+    circle.outside_event = true;
+    circle.center_lat = 40.0;
+    circle.center_lon = -105.0;
+    circle.radius = 100.0;
+    auto circle_handle = test.AddZone(circle);
+
+    ZoneInfo square = circle;
+    square.shape_type = GeofenceShapeType::POLYGONAL;
+    square.polygon_points.append({40.01, -105.0, true});
+    square.polygon_points.append({40.01, -104.99, true});
+    square.polygon_points.append({40.02, -104.99, true});
+    square.polygon_points.append({40.02, -105.0, true});
+    auto square_handle = test.AddZone(square);
+
+    // Straight route of 500 points along the 39.99 parallel
+    ZoneInfo route = circle;
+    route.shape_type = GeofenceShapeType::CORRIDOR;
+    route.radius = 100.0;
+    for(int i = 0; i < 500; i++) {
+        route.polygon_points.append({39.99, -105.5 + i * 0.002, true});
+    }
+    auto route_handle = test.AddZone(route);
+
+    double distances[3];
+    int plain = 0;
+    auto slot_of = [&](GeofenceZoneHandle handle) {
+        return (handle == circle_handle) ? 0 : (handle == square_handle) ? 1 : 2;
+    };
+    REQUIRE(test.Subscribe([&](CallbackContext& context) {
+        distances[slot_of(context.handle)] = context.distance;
+    }, GEOFENCE_EVENT_MASK_ALL | GEOFENCE_EVENT_DISTANCE) > 0);
+    REQUIRE(test.Subscribe([&](CallbackContext& context) {
+        plain++;
+    }) > 0);
+
+    // Inside the circle, south of the square, north of the route
+    test.UpdateGeofencePoint({ 40.0, -105.0, 0.0, 0.0, 0 });
+    test.loop();
+    REQUIRE(plain == 3);
+    REQUIRE(distances[0] == Approx(-100.0).margin(0.1));
+    REQUIRE(distances[1] == Approx(1111.95).margin(1.0));
+    REQUIRE(distances[2] == Approx(1111.95 - 100.0).margin(1.0));
+
+    // Outside the circle, inside the square near its west edge
+    test.UpdateGeofencePoint({ 40.015, -104.999, 0.0, 0.0, 0 });
+    test.loop();
+    REQUIRE(distances[0] == Approx(GeofenceDistanceModels::Haversine::Distance(
+        40.0, -105.0, 40.015, -104.999) - 100.0).margin(0.1));
+    REQUIRE(distances[1] == Approx(-85.18).margin(0.5));
+    REQUIRE(distances[2] == Approx(2779.9 - 100.0).margin(2.0));
+
+    // Not computed without the flag or with a poor location
+    double seen = 0.0;
+    test.Unsubscribe(1);
+    test.Subscribe([&seen](CallbackContext& context) {
+        seen = context.distance;
+    });
+    test.loop();
+    REQUIRE(std::isnan(seen));
+    test.Subscribe([&seen](CallbackContext& context) {
+        seen = context.distance;
+    }, GeofenceEventBit(GeofenceEventType::POOR_LOCATION) | GEOFENCE_EVENT_DISTANCE);
+    seen = 0.0;
+    test.UpdateGeofencePoint({ 40.015, -104.999, 0.0, 100.0, 0 });
+    test.loop();
+    REQUIRE(std::isnan(seen));
+}
+
+TEST_CASE("Evaluation Budget Test") {
+    Geofence test(0);
+    test.init();
+    for(int i = 0; i < 10; i++) {
+        ZoneInfo zone;
+        zone.enable = true;
+        zone.inside_event = true;
+        zone.outside_event = true;
+        zone.center_lat = 40.0;
+        zone.center_lon = -105.0 + i * 0.0001;
+        zone.radius = 100.0;
+        REQUIRE(test.IsValidZone(test.AddZone(zone)));
+    }
+    int inside = 0, outside = 0, cost_us = 0;
+    test.Subscribe([&](CallbackContext& context) {
+        if(context.event_type == GeofenceEventType::INSIDE) {
+            inside++;
+        }
+        else if(context.event_type == GeofenceEventType::OUTSIDE) {
+            outside++;
+        }
+        System.incMicros(cost_us);
+    });
+
+    // Without a budget a call evaluates every zone
+    test.UpdateGeofencePoint({ 40.0, -105.0, 0.0, 0.0, 0 });
+    test.loop();
+    REQUIRE(inside == 10);
+    REQUIRE(test.IsPassComplete());
+    REQUIRE(test.GetEvaluationStats().passes == 1);
+    REQUIRE(test.GetEvaluationStats().last_pass_slices == 1);
+
+    // Three zones per call, the whole pass uses the point it started with
+    test.SetEvaluationBudget(3, 0);
+    test.ResetEvaluationStats();
+    inside = 0;
+    test.loop();
+    REQUIRE(inside == 3);
+    REQUIRE_FALSE(test.IsPassComplete());
+    test.UpdateGeofencePoint({ 41.0, -105.0, 0.0, 0.0, 0 });
+    test.loop();
+    test.loop();
+    REQUIRE(inside == 9);
+    REQUIRE_FALSE(test.IsPassComplete());
+    test.loop();
+    REQUIRE(inside == 10);
+    REQUIRE(outside == 0);
+    REQUIRE(test.IsPassComplete());
+    test.loop();
+    REQUIRE(outside == 3);
+    REQUIRE(test.GetEvaluationStats().slices == 5);
+    REQUIRE(test.GetEvaluationStats().passes == 1);
+    REQUIRE(test.GetEvaluationStats().max_pass_slices == 4);
+
+    // A time budget stops once it is used up, after at least one zone
+    test.SetEvaluationBudget(0, 250);
+    test.ResetEvaluationStats();
+    cost_us = 100;
+    outside = 0;
+    test.loop();
+    REQUIRE(outside == 3);
+    REQUIRE(test.GetEvaluationStats().last_slice_us == 300);
+    test.loop();
+    test.loop();
+    REQUIRE(outside == 7);
+    REQUIRE(test.IsPassComplete());
+    REQUIRE(test.GetEvaluationStats().last_pass_slices == 4);
+    test.SetEvaluationBudget(0, 50);
+    test.ResetEvaluationStats();
+    for(int i = 0; i < 10; i++) {
+        test.loop();
+    }
+    REQUIRE(outside == 17);
+    REQUIRE(test.IsPassComplete());
+    REQUIRE(test.GetEvaluationStats().passes == 1);
+    REQUIRE(test.GetEvaluationStats().max_pass_slices == 10);
+    REQUIRE(test.GetEvaluationStats().max_slice_us == 100);
+
+    // Keep later tests on whole milliseconds
+    System.incMicros(1000 - System.micros() % 1000);
+}
+
+TEST_CASE("Verification Timer Wheel Test") {
+    // Random schedules, cancels and jumps against a plain list of deadlines,
+    // starting just below a top level boundary so the top level wraps
+    constexpr int count = 200;
+    GeofenceTimerWheel wheel(count);
+    uint64_t reference[count] = {};
+    uint64_t now = (1ULL << 36) - 100000;
+    wheel.Advance(now);
+    uint32_t seed = 11;
+    auto random = [&seed](uint32_t range) {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 8) % range;
+    };
+    const uint32_t ranges[] = {100, 10000, 3600000, 70000000};
+    for(int step = 0; step < 20000; step++) {
+        int id = random(count);
+        switch(random(4)) {
+            case 0:
+            case 1:
+                reference[id] = now + 1 + random(ranges[random(4)]);
+                REQUIRE(wheel.Schedule(id, reference[id]));
+                break;
+            case 2:
+                wheel.Cancel(id);
+                reference[id] = 0;
+                break;
+            default: {
+                now += random(ranges[random(3)]);
+                int due = 0;
+                for(auto& deadline : reference) {
+                    if(deadline && deadline <= now) {
+                        deadline = 0;
+                        due++;
+                    }
+                }
+                REQUIRE(wheel.Advance(now) == due);
+                break;
+            }
+        }
+        uint64_t earliest = UINT64_MAX;
+        int mismatched = 0;
+        for(int i = 0; i < count; i++) {
+            mismatched += (wheel.IsScheduled(i) != (reference[i] != 0));
+            if(reference[i]) {
+                earliest = std::min(earliest, reference[i]);
+            }
+        }
+        REQUIRE(mismatched == 0);
+        uint64_t deadline = 0;
+        REQUIRE(wheel.NextDeadline(deadline) == (earliest != UINT64_MAX));
+        if(earliest != UINT64_MAX) {
+            REQUIRE(deadline == earliest);
+        }
+    }
+    REQUIRE_FALSE(wheel.Schedule(0, now));
+    REQUIRE_FALSE(wheel.IsScheduled(0));
+}
+
+TEST_CASE("Verification Deadline Test") {
+    Geofence test(0);
+    test.init();
+    ZoneInfo zone;
+    zone.enable = true;
+    zone.enter_event = true;
+    zone.exit_event = true;
+    zone.verification_time_sec = 3;
+    zone.center_lat = 37.76887;
+    zone.center_lon = -122.48248;
+    zone.radius = 2700.0;
+    auto handle = test.AddZone(zone);
+    int enter = 0, exit = 0;
+    test.Subscribe([&](CallbackContext& context) {
+        enter += (context.event_type == GeofenceEventType::ENTER);
+        exit += (context.event_type == GeofenceEventType::EXIT);
+    });
+
+    uint64_t deadline = 0;
+    REQUIRE_FALSE(test.GetNextDeadline(deadline));
+    test.UpdateGeofencePoint(TestPoints[0]); //outside the zone
+    System.inc(1);
+    test.loop();
+    REQUIRE(test.GetNextDeadline(deadline));
+    REQUIRE(deadline == System.millis() + 3000);
+    System.inc(3000);
+    test.loop();
+    REQUIRE_FALSE(test.GetNextDeadline(deadline));
+
+    // The enter is confirmed on the deadline and not a millisecond earlier
+    test.UpdateGeofencePoint(TestPoints[6]); //inside the zone
+    test.loop();
+    uint64_t entered = System.millis();
+    REQUIRE(test.GetNextDeadline(deadline));
+    REQUIRE(deadline == entered + 3000);
+    System.inc(2999);
+    test.loop();
+    REQUIRE(enter == 0);
+    System.inc(1);
+    test.loop();
+    REQUIRE(enter == 1);
+    REQUIRE_FALSE(test.GetNextDeadline(deadline));
+
+    // Leaving and coming back before the deadline cancels the exit
+    test.UpdateGeofencePoint(TestPoints[0]);
+    test.loop();
+    REQUIRE(test.GetNextDeadline(deadline));
+    System.inc(1000);
+    test.UpdateGeofencePoint(TestPoints[6]);
+    test.loop();
+    REQUIRE(test.GetNextDeadline(deadline));
+    REQUIRE(deadline == System.millis() + 3000);
+    System.inc(5000);
+    test.loop();
+    REQUIRE(exit == 0);
+    REQUIRE(enter == 1);
+
+    // A pending transition goes away with its zone
+    test.UpdateGeofencePoint(TestPoints[0]);
+    test.loop();
+    REQUIRE(test.GetNextDeadline(deadline));
+    REQUIRE(test.RemoveZone(handle) == SYSTEM_ERROR_NONE);
+    REQUIRE_FALSE(test.GetNextDeadline(deadline));
+}
+
+TEST_CASE("Event Driven Evaluation Test") {
+    Geofence test(0);
+    test.init();
+    ZoneInfo zone;
+    zone.enable = true;
+    zone.inside_event = true;
+    zone.center_lat = 37.76887;
+    zone.center_lon = -122.48248;
+    zone.radius = 2700.0;
+    auto plain = test.AddZone(zone);
+    zone.inside_event = false;
+    zone.enter_event = true;
+    zone.verification_time_sec = 3;
+    test.AddZone(zone);
+    int inside = 0, enter = 0;
+    test.Subscribe([&](CallbackContext& context) {
+        inside += (context.event_type == GeofenceEventType::INSIDE);
+        enter += (context.event_type == GeofenceEventType::ENTER);
+    });
+    test.SetEventDrivenEvaluation(true);
+
+    // One evaluation per point, calls in between do nothing
+    test.UpdateGeofencePoint(TestPoints[0]); //outside the zones
+    test.loop();
+    System.inc(3000);
+    test.loop();
+    test.UpdateGeofencePoint(TestPoints[6]); //inside the zones
+    test.loop();
+    REQUIRE(inside == 1);
+    for(int i = 0; i < 2999; i++) {
+        System.inc(1);
+        test.loop();
+    }
+    REQUIRE(inside == 1);
+    REQUIRE(enter == 0);
+    REQUIRE(test.GetEvaluationStats().slices == 2);
+
+    // The expired verification timer confirms the enter on its own
+    System.inc(1);
+    test.loop();
+    REQUIRE(enter == 1);
+    REQUIRE(inside == 1);
+    REQUIRE(test.GetEvaluationStats().slices == 2);
+    test.loop();
+    REQUIRE(enter == 1);
+
+    // Reading the zone info doesn't mark the zone changed
+    const Geofence& view = test;
+    REQUIRE(view.GetZoneInfo(0).inside_event == true);
+    REQUIRE(view.GetZoneInfo(plain)->radius == 2700.0);
+    test.loop();
+    REQUIRE(test.GetEvaluationStats().slices == 2);
+
+    // Changed zones are evaluated without a new point
+    zone.enter_event = false;
+    zone.inside_event = true;
+    zone.verification_time_sec = 0;
+    REQUIRE(test.SetZoneInfo(plain, zone) == SYSTEM_ERROR_NONE);
+    test.loop();
+    REQUIRE(inside == 2);
+    REQUIRE(test.GetEvaluationStats().slices == 3);
+
+    // Periodic evaluation dispatches on every call again
+    test.SetEventDrivenEvaluation(false);
+    test.loop();
+    test.loop();
+    REQUIRE(inside == 4);
+}
+
+// Ray casting in the arithmetic of the selected engine, on E7 coordinates
+static bool ReferenceInPolygon(const Vector<PolygonPoint>& points,
+                int64_t lat, int64_t lon) {
+    bool inside = false;
+    for(int i = 0, j = points.size() - 1; i < points.size(); j = i++) {
+#if GEOFENCE_USE_FIXED_POINT
+        int64_t lat_i = llround(points[i].lat * 1e7), lon_i = llround(points[i].lon * 1e7);
+        int64_t lat_j = llround(points[j].lat * 1e7), lon_j = llround(points[j].lon * 1e7);
+        if((lat_i < lat && lat_j >= lat) || (lat_j < lat && lat_i >= lat)) {
+            int64_t lhs = (lon - lon_j) * (lat_i - lat_j);
+            int64_t rhs = (lon_i - lon_j) * (lat - lat_j);
+            if((lat_i > lat_j) ? (lhs > rhs) : (lhs < rhs)) {
+                inside = !inside;
+            }
+        }
+#else
+        double point_lat = lat / 1e7, point_lon = lon / 1e7;
+        auto& a = points[i];
+        auto& b = points[j];
+        if((a.lat < point_lat && b.lat >= point_lat) ||
+                (b.lat < point_lat && a.lat >= point_lat)) {
+            if(point_lon > (b.lon + (a.lon - b.lon) * (point_lat - b.lat) /
+                    (a.lat - b.lat))) {
+                inside = !inside;
+            }
+        }
+#endif
+    }
+    return inside;
+}
+
+TEST_CASE("Convex Polygon Test") {
+    Geofence test(0);
+    test.init();
+    ZoneInfo zone;
+    zone.enable = true;
+    zone.inside_event = true;
+    zone.outside_event = true;
+    zone.shape_type = GeofenceShapeType::POLYGONAL;
+    auto handle = test.AddZone(zone);
+    GeofenceEventType last = GeofenceEventType::UNKNOWN;
+    test.Subscribe([&last](CallbackContext& context) {
+        last = context.event_type;
+    });
+
+    uint32_t seed = 4321;
+    auto random = [&seed]() {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 8) / (double)(1 << 24);
+    };
+    int mismatches = 0, evaluated = 0;
+    auto check = [&](int64_t lat, int64_t lon) {
+        last = GeofenceEventType::UNKNOWN;
+        test.UpdateGeofencePoint({ lat / 1e7, lon / 1e7, 0.0, 0.0, 0 });
+        test.loop();
+        bool inside = ReferenceInPolygon(zone.polygon_points, lat, lon);
+        mismatches += (last != (inside ? GeofenceEventType::INSIDE :
+            GeofenceEventType::OUTSIDE));
+        evaluated++;
+    };
+
+    // Convex polygons of both windings from 3 to 200 vertices and 1 m to
+    // 10 km across, concave polygons and self intersecting stars, tested
+    // at random points, on the vertices, next to them and on the edges
+    for(int n = 0; n < 300; n++) {
+        int count = 3 + (int)(random() * 198);
+        double radius_lat = 1e-5 * pow(1e4, random());
+        double radius_lon = radius_lat * (0.5 + random());
+        int kind = n % 5;   // 0-2 convex, 3 concave, 4 star
+        Vector<double> angles;
+        for(int i = 0; i < count; i++) {
+            angles.append(random() * 2.0 * M_PI);
+        }
+        std::sort(angles.begin(), angles.end());
+        zone.polygon_points.clear();
+        for(int i = 0; i < count; i++) {
+            double angle = (kind == 4) ? (i * 2 % count) * 2.0 * M_PI / count :
+                angles[(kind == 1) ? count - 1 - i : i];
+            double scale = (kind == 3 && i % 3 == 0) ? 0.6 : 1.0;
+            zone.polygon_points.append({
+                llround((40.0 + scale * radius_lat * sin(angle)) * 1e7) / 1e7,
+                llround((-105.0 + scale * radius_lon * cos(angle)) * 1e7) / 1e7, true });
+        }
+        REQUIRE(test.SetZoneInfo(handle, zone) == SYSTEM_ERROR_NONE);
+
+        int64_t lat0 = 400000000, lon0 = -1050000000;
+        int64_t extent_lat = (int64_t)(radius_lat * 1.2e7) + 2;
+        int64_t extent_lon = (int64_t)(radius_lon * 1.2e7) + 2;
+        for(int i = 0; i < 50; i++) {
+            check(lat0 + (int64_t)((random() * 2.0 - 1.0) * extent_lat),
+                lon0 + (int64_t)((random() * 2.0 - 1.0) * extent_lon));
+        }
+        for(int i = 0; i < count; i++) {
+            auto& a = zone.polygon_points[i];
+            auto& b = zone.polygon_points[(i + 1) % count];
+            int64_t lat_a = llround(a.lat * 1e7), lon_a = llround(a.lon * 1e7);
+            int64_t lat_b = llround(b.lat * 1e7), lon_b = llround(b.lon * 1e7);
+            check(lat_a, lon_a);
+            check(lat_a + 1, lon_a - 1);
+            check((lat_a + lat_b) / 2, (lon_a + lon_b) / 2);
+        }
+    }
+    CHECK(evaluated > 50000);
+    REQUIRE(mismatches == 0);
+}
+
+TEST_CASE("Polygon Core Test") {
+    Geofence test(0);
+    test.init();
+    ZoneInfo zone;
+    zone.enable = true;
+    zone.inside_event = true;
+    zone.outside_event = true;
+    zone.shape_type = GeofenceShapeType::POLYGONAL;
+    const double radius = 0.01;
+    for(int i = 0; i < 64; i++) {
+        double angle = i * 2.0 * M_PI / 64;
+        zone.polygon_points.append({ 40.0 + radius * sin(angle),
+            -105.0 + radius * cos(angle), true });
+    }
+    REQUIRE(test.IsValidZone(test.AddZone(zone)));
+    GeofenceEventType last = GeofenceEventType::UNKNOWN;
+    test.Subscribe([&last](CallbackContext& context) {
+        last = context.event_type;
+    });
+    auto evaluate = [&](double lat, double lon) {
+        last = GeofenceEventType::UNKNOWN;
+        test.UpdateGeofencePoint({ 40.0 + lat * radius, -105.0 + lon * radius,
+            0.0, 0.0, 0 });
+        test.loop();
+        return last;
+    };
+    test.ResetEvaluationStats();
+
+    // Deep inside, accepted by an inscribed rectangle
+    REQUIRE(evaluate(0.0, 0.0) == GeofenceEventType::INSIDE);
+    REQUIRE(evaluate(0.5, 0.0) == GeofenceEventType::INSIDE);
+    REQUIRE(evaluate(0.0, -0.5) == GeofenceEventType::INSIDE);
+    REQUIRE(test.GetEvaluationStats().fast_accepts == 3);
+    REQUIRE(test.GetEvaluationStats().fast_rejects == 0);
+
+    // Outside of the bounding box, and inside it but outside the polygon
+    REQUIRE(evaluate(0.0, 1.5) == GeofenceEventType::OUTSIDE);
+    REQUIRE(test.GetEvaluationStats().fast_rejects == 1);
+    REQUIRE(evaluate(0.95, 0.95) == GeofenceEventType::OUTSIDE);
+    REQUIRE(evaluate(0.99 * M_SQRT1_2, -0.99 * M_SQRT1_2) == GeofenceEventType::INSIDE);
+    REQUIRE(test.GetEvaluationStats().polygon_tests == 6);
+    REQUIRE(test.GetEvaluationStats().fast_rejects == 1);
+
+    // Random points agree with ray casting, inside a core or not
+    uint32_t seed = 99;
+    int mismatches = 0;
+    for(int i = 0; i < 10000; i++) {
+        seed = seed * 1103515245 + 12345;
+        double lat = ((int)((seed >> 8) % 2001) - 1000) * 0.0011;
+        seed = seed * 1103515245 + 12345;
+        double lon = ((int)((seed >> 8) % 2001) - 1000) * 0.0011;
+        bool inside = ReferenceInPolygon(zone.polygon_points,
+            llround((40.0 + lat * radius) * 1e7), llround((-105.0 + lon * radius) * 1e7));
+        mismatches += (evaluate(lat, lon) !=
+            (inside ? GeofenceEventType::INSIDE : GeofenceEventType::OUTSIDE));
+    }
+    REQUIRE(mismatches == 0);
+    auto& stats = test.GetEvaluationStats();
+    CHECK(stats.fast_accepts > stats.polygon_tests / 4);
+    CHECK(stats.fast_rejects > stats.polygon_tests / 10);
+}
+
+TEST_CASE("Polygon Simplification Test") {
+    Geofence test(0);
+    test.init();
+    ZoneInfo zone;
+    zone.enable = true;
+    zone.inside_event = true;
+    zone.outside_event = true;
+    zone.shape_type = GeofenceShapeType::POLYGONAL;
+    zone.simplify_tolerance = 5.0;
+
+    // Concave flower of 2000 vertices with centimeter jitter, a GIS export
+    // with far more detail than a GPS fix
+    uint32_t seed = 777;
+    auto random = [&seed]() {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 8) / (double)(1 << 24);
+    };
+    const double radius = 0.01;
+    for(int i = 0; i < 2000; i++) {
+        double angle = i * 2.0 * M_PI / 2000;
+        double r = radius * (1.0 + 0.4 * sin(5.0 * angle)) + (random() - 0.5) * 2e-7;
+        zone.polygon_points.append({
+            llround((40.0 + r * sin(angle)) * 1e7) / 1e7,
+            llround((-105.0 + r * cos(angle) / cos(40.0 * M_PI / 180.0)) * 1e7) / 1e7,
+            true });
+    }
+    auto handle = test.AddZone(zone);
+    REQUIRE(test.IsValidZone(handle));
+    GeofenceEventType last = GeofenceEventType::UNKNOWN;
+    test.Subscribe([&last](CallbackContext& context) {
+        last = context.event_type;
+    });
+
+    // Same answers as the full polygon, also within the tolerance band
+    // where the full polygon decides
+    int mismatches = 0;
+    for(double tolerance : {5.0, 0.5, 50.0}) {
+        zone.simplify_tolerance = tolerance;
+        REQUIRE(test.SetZoneInfo(handle, zone) == SYSTEM_ERROR_NONE);
+        for(int i = 0; i < 4000; i++) {
+            double angle = random() * 2.0 * M_PI;
+            double r = radius * (1.0 + 0.4 * sin(5.0 * angle)) +
+                (random() - 0.5) * ((i % 2) ? 2e-4 : 2e-2);
+            int64_t lat = llround((40.0 + r * sin(angle)) * 1e7);
+            int64_t lon = llround((-105.0 + r * cos(angle) /
+                cos(40.0 * M_PI / 180.0)) * 1e7);
+            last = GeofenceEventType::UNKNOWN;
+            test.UpdateGeofencePoint({ lat / 1e7, lon / 1e7, 0.0, 0.0, 0 });
+            test.loop();
+            bool inside = ReferenceInPolygon(zone.polygon_points, lat, lon);
+            mismatches += (last != (inside ? GeofenceEventType::INSIDE :
+                GeofenceEventType::OUTSIDE));
+        }
+    }
+    REQUIRE(mismatches == 0);
+}
+
+TEST_CASE("Rectangle Zone Test") {
+    Geofence test(0);
+    test.init();
+    ZoneInfo box;
+    box.enable = true;
+    box.inside_event = true;
+    box.outside_event = true;
+    box.shape_type = GeofenceShapeType::RECTANGLE;
+    box.min_lat = 39.999;
+    box.max_lat = 40.001;
+    box.min_lon = -104.9808;
+    box.max_lon = -104.9788;
+    auto handle = test.AddZone(box);
+    REQUIRE(test.IsValidZone(handle));
+    ZoneInfo square = box;
+    square.shape_type = GeofenceShapeType::POLYGONAL;
+    square.polygon_points.append({box.min_lat, box.min_lon, true});
+    square.polygon_points.append({box.min_lat, box.max_lon, true});
+    square.polygon_points.append({box.max_lat, box.max_lon, true});
+    square.polygon_points.append({box.max_lat, box.min_lon, true});
+    auto square_handle = test.AddZone(square);
+
+    GeofenceEventType box_event = GeofenceEventType::UNKNOWN;
+    GeofenceEventType square_event = GeofenceEventType::UNKNOWN;
+    Vector<CallbackContext> events;
+    test.Subscribe([&](CallbackContext& context) {
+        if(context.handle == square_handle) {
+            square_event = context.event_type;
+        }
+        else {
+            box_event = context.event_type;
+            events.append(context);
+        }
+    });
+    auto evaluate = [&](double lat, double lon, time_t time = 0) {
+        box_event = square_event = GeofenceEventType::UNKNOWN;
+        events.clear();
+        test.UpdateGeofencePoint({ lat, lon, 0.0, 0.0, time });
+        test.loop();
+        return box_event;
+    };
+
+    // Same as the square polygon off the edges, edges included
+    uint32_t seed = 46;
+    int mismatches = 0;
+    for(int i = 0; i < 2000; i++) {
+        seed = seed * 1103515245 + 12345;
+        double lat = 39.9985 + ((seed >> 8) % 1000) * 0.0000031;
+        seed = seed * 1103515245 + 12345;
+        double lon = -104.9813 + ((seed >> 8) % 1000) * 0.0000031;
+        mismatches += (evaluate(lat, lon) != square_event);
+    }
+    REQUIRE(mismatches == 0);
+    REQUIRE(evaluate(39.999, -104.9798) == GeofenceEventType::INSIDE);
+    REQUIRE(evaluate(40.0, -104.9788) == GeofenceEventType::INSIDE);
+    REQUIRE(evaluate(40.0, -104.97879) == GeofenceEventType::OUTSIDE);
+
+    // Distance to the nearest edge, negative inside
+    GeofenceZoneDistance nearest;
+    REQUIRE(test.FindNearestZone(40.0, -104.9798, nearest) == SYSTEM_ERROR_NONE);
+    REQUIRE(nearest.distance == Approx(-85.2).epsilon(0.01));
+    REQUIRE(test.FindNearestZone(40.002, -104.9798, nearest) == SYSTEM_ERROR_NONE);
+    REQUIRE(nearest.distance == Approx(111.2).epsilon(0.01));
+
+    // Crossing between fixes, 1.5 s per 0.001 degree
+    box.inside_event = false;
+    box.outside_event = false;
+    box.enter_event = true;
+    box.exit_event = true;
+    REQUIRE(test.SetZoneInfo(handle, box) == SYSTEM_ERROR_NONE);
+    REQUIRE(test.RemoveZone(square_handle) == SYSTEM_ERROR_NONE);
+    test.SetCrossingDetection(true);
+    evaluate(40.0, -104.97, 1060);
+    REQUIRE(evaluate(40.0, -105.01, 1120) == GeofenceEventType::EXIT);
+    REQUIRE(events.size() == 2);
+    REQUIRE(events.at(0).event_type == GeofenceEventType::ENTER);
+    REQUIRE(events.at(0).time == 1073);
+    REQUIRE(events.at(1).time == 1076);
+
+    // Across the date line, with the west edge on either side of 0
+    box.enter_event = false;
+    box.exit_event = false;
+    box.inside_event = true;
+    box.outside_event = true;
+    box.min_lon = 179.5;
+    box.max_lon = -179.5;
+    REQUIRE(test.SetZoneInfo(handle, box) == SYSTEM_ERROR_NONE);
+    test.SetCrossingDetection(false);
+    REQUIRE(evaluate(40.0, 179.9) == GeofenceEventType::INSIDE);
+    REQUIRE(evaluate(40.0, -179.9) == GeofenceEventType::INSIDE);
+    REQUIRE(evaluate(40.0, 180.0) == GeofenceEventType::INSIDE);
+    REQUIRE(evaluate(40.0, 179.0) == GeofenceEventType::OUTSIDE);
+    REQUIRE(evaluate(40.0, -179.0) == GeofenceEventType::OUTSIDE);
+    REQUIRE(evaluate(40.0, 0.0) == GeofenceEventType::OUTSIDE);
+    box.min_lon = -10.0;
+    box.max_lon = -20.0;
+    REQUIRE(test.SetZoneInfo(handle, box) == SYSTEM_ERROR_NONE);
+    REQUIRE(evaluate(40.0, -5.0) == GeofenceEventType::INSIDE);
+    REQUIRE(evaluate(40.0, 179.0) == GeofenceEventType::INSIDE);
+    REQUIRE(evaluate(40.0, -25.0) == GeofenceEventType::INSIDE);
+    REQUIRE(evaluate(40.0, -15.0) == GeofenceEventType::OUTSIDE);
+
+    // Crossing the date line between fixes
+    box.min_lon = 179.9;
+    box.max_lon = -179.9;
+    box.inside_event = false;
+    box.outside_event = false;
+    box.enter_event = true;
+    box.exit_event = true;
+    REQUIRE(test.SetZoneInfo(handle, box) == SYSTEM_ERROR_NONE);
+    test.SetCrossingDetection(true);
+    evaluate(40.0, 179.8, 0);
+    REQUIRE(evaluate(40.0, -179.8, 40) == GeofenceEventType::EXIT);
+    REQUIRE(events.size() == 2);
+    REQUIRE(events.at(0).time == 10);
+    REQUIRE(events.at(1).time == 30);
+
+    // Latitudes the wrong way round are never inside
+    box.min_lat = 40.001;
+    box.max_lat = 39.999;
+    box.inside_event = true;
+    box.outside_event = true;
+    REQUIRE(test.SetZoneInfo(handle, box) == SYSTEM_ERROR_NONE);
+    test.SetCrossingDetection(false);
+    REQUIRE(evaluate(40.0, 180.0) == GeofenceEventType::OUTSIDE);
+}
+
+TEST_CASE("Batch Subscription Test") {
+    Geofence test(0);
+    test.init();
+
+    ZoneInfo depot;
+    depot.enable = true;
+    depot.radius = 2700.0;
+    depot.center_lat = 37.76887;
+    depot.center_lon = -122.48248;
+    depot.enter_event = true;
+    depot.exit_event = true;
+    depot.inside_event = true;
+    depot.outside_event = true;
+    depot.groups = 0x01;
+    test.AddZone(depot);
+    test.AddZone(depot);
+    depot.groups = 0x02;
+    auto yard = test.AddZone(depot);
+
+    // Same events in the same order as a per-event subscriber, one call per
+    // loop()
+    Vector<CallbackContext> single;
+    test.Subscribe([&](CallbackContext& context) {
+        single.append(context);
+    }, GEOFENCE_EVENT_MASK_ALL | GEOFENCE_EVENT_DISTANCE);
+    int calls = 0;
+    Vector<CallbackContext> batched;
+    REQUIRE(test.SubscribeBatch([&](const CallbackContext* events, int count) {
+        calls++;
+        REQUIRE(count > 0);
+        for(int i = 0; i < count; i++) {
+            batched.append(events[i]);
+        }
+        REQUIRE(test.SubscribeBatch([](const CallbackContext* events, int count) {}) ==
+            SYSTEM_ERROR_INVALID_STATE);
+    }, GEOFENCE_EVENT_MASK_ALL | GEOFENCE_EVENT_DISTANCE) > 0);
+    int yard_calls = 0, yard_events = 0;
+    int yard_id = test.SubscribeBatch([&](const CallbackContext* events, int count) {
+        yard_calls++;
+        for(int i = 0; i < count; i++) {
+            REQUIRE(events[i].handle == yard);
+            REQUIRE(events[i].event_type == GeofenceEventType::ENTER);
+            yard_events++;
+        }
+    }, GeofenceEventBit(GeofenceEventType::ENTER), 0x02);
+    REQUIRE(yard_id > 0);
+
+    PointData path[] = {TestPoints[0], TestPoints[6], TestPoints[6], TestPoints[0]};
+    for(auto& point : path) {
+        test.UpdateGeofencePoint(point);
+        test.loop();
+    }
+    REQUIRE(calls == 4);
+    REQUIRE(single.size() == 3 + 6 + 3 + 6);
+    REQUIRE(batched.size() == single.size());
+    for(int i = 0; i < single.size(); i++) {
+        REQUIRE(batched.at(i).handle == single.at(i).handle);
+        REQUIRE(batched.at(i).event_type == single.at(i).event_type);
+        REQUIRE(batched.at(i).time == single.at(i).time);
+        REQUIRE(batched.at(i).distance == single.at(i).distance);
+    }
+    REQUIRE(batched.at(0).distance > 0.0);
+    REQUIRE(batched.at(3).distance < 0.0);
+    REQUIRE(yard_calls == 1);
+    REQUIRE(yard_events == 1);
+
+    // A loop() without selected events doesn't call, collected events are
+    // dropped once unsubscribed
+    REQUIRE(test.Unsubscribe(yard_id) == SYSTEM_ERROR_NONE);
+    test.UpdateGeofencePoint(TestPoints[6]);
+    test.loop();
+    REQUIRE(yard_calls == 1);
+    int unsubscribe_id = 0, unsubscribe_calls = 0;
+    unsubscribe_id = test.SubscribeBatch([&](const CallbackContext* events, int count) {
+        unsubscribe_calls++;
+        REQUIRE(test.Unsubscribe(unsubscribe_id) == SYSTEM_ERROR_NONE);
+    });
+    test.loop();
+    test.loop();
+    REQUIRE(unsubscribe_calls == 1);
+
+    // Time-sliced passes deliver the events of each slice
+    calls = 0;
+    batched.clear();
+    test.SetEvaluationBudget(2, 0);
+    test.UpdateGeofencePoint(TestPoints[0]);
+    test.loop();
+    REQUIRE(calls == 1);
+    REQUIRE(batched.size() == 4);
+    test.loop();
+    REQUIRE(calls == 2);
+    REQUIRE(batched.size() == 6);
+}
+
+TEST_CASE("Async Delivery Test") {
+    Geofence test(0);
+    test.init();
+
+    ZoneInfo depot;
+    depot.enable = true;
+    depot.radius = 2700.0;
+    depot.center_lat = 37.76887;
+    depot.center_lon = -122.48248;
+    depot.inside_event = true;
+    depot.outside_event = true;
+    for(int i = 0; i < 3; i++) {
+        test.AddZone(depot);
+    }
+    Vector<CallbackContext> events;
+    test.Subscribe([&](CallbackContext& context) {
+        events.append(context);
+    });
+
+    REQUIRE(test.SetAsyncDelivery(-1) == SYSTEM_ERROR_INVALID_ARGUMENT);
+    REQUIRE(test.SetAsyncDelivery(4, GeofenceEventOrder::GLOBAL, 2) ==
+        SYSTEM_ERROR_INVALID_ARGUMENT);
+    REQUIRE(test.SetAsyncDelivery(4, GeofenceEventOrder::PER_ZONE, 0) ==
+        SYSTEM_ERROR_INVALID_ARGUMENT);
+    REQUIRE(test.ProcessAsyncEvents() == SYSTEM_ERROR_INVALID_ARGUMENT);
+
+    // Queued by loop(), delivered by the worker, dropped once the queue is full
+    REQUIRE(test.SetAsyncDelivery(3) == SYSTEM_ERROR_NONE);
+    test.UpdateGeofencePoint(TestPoints[6]); //inside all zones
+    test.loop();
+    REQUIRE(events.size() == 0);
+    REQUIRE(test.GetAsyncStats().queued == 3);
+    test.loop();
+    auto stats = test.GetAsyncStats();
+    REQUIRE(stats.queued == 4);
+    REQUIRE(stats.dropped == 2);
+    REQUIRE(stats.max_pending == 4);
+    REQUIRE(test.ProcessAsyncEvents(1) == SYSTEM_ERROR_INVALID_ARGUMENT);
+    REQUIRE(test.ProcessAsyncEvents(0, 1) == 1);
+    REQUIRE(test.ProcessAsyncEvents() == 3);
+    REQUIRE(test.ProcessAsyncEvents() == 0);
+    REQUIRE(events.size() == 4);
+    REQUIRE(events.at(0).event_type == GeofenceEventType::INSIDE);
+    REQUIRE(events.at(2).index == 2);
+    REQUIRE(events.at(3).index == 0);
+    REQUIRE(test.GetAsyncStats().delivered == 4);
+
+    // Back to calling from loop()
+    REQUIRE(test.SetAsyncDelivery(0) == SYSTEM_ERROR_NONE);
+    test.loop();
+    REQUIRE(events.size() == 7);
+    REQUIRE(test.GetAsyncStats().queued == 0);
+}
+
+TEST_CASE("Async Delivery Threads Test") {
+    const int zones = 16;
+    const int loops = 3000;
+    for(auto order : {GeofenceEventOrder::GLOBAL, GeofenceEventOrder::PER_ZONE}) {
+        int workers = (order == GeofenceEventOrder::GLOBAL) ? 1 : 4;
+        Geofence test(0);
+        test.init();
+        for(int i = 0; i < zones; i++) {
+            ZoneInfo zone;
+            zone.enable = true;
+            zone.radius = 100.0 + 200.0 * i;
+            zone.center_lat = 37.76887;
+            zone.center_lon = -122.48248;
+            zone.inside_event = true;
+            zone.outside_event = true;
+            test.AddZone(zone);
+        }
+
+        // Each zone is only delivered by one worker, so its last time isn't
+        // shared
+        struct {
+            std::vector<time_t> last_time;
+            time_t last_global_time{-1};
+            int last_global_zone{-1};
+            std::atomic<int> delivered{0};
+            std::atomic<int> out_of_order{0};
+        } seen;
+        seen.last_time.assign(zones, -1);
+        bool global = (order == GeofenceEventOrder::GLOBAL);
+        test.Subscribe([&seen, global](CallbackContext& context) {
+            if(context.time <= seen.last_time[context.index]) {
+                seen.out_of_order++;
+            }
+            seen.last_time[context.index] = context.time;
+            if(global) {
+                if(context.time < seen.last_global_time ||
+                        (context.time == seen.last_global_time &&
+                            context.index <= seen.last_global_zone)) {
+                    seen.out_of_order++;
+                }
+                seen.last_global_time = context.time;
+                seen.last_global_zone = context.index;
+            }
+            seen.delivered++;
+        });
+        REQUIRE(test.SetAsyncDelivery(64, order, workers) == SYSTEM_ERROR_NONE);
+
+        std::atomic<bool> stop(false);
+        std::vector<std::thread> threads;
+        for(int worker = 0; worker < workers; worker++) {
+            threads.emplace_back([&, worker]() {
+                while(!stop) {
+                    if(!test.ProcessAsyncEvents(worker)) {
+                        std::this_thread::yield();
+                    }
+                }
+                test.ProcessAsyncEvents(worker);
+            });
+        }
+        for(int n = 0; n < loops; n++) {
+            double offset = (n % 40) * 0.0001;
+            test.UpdateGeofencePoint({ 37.76887 + offset, -122.48248, 0.0, 0.0, n });
+            test.loop();
+        }
+        stop = true;
+        for(auto& thread : threads) {
+            thread.join();
+        }
+
+        auto stats = test.GetAsyncStats();
+        REQUIRE(seen.out_of_order == 0);
+        REQUIRE(stats.queued + stats.dropped == zones * loops);
+        REQUIRE(stats.delivered == stats.queued);
+        REQUIRE(seen.delivered == (int)stats.queued);
+        REQUIRE(stats.max_pending <= 64);
+    }
+}
+
+TEST_CASE("Latency Histogram Test") {
+    // Every value lands in a bucket whose bounds are within 12.5%
+    for(uint32_t value : {0u, 1u, 7u, 8u, 15u, 16u, 17u, 100u, 999u, 1000u,
+            65535u, 65536u, 1234567u, 0x7FFFFFFFu, 0x80000000u, 0xFFFFFFFFu}) {
+        int bucket = GeofenceLatencyHistogram::BucketOf(value);
+        REQUIRE(bucket < GeofenceLatencyHistogram::BUCKETS);
+        REQUIRE(value <= GeofenceLatencyHistogram::BucketUpperBound(bucket));
+        REQUIRE(GeofenceLatencyHistogram::BucketUpperBound(bucket) <= value + (uint64_t)value / 8);
+        if(bucket) {
+            REQUIRE(value > GeofenceLatencyHistogram::BucketUpperBound(bucket - 1));
+        }
+    }
+    REQUIRE(GeofenceLatencyHistogram::BucketOf(0xFFFFFFFF) ==
+        GeofenceLatencyHistogram::BUCKETS - 1);
+
+    GeofenceLatencyHistogram histogram;
+    REQUIRE(histogram.GetPercentile(50.0) == 0);
+    for(uint32_t us = 1; us <= 1000; us++) {
+        histogram.Record(us);
+    }
+    REQUIRE(histogram.GetTotalCount() == 1000);
+    REQUIRE(histogram.GetMax() == 1000);
+    REQUIRE(histogram.GetPercentile(50.0) >= 500);
+    REQUIRE(histogram.GetPercentile(50.0) <= 500 + 500 / 8);
+    REQUIRE(histogram.GetPercentile(99.0) >= 990);
+    REQUIRE(histogram.GetPercentile(100.0) == 1000);
+    REQUIRE(histogram.GetPercentile(0.0) == 1);
+    histogram.Reset();
+    REQUIRE(histogram.GetTotalCount() == 0);
+
+    Geofence test(0);
+    test.init();
+    ZoneInfo zone;
+    zone.enable = true;
+    zone.radius = 2700.0;
+    zone.center_lat = 37.76887;
+    zone.center_lon = -122.48248;
+    zone.inside_event = true;
+    zone.enter_event = true;
+    zone.exit_event = true;
+    auto handle = test.AddZone(zone);
+    test.Subscribe([](CallbackContext& context) {});
+    auto& latency = test.GetLatencyHistogram();
+
+    // From the fix arriving to the callbacks, repeated passes aren't measured
+    test.UpdateGeofencePoint(TestPoints[6]); //inside the zone
+    System.incMicros(250);
+    test.loop();
+    REQUIRE(latency.GetTotalCount() == 1);
+    REQUIRE(latency.GetMax() == 250);
+    System.incMicros(5000);
+    test.loop();
+    REQUIRE(latency.GetTotalCount() == 1);
+
+    // Batched and asynchronous callbacks are measured when they are called
+    test.ResetEvaluationStats();
+    REQUIRE(latency.GetTotalCount() == 0);
+    int batch_id = test.SubscribeBatch([](const CallbackContext* events, int count) {
+        System.incMicros(1000);
+    });
+    test.UpdateGeofencePoint(TestPoints[6]);
+    System.incMicros(100);
+    test.loop();
+    REQUIRE(latency.GetTotalCount() == 2);
+    REQUIRE(latency.GetMax() == 100);
+    REQUIRE(test.Unsubscribe(batch_id) == SYSTEM_ERROR_NONE);
+#if GEOFENCE_ENABLE_ASYNC
+    test.ResetEvaluationStats();
+    REQUIRE(test.SetAsyncDelivery(8) == SYSTEM_ERROR_NONE);
+    test.UpdateGeofencePoint(TestPoints[6]);
+    test.loop();
+    System.incMicros(300);
+    REQUIRE(test.ProcessAsyncEvents() == 1);
+    REQUIRE(latency.GetTotalCount() == 1);
+    REQUIRE(latency.GetMax() == 300);
+    REQUIRE(test.SetAsyncDelivery(0) == SYSTEM_ERROR_NONE);
+#endif
+
+    // The verification time isn't counted: the EXIT is due 5 s after the
+    // fix and reported 2 s later, by a repeated pass over the same fix
+    zone.inside_event = false;
+    zone.verification_time_sec = 5;
+    REQUIRE(test.SetZoneInfo(handle, zone) == SYSTEM_ERROR_NONE);
+    test.UpdateGeofencePoint(TestPoints[6]); //inside again, after the reset
+    test.loop();
+    System.inc(5000);
+    test.loop();
+    test.ResetEvaluationStats();
+    test.UpdateGeofencePoint(TestPoints[0]); //outside the zone
+    test.loop();
+    System.inc(7000);
+    test.loop();
+    REQUIRE(latency.GetTotalCount() == 1);
+    REQUIRE(latency.GetMax() == 2000000);
+
+    // Same when the deadline confirms it without evaluating the zones
+    test.SetEventDrivenEvaluation(true);
+    test.ResetEvaluationStats();
+    test.UpdateGeofencePoint(TestPoints[6]); //inside the zone
+    test.loop();
+    System.inc(5003);
+    test.loop();
+    REQUIRE(latency.GetTotalCount() == 1);
+    REQUIRE(latency.GetMax() == 3000);
+}
+
+TEST_CASE("Point Seqlock Test") {
+    // Every field of a copy comes from the same publication
+    GeofencePointSeqlock latest;
+    std::atomic<bool> stop(false);
+    std::thread writer([&]() {
+        for(int n = 1; !stop; n++) {
+            latest.Publish({ n * 1e-6, -n * 1e-6, (double)n, n * 0.5, n }, n);
+        }
+    });
+    int copies = 0, torn = 0;
+    uint32_t last_sequence = 0;
+    while(copies < 200000) {
+        PointData point;
+        uint32_t arrival_us, sequence;
+        if(!latest.Read(point, arrival_us, sequence, 4)) {
+            continue;
+        }
+        copies++;
+        time_t n = point.gps_time;
+        torn += (point.lat != n * 1e-6) || (point.lon != -n * 1e-6) ||
+            (point.horizontal_accuracy != (double)n) || (point.hdop != n * 0.5) ||
+                (arrival_us != (uint32_t)n) || (sequence != (uint32_t)n * 2) ||
+                    (sequence < last_sequence);
+        last_sequence = sequence;
+    }
+    stop = true;
+    writer.join();
+    REQUIRE(torn == 0);
+    REQUIRE(last_sequence > 0);
+
+    // A GNSS thread updating the point while loop() evaluates it: the
+    // distance of each event matches the fix of its time, never a mix of
+    // two fixes
+    Geofence test(0);
+    test.init();
+    ZoneInfo zone;
+    zone.enable = true;
+    zone.radius = 1000.0;
+    zone.center_lat = 37.5;
+    zone.center_lon = -121.5;
+    zone.outside_event = true;
+    test.AddZone(zone);
+    const PointData fixes[] = {
+        { 37.0, -122.0, 0.0, 0.0, 0 },
+        { 37.9, -121.2, 0.0, 0.0, 1 },
+    };
+    // A mix of the two is about 10 km from both
+    double distance[2];
+    for(int i = 0; i < 2; i++) {
+        GeofenceZoneDistance nearest;
+        REQUIRE(test.FindNearestZone(fixes[i].lat, fixes[i].lon, nearest) ==
+            SYSTEM_ERROR_NONE);
+        distance[i] = nearest.distance;
+    }
+    REQUIRE(fabs(distance[0] - distance[1]) > 10000.0);
+
+    struct {
+        const double* distance;
+        std::atomic<int> events{0};
+        std::atomic<int> mismatches{0};
+    } seen;
+    seen.distance = distance;
+    test.Subscribe([&seen](CallbackContext& context) {
+        seen.events++;
+        seen.mismatches += fabs(context.distance -
+            seen.distance[context.time & 1]) > 100.0;
+    }, GEOFENCE_EVENT_MASK_ALL | GEOFENCE_EVENT_DISTANCE);
+
+    // loop() keeps the previous point while the writer keeps interfering,
+    // so start from a fix
+    test.UpdateGeofencePoint(fixes[0]);
+    test.loop();
+    stop = false;
+    std::thread gnss([&]() {
+        for(int n = 0; !stop; n++) {
+            PointData fix = fixes[n & 1];
+            fix.gps_time = n;
+            test.UpdateGeofencePoint(fix);
+        }
+    });
+    for(int n = 0; n < 100000; n++) {
+        test.loop();
+    }
+    stop = true;
+    gnss.join();
+    REQUIRE(seen.events == 100000 + 1);
+    REQUIRE(seen.mismatches == 0);
+}
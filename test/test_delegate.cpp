@@ -0,0 +1,92 @@
+#include "catch.hpp"
+
+#include <functional>
+
+#include "GeofenceDelegate.h"
+
+static int Twice(int value) {
+    return value * 2;
+}
+
+static int AddContext(void* context, int value) {
+    return value + *static_cast<int*>(context);
+}
+
+struct CountedCallable {
+    static int live;
+    int offset;
+
+    CountedCallable(int offset) : offset(offset) {
+        live++;
+    }
+    CountedCallable(const CountedCallable& other) : offset(other.offset) {
+        live++;
+    }
+    ~CountedCallable() {
+        live--;
+    }
+    int operator()(int value) const {
+        return value + offset;
+    }
+};
+
+int CountedCallable::live = 0;
+
+TEST_CASE("Delegate Call Test") {
+    GeofenceDelegate<int(int)> empty;
+    REQUIRE(!empty);
+
+    GeofenceDelegate<int(int)> function(Twice);
+    REQUIRE(function);
+    REQUIRE(function(21) == 42);
+
+    int offset = 10;
+    GeofenceDelegate<int(int)> lambda([&offset](int value) { return value + offset; });
+    REQUIRE(lambda(1) == 11);
+    offset = 20;
+    REQUIRE(lambda(1) == 21);
+
+    GeofenceDelegate<int(int)> bound(AddContext, &offset);
+    REQUIRE(bound(2) == 22);
+
+    std::function<int(int)> wrapped = Twice;
+    GeofenceDelegate<int(int)> from_function(wrapped);
+    REQUIRE(from_function(4) == 8);
+
+    // Empty targets give empty delegates
+    int (*null_function)(int) = nullptr;
+    REQUIRE(!GeofenceDelegate<int(int)>(null_function));
+    REQUIRE(!GeofenceDelegate<int(int)>(std::function<int(int)>()));
+    REQUIRE(!GeofenceDelegate<int(int)>(nullptr));
+}
+
+TEST_CASE("Delegate Lifetime Test") {
+    {
+        GeofenceDelegate<int(int)> a(CountedCallable(5));
+        REQUIRE(CountedCallable::live == 1);
+
+        GeofenceDelegate<int(int)> b(a);
+        REQUIRE(CountedCallable::live == 2);
+        REQUIRE(b(1) == 6);
+
+        GeofenceDelegate<int(int)> c(std::move(a));
+        REQUIRE(CountedCallable::live == 2);
+        REQUIRE(!a);
+        REQUIRE(c(2) == 7);
+
+        b = Twice;
+        REQUIRE(CountedCallable::live == 1);
+        REQUIRE(b(2) == 4);
+
+        a = c;
+        REQUIRE(CountedCallable::live == 2);
+        a = a;
+        REQUIRE(CountedCallable::live == 2);
+        REQUIRE(a(3) == 8);
+
+        c = nullptr;
+        REQUIRE(CountedCallable::live == 1);
+        REQUIRE(!c);
+    }
+    REQUIRE(CountedCallable::live == 0);
+}
@@ -0,0 +1,44 @@
+#include "catch.hpp"
+
+#include "GeofenceDistance.h"
+
+using namespace GeofenceDistanceModels;
+
+static double Dms(double degrees, double minutes, double seconds) {
+    double value = fabs(degrees) + minutes / 60.0 + seconds / 3600.0;
+    return (degrees < 0.0) ? -value : value;
+}
+
+TEST_CASE("Vincenty Distance Test") {
+    // Flinders Peak to Buninyong, Vincenty (1975)
+    double d = Vincenty::Distance(Dms(-37, 57, 3.72030), Dms(144, 25, 29.52440),
+        Dms(-37, 39, 10.15610), Dms(143, 55, 35.38390));
+    REQUIRE(d == Approx(54972.271).margin(0.001));
+
+    // A quarter meridian is 10001965.729 m on WGS84
+    REQUIRE(Vincenty::Distance(0.0, 0.0, 90.0, 0.0) == Approx(10001965.729).margin(0.001));
+    REQUIRE(Vincenty::Distance(45.0, 10.0, 45.0, 10.0) == 0.0);
+}
+
+TEST_CASE("Spherical Distance Models Test") {
+    // One degree of longitude on the equator across the date line
+    const double degree = GEOFENCE_EARTH_RADIUS_M * M_PI / 180.0;
+    REQUIRE(Haversine::Distance(0.0, 179.5, 0.0, -179.5) == Approx(degree));
+    REQUIRE(Chord::Distance(0.0, 179.5, 0.0, -179.5) == Approx(degree));
+    REQUIRE(Equirectangular::Distance(0.0, 179.5, 0.0, -179.5) == Approx(degree));
+    REQUIRE(Chord::Distance(-90.0, 0.0, 90.0, 0.0) == Approx(degree * 180.0));
+
+    // Urban distances, the cheap models follow haversine closely
+    for(double lat : {0.0, 30.0, 60.0, -75.0}) {
+        for(double offset : {0.0001, 0.001, 0.01, 0.1}) {
+            double haversine = Haversine::Distance(lat, 10.0, lat + offset, 10.0 + offset);
+            REQUIRE(Chord::Distance(lat, 10.0, lat + offset, 10.0 + offset) ==
+                Approx(haversine).epsilon(1e-6));
+            REQUIRE(Equirectangular::Distance(lat, 10.0, lat + offset, 10.0 + offset) ==
+                Approx(haversine).epsilon(1e-4));
+            // The sphere is within 0.6% of the ellipsoid
+            REQUIRE(Vincenty::Distance(lat, 10.0, lat + offset, 10.0 + offset) ==
+                Approx(haversine).epsilon(0.006));
+        }
+    }
+}
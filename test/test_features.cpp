@@ -0,0 +1,81 @@
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include "Geofence.h"
+
+// Built with the smallest feature configuration, see CMakeLists.txt
+
+static ZoneInfo Circle() {
+    ZoneInfo zone;
+    zone.enable = true;
+    zone.inside_event = true;
+    zone.outside_event = true;
+    zone.enter_event = true;
+    zone.exit_event = true;
+    zone.verification_time_sec = 5;
+    zone.center_lat = 40.0;
+    zone.center_lon = -105.0;
+    zone.radius = 100.0;
+    return zone;
+}
+
+TEST_CASE("Minimal Configuration Test") {
+    Geofence test(0);
+    test.init();
+    auto handle = test.AddZone(Circle());
+    REQUIRE(test.IsValidZone(handle));
+    int events[8] = {};
+    test.Subscribe([&events](CallbackContext& context) {
+        events[(int)context.event_type]++;
+    });
+
+    // Enter and exit on the first fix, without verification time and
+    // without INSIDE and OUTSIDE events
+    test.UpdateGeofencePoint({ 40.01, -105.0, 0.0, 0.0, 0 });
+    test.loop();
+    test.UpdateGeofencePoint({ 40.0, -105.0, 0.0, 0.0, 0 });
+    test.loop();
+    REQUIRE(events[(int)GeofenceEventType::ENTER] == 1);
+    test.UpdateGeofencePoint({ 40.01, -105.0, 0.0, 0.0, 0 });
+    test.loop();
+    REQUIRE(events[(int)GeofenceEventType::EXIT] == 1);
+    REQUIRE(events[(int)GeofenceEventType::INSIDE] == 0);
+    REQUIRE(events[(int)GeofenceEventType::OUTSIDE] == 0);
+    test.UpdateGeofencePoint({ 40.01, -105.0, 0.0, 100.0, 0 });
+    test.loop();
+    REQUIRE(events[(int)GeofenceEventType::POOR_LOCATION] == 0);
+
+    uint64_t deadline;
+    REQUIRE_FALSE(test.GetNextDeadline(deadline));
+    REQUIRE(test.GetEvaluationStats().slices == 0);
+    REQUIRE(test.GetVertexArenaSize() == 0);
+
+    // Shapes that are left out are rejected
+    ZoneInfo square = Circle();
+    square.shape_type = GeofenceShapeType::POLYGONAL;
+    square.polygon_points.append({40.0, -105.0, true});
+    square.polygon_points.append({40.0, -104.99, true});
+    square.polygon_points.append({40.01, -104.99, true});
+    REQUIRE_FALSE(test.IsValidZone(test.AddZone(square)));
+    square.shape_type = GeofenceShapeType::CORRIDOR;
+    REQUIRE_FALSE(test.IsValidZone(test.AddZone(square)));
+    square.shape_type = GeofenceShapeType::RECTANGLE;
+    REQUIRE_FALSE(test.IsValidZone(test.AddZone(square)));
+    REQUIRE(test.SetZoneInfo(handle, square) == SYSTEM_ERROR_NOT_SUPPORTED);
+    REQUIRE(test.GetZoneCount() == 1);
+
+    // Zone states still survive a snapshot
+    uint8_t snapshot[64];
+    int size = test.SaveZoneStates(snapshot, sizeof(snapshot), 1);
+    REQUIRE(size > 0);
+    Geofence after(0);
+    after.AddZone(Circle());
+    REQUIRE(after.RestoreZoneStates(snapshot, size) == 1);
+    int enter = 0;
+    after.Subscribe([&enter](CallbackContext& context) {
+        enter++;
+    });
+    after.UpdateGeofencePoint({ 40.0, -105.0, 0.0, 0.0, 0 });
+    after.loop();
+    REQUIRE(enter == 1);
+}
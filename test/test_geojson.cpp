@@ -0,0 +1,255 @@
+#include "catch.hpp"
+
+#include <string.h>
+
+#include "GeofenceGeoJson.h"
+
+static const char FeatureCollection[] = R"({
+  "type": "FeatureCollection",
+  "features": [
+    {
+      "type": "Feature",
+      "properties": { "name": "Golden Gate Park", "inside_event": true, "tags": [1, {"a": null}],
+                      "simplify_tolerance": 2.5 },
+      "geometry": {
+        "type": "Polygon",
+        "coordinates": [
+          [ [-122.511040, 37.771531], [-122.510452, 37.764150], [-122.453018, 37.766465],
+            [-122.454279, 37.774911], [-122.511040, 37.771531] ],
+          [ [-122.49, 37.768], [-122.48, 37.768], [-122.48, 37.769], [-122.49, 37.768] ]
+        ]
+      }
+    },
+    {
+      "type": "Feature",
+      "geometry": {
+        "coordinates": [ -122.48248, 37.76887, 12.5 ],
+        "type": "Point"
+      },
+      "properties": { "radius": 2700, "enter_event": true, "exit_event": true,
+                      "verification_time_sec": 30, "name": "esc\"aped \\ radius" }
+    },
+    {
+      "type": "Feature",
+      "properties": null,
+      "geometry": { "type": "MultiPolygon", "coordinates": [
+        [ [ [175.459385, 7.870459], [175.459385, 4.504215], [-176.611013, 4.790698],
+            [-176.248620, 10.058798], [175.459385, 7.870459] ] ],
+        [ [ [-60.130649, -2.992267], [-60.124700, -3.152658], [-59.919461, -3.155628],
+            [-59.901614, -3.027912] ] ]
+      ] }
+    },
+    { "type": "Feature", "properties": {}, "geometry": { "type": "LineString",
+      "coordinates": [ [0.0, 0.0], [1.0, 1.0] ] } },
+    { "type": "Feature", "properties": {}, "geometry": { "type": "Point",
+      "coordinates": [ 0.0, 0.0 ] } },
+    { "type": "Feature", "properties": { "radius": 1e3 }, "geometry": null }
+  ]
+})";
+
+struct ImportedZone {
+    ZoneInfo zone;
+    int feature;
+};
+
+static int ImportAll(GeofenceGeoJsonReader& reader, const char* json,
+                size_t chunk, Vector<ImportedZone>& zones) {
+    reader.Begin([&zones](const ZoneInfo& zone, int feature_index) {
+        zones.append({zone, feature_index});
+        return SYSTEM_ERROR_NONE;
+    });
+    size_t length = strlen(json);
+    for(size_t i = 0; i < length; i += chunk) {
+        int ret = reader.Parse(json + i, std::min(chunk, length - i));
+        if(ret) {
+            return ret;
+        }
+    }
+    return reader.End();
+}
+
+TEST_CASE("GeoJSON FeatureCollection Import Test") {
+    GeofenceGeoJsonReader reader;
+    Vector<ImportedZone> zones;
+
+    REQUIRE(ImportAll(reader, FeatureCollection, 4096, zones) == SYSTEM_ERROR_NONE);
+    REQUIRE(reader.ZoneCount() == 4);
+    REQUIRE(zones.size() == 4);
+    REQUIRE(reader.SkippedFeatureCount() == 2); // LineString and Point without radius
+
+    // Polygon, closing vertex and hole dropped
+    auto& park = zones.at(0);
+    REQUIRE(park.feature == 0);
+    REQUIRE(park.zone.shape_type == GeofenceShapeType::POLYGONAL);
+    REQUIRE(park.zone.enable == true);
+    REQUIRE(park.zone.inside_event == true);
+    REQUIRE(park.zone.enter_event == false);
+    REQUIRE(park.zone.polygon_points.size() == 4);
+    REQUIRE(park.zone.polygon_points.at(0).lat == 37.771531);
+    REQUIRE(park.zone.polygon_points.at(0).lon == -122.511040);
+    REQUIRE(park.zone.polygon_points.at(3).lat == 37.774911);
+    REQUIRE(park.zone.polygon_points.at(3).enable == true);
+    REQUIRE(park.zone.simplify_tolerance == 2.5);
+
+    // Point with radius, properties after geometry and type after coordinates
+    auto& circle = zones.at(1);
+    REQUIRE(circle.feature == 1);
+    REQUIRE(circle.zone.shape_type == GeofenceShapeType::CIRCULAR);
+    REQUIRE(circle.zone.center_lat == 37.76887);
+    REQUIRE(circle.zone.center_lon == -122.48248);
+    REQUIRE(circle.zone.radius == 2700.0);
+    REQUIRE(circle.zone.enter_event == true);
+    REQUIRE(circle.zone.exit_event == true);
+    REQUIRE(circle.zone.inside_event == false);
+    REQUIRE(circle.zone.verification_time_sec == 30);
+    REQUIRE(circle.zone.simplify_tolerance == 0.0);
+
+    // MultiPolygon becomes one zone per polygon
+    REQUIRE(zones.at(2).feature == 2);
+    REQUIRE(zones.at(2).zone.polygon_points.size() == 4);
+    REQUIRE(zones.at(2).zone.polygon_points.at(2).lon == -176.611013);
+    REQUIRE(zones.at(3).feature == 2);
+    REQUIRE(zones.at(3).zone.polygon_points.size() == 4);
+    REQUIRE(zones.at(3).zone.polygon_points.at(0).lat == -2.992267);
+
+    // The vertices of every zone are passed in the buffer reserved up front
+    Vector<const PolygonPoint*> buffers;
+    reader.Begin([&buffers](const ZoneInfo& zone, int feature_index) {
+        REQUIRE(zone.polygon_points.capacity() >= GEOFENCE_GEOJSON_MAX_VERTICES);
+        buffers.append(zone.polygon_points.data());
+        return SYSTEM_ERROR_NONE;
+    });
+    REQUIRE(reader.Parse(FeatureCollection, strlen(FeatureCollection)) == SYSTEM_ERROR_NONE);
+    REQUIRE(reader.End() == SYSTEM_ERROR_NONE);
+    REQUIRE(buffers.size() == 4);
+    REQUIRE(buffers.at(0) != nullptr);
+    for(auto buffer : buffers) {
+        REQUIRE(buffer == buffers.at(0));
+    }
+}
+
+TEST_CASE("GeoJSON Chunked Import Test") {
+    GeofenceGeoJsonReader reader;
+    Vector<ImportedZone> whole;
+    REQUIRE(ImportAll(reader, FeatureCollection, 1 << 16, whole) == SYSTEM_ERROR_NONE);
+
+    for(size_t chunk : {1, 2, 3, 7, 64}) {
+        Vector<ImportedZone> zones;
+        REQUIRE(ImportAll(reader, FeatureCollection, chunk, zones) == SYSTEM_ERROR_NONE);
+        REQUIRE(zones.size() == whole.size());
+        for(int i = 0; i < zones.size(); i++) {
+            REQUIRE(zones.at(i).zone.shape_type == whole.at(i).zone.shape_type);
+            REQUIRE(zones.at(i).zone.polygon_points.size() == whole.at(i).zone.polygon_points.size());
+            REQUIRE(zones.at(i).zone.center_lat == whole.at(i).zone.center_lat);
+        }
+    }
+}
+
+TEST_CASE("GeoJSON Defaults and Limits Test") {
+    GeofenceGeoJsonReader reader(4);
+    ZoneInfo defaults;
+    defaults.enable = true;
+    defaults.outside_event = true;
+    defaults.radius = 100.0;
+    reader.SetZoneDefaults(defaults);
+
+    Vector<ImportedZone> zones;
+    const char* json = R"({"type":"FeatureCollection","features":[
+        {"type":"Feature","geometry":{"type":"Point","coordinates":[1.5,2.5]}},
+        {"type":"Feature","geometry":{"type":"Polygon","coordinates":[[[0,0],[1,0],[1,1],[0,1],[0.5,0.5],[0,0]]]}},
+        {"type":"Feature","properties":{"enable":false,"outside_event":false},
+         "geometry":{"type":"Polygon","coordinates":[[[0,0],[1,0],[1,1],[0,0]]]}}
+    ]})";
+    REQUIRE(ImportAll(reader, json, 5, zones) == SYSTEM_ERROR_NONE);
+    REQUIRE(reader.SkippedFeatureCount() == 1); // Too many vertices
+    REQUIRE(zones.size() == 2);
+    REQUIRE(zones.at(0).zone.radius == 100.0);
+    REQUIRE(zones.at(0).zone.outside_event == true);
+    REQUIRE(zones.at(1).feature == 2);
+    REQUIRE(zones.at(1).zone.polygon_points.size() == 3);
+    REQUIRE(zones.at(1).zone.enable == false);
+    REQUIRE(zones.at(1).zone.outside_event == false);
+}
+
+TEST_CASE("GeoJSON LineString Corridor Import Test") {
+    GeofenceGeoJsonReader reader;
+    Vector<ImportedZone> zones;
+    const char* json = R"({"type":"FeatureCollection","features":[
+        {"type":"Feature","properties":{"radius":200},
+         "geometry":{"type":"LineString","coordinates":[[7.0,45.0],[7.1,45.0,310.5],[7.2,45.1]]}},
+        {"type":"Feature","properties":{"radius":200},
+         "geometry":{"type":"LineString","coordinates":[[7.0,45.0]]}}
+    ]})";
+    REQUIRE(ImportAll(reader, json, 7, zones) == SYSTEM_ERROR_NONE);
+    REQUIRE(reader.SkippedFeatureCount() == 1); // Single position
+    REQUIRE(zones.size() == 1);
+    REQUIRE(zones.at(0).zone.shape_type == GeofenceShapeType::CORRIDOR);
+    REQUIRE(zones.at(0).zone.radius == 200.0);
+    REQUIRE(zones.at(0).zone.polygon_points.size() == 3);
+    REQUIRE(zones.at(0).zone.polygon_points.at(1).lon == 7.1);
+    REQUIRE(zones.at(0).zone.polygon_points.at(2).lat == 45.1);
+}
+
+TEST_CASE("GeoJSON Malformed Document Test") {
+    GeofenceGeoJsonReader reader;
+    Vector<ImportedZone> zones;
+
+    REQUIRE(ImportAll(reader, R"({"type": "Feature", "geometry": {)", 8, zones) == SYSTEM_ERROR_NOT_ENOUGH_DATA);
+    REQUIRE(ImportAll(reader, R"({"type" "Feature"})", 8, zones) == SYSTEM_ERROR_BAD_DATA);
+    REQUIRE(reader.ErrorOffset() == 8);
+    REQUIRE(ImportAll(reader, R"({"a": [1, 2,]})", 3, zones) == SYSTEM_ERROR_BAD_DATA);
+    REQUIRE(ImportAll(reader, R"({"a": tru})", 3, zones) == SYSTEM_ERROR_BAD_DATA);
+    REQUIRE(ImportAll(reader, R"({"a": 1} {})", 3, zones) == SYSTEM_ERROR_BAD_DATA);
+    REQUIRE(ImportAll(reader, R"([[[[[[[[[[[[[[[[[[[[]]]]]]]]]]]]]]]]]]])", 3, zones) == SYSTEM_ERROR_LIMIT_EXCEEDED);
+    REQUIRE(zones.isEmpty());
+
+    // Callback errors abort the import
+    reader.Begin([](const ZoneInfo& zone, int feature_index) {
+        return SYSTEM_ERROR_NO_MEMORY;
+    });
+    REQUIRE(reader.Parse(FeatureCollection, strlen(FeatureCollection)) == SYSTEM_ERROR_NO_MEMORY);
+    REQUIRE(reader.End() == SYSTEM_ERROR_NO_MEMORY);
+}
+
+TEST_CASE("GeoJSON Imported Zone Evaluation Test") {
+    GeofenceGeoJsonReader reader;
+    ZoneInfo defaults;
+    defaults.enable = true;
+    defaults.inside_event = true;
+    reader.SetZoneDefaults(defaults);
+
+    Geofence test(4);
+    test.init();
+    int index = 0;
+    reader.Begin([&](const ZoneInfo& zone, int feature_index) {
+        test.GetZoneInfo(index++) = zone;
+        return SYSTEM_ERROR_NONE;
+    });
+    REQUIRE(reader.Parse(FeatureCollection, strlen(FeatureCollection)) == SYSTEM_ERROR_NONE);
+    REQUIRE(reader.End() == SYSTEM_ERROR_NONE);
+    REQUIRE(index == 4);
+
+    Vector<int> inside;
+    test.RegisterGeofenceCallback([&inside](CallbackContext& context) {
+        if(context.event_type == GeofenceEventType::INSIDE) {
+            inside.append(context.index);
+        }
+    });
+
+    test.UpdateGeofencePoint({ 37.76705, -122.48593, 0.0, 0.0, 0 }); // Elk Glen Picnic Area
+    test.loop();
+    REQUIRE(inside.size() == 1); // The circle has a 30 second verification time
+    REQUIRE(inside.at(0) == 0);
+    inside.clear();
+
+    test.UpdateGeofencePoint({ 6.721186, -179.28955, 0.0, 0.0, 0 }); // Near dateline in Pacific
+    test.loop();
+    REQUIRE(inside.size() == 1);
+    REQUIRE(inside.at(0) == 2);
+    inside.clear();
+
+    test.UpdateGeofencePoint({ -3.072765, -59.99389, 0.0, 0.0, 0 }); // Manuas Brazil
+    test.loop();
+    REQUIRE(inside.size() == 1);
+    REQUIRE(inside.at(0) == 3);
+}